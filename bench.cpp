@@ -0,0 +1,256 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+/*  Micro benchmark of the hash kernels.
+    Measures the throughput of every hash implementation on in-memory buffers
+    of different sizes, and the gethash-like file hashing with different
+    read buffer sizes on cold and warm cache.
+
+    Usage: unisync_bench [FILE]...
+      (Without files a temporary 256 Mbyte test file is created) */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include "unisync.h"
+#include "utils.h"
+
+#define BENCH_MINTIME   0.5
+
+struct BenchResult
+{
+    double seconds;
+    double bytes;
+    double cycles;
+};
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static unsigned long long cycles(void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static const char *hashname(int hashmode)
+{
+    if(hashmode == HASH_MD5)
+        return "md5";
+    return "sha256";
+}
+
+static void printresult(const char *name,const char *param,struct BenchResult *r)
+{
+    double mbs = 0.0;
+    if(r->seconds > 0)
+        mbs = r->bytes / (1024*1024) / r->seconds;
+    if(r->cycles > 0)
+        printf("%-8s %-24s %10.2f MB/s %8.2f cycles/byte\n",name,param,mbs,r->cycles / r->bytes);
+    else
+        printf("%-8s %-24s %10.2f MB/s\n",name,param,mbs);
+    fflush(stdout);
+}
+
+/* Feeds the hasher with the same buffer again and again for at least BENCH_MINTIME seconds */
+static void bench_memory(int hashmode,unsigned int buffsize)
+{
+    char hexhash[80];
+    char param[64];
+    struct BenchResult r;
+    unsigned char *buff = new unsigned char[buffsize];
+    for(unsigned int i = 0 ; i < buffsize ; ++i)
+        buff[i] = (unsigned char)(i * 131 + 7);
+
+    r.bytes = 0;
+    Hasher hasher(hashmode);
+    double ts = now();
+    unsigned long long cs = cycles();
+    do
+    {
+        for(int rep = 0 ; rep < 64 ; ++rep)
+            hasher.update(buff,buffsize);
+        r.bytes += 64.0 * buffsize;
+        r.seconds = now() - ts;
+    }
+    while(r.seconds < BENCH_MINTIME);
+    r.cycles = (double)(cycles() - cs);
+    hasher.final(hexhash,0);
+
+    snprintf(param,64,"memory %u byte",buffsize);
+    printresult(hashname(hashmode),param,&r);
+    delete[] buff;
+}
+
+static int dropcache(const char *path)
+{
+    int fd = open(path,O_RDONLY);
+    if(fd < 0)
+        return 1;
+    fdatasync(fd);
+    posix_fadvise(fd,0,0,POSIX_FADV_DONTNEED);
+    close(fd);
+    return 0;
+}
+
+/* Hashes the file the way gethash does, but with the given read buffer size */
+static int bench_file(const char *path,int hashmode,unsigned int buffsize,bool cold)
+{
+    char hexhash[80];
+    char param[64];
+    struct BenchResult r;
+    FILE *f;
+    size_t n;
+
+    if(cold)
+        dropcache(path);
+    else
+        gethash(path,hexhash,hashmode); //makes the cache warm
+
+    unsigned char *buff = new unsigned char[buffsize];
+    r.bytes = 0;
+    double ts = now();
+    unsigned long long cs = cycles();
+    if((f = fopen(path,"rb")) == NULL)
+    {
+        delete[] buff;
+        return 1;
+    }
+    setvbuf(f,NULL,_IONBF,0);
+    Hasher hasher(hashmode);
+    while((n = fread(buff,1,buffsize,f)) > 0)
+    {
+        hasher.update(buff,n);
+        r.bytes += n;
+    }
+    hasher.final(hexhash,0);
+    fclose(f);
+    r.seconds = now() - ts;
+    r.cycles = (double)(cycles() - cs);
+
+    snprintf(param,64,"%s file %u byte",cold ? "cold" : "warm",buffsize);
+    printresult(hashname(hashmode),param,&r);
+    delete[] buff;
+    return 0;
+}
+
+/* Measures the gethash() itself as it is used by the scanner */
+static int bench_gethash(const char *path,int hashmode)
+{
+    char hexhash[80];
+    struct BenchResult r;
+    struct stat st;
+
+    if(stat(path,&st) != 0)
+        return 1;
+    gethash(path,hexhash,hashmode);
+    double ts = now();
+    unsigned long long cs = cycles();
+    if(gethash(path,hexhash,hashmode))
+        return 1;
+    r.seconds = now() - ts;
+    r.cycles = (double)(cycles() - cs);
+    r.bytes = (double)st.st_size;
+    printresult(hashname(hashmode),"warm gethash()",&r);
+    return 0;
+}
+
+static int maketestfile(char *path)
+{
+    strcpy(path,"/tmp/unisync_bench_XXXXXX");
+    int fd = mkstemp(path);
+    if(fd < 0)
+        return 1;
+    unsigned char *buff = new unsigned char[COPY_BUFFSIZE];
+    unsigned int x = 12345;
+    for(int b = 0 ; b < (256*1024*1024) / COPY_BUFFSIZE ; ++b)
+    {
+        for(int i = 0 ; i < COPY_BUFFSIZE ; ++i)
+        {
+            x = x * 1103515245 + 12345;
+            buff[i] = (unsigned char)(x >> 16);
+        }
+        if(write(fd,buff,COPY_BUFFSIZE) != COPY_BUFFSIZE)
+        {
+            delete[] buff;
+            close(fd);
+            return 1;
+        }
+    }
+    delete[] buff;
+    close(fd);
+    return 0;
+}
+
+int main(int argi,char **argc)
+{
+    int hashmodes[2] = { HASH_MD5 , HASH_SHA256 };
+    unsigned int memsizes[5] = { 64 , 4096 , 65536 , 1024*1024 , 16*1024*1024 };
+    unsigned int filebuffs[5] = { 4096 , 8192 , 65536 , 262144 , 1024*1024 };
+    char tmpfile[64];
+    int h,i,f;
+
+    printf("%s hash benchmark\n",PROGRAMNAME);
+#ifndef HAVE_RDTSC
+    printf("(cycles/byte is not available on this platform)\n");
+#endif
+    for(h = 0 ; h < 2 ; ++h)
+        for(i = 0 ; i < 5 ; ++i)
+            bench_memory(hashmodes[h],memsizes[i]);
+
+    tmpfile[0] = '\0';
+    if(argi < 2)
+    {
+        if(maketestfile(tmpfile))
+        {
+            fprintf(stderr,"Error, cannot create test file in /tmp\n");
+            return 1;
+        }
+    }
+
+    for(f = 1 ; f < argi || (f == 1 && tmpfile[0] != '\0') ; ++f)
+    {
+        const char *path = tmpfile[0] != '\0' ? tmpfile : argc[f];
+        printf("File: %s\n",path);
+        for(h = 0 ; h < 2 ; ++h)
+        {
+            if(bench_gethash(path,hashmodes[h]))
+            {
+                fprintf(stderr,"Error, cannot read file: %s\n",path);
+                break;
+            }
+            for(i = 0 ; i < 5 ; ++i)
+            {
+                bench_file(path,hashmodes[h],filebuffs[i],true);
+                bench_file(path,hashmodes[h],filebuffs[i],false);
+            }
+        }
+    }
+
+    if(tmpfile[0] != '\0')
+        unlink(tmpfile);
+    return 0;
+}
+
+/* end code */
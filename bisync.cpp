@@ -0,0 +1,520 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <thread>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "unisync.h"
+#include "utils.h"
+#include "catalog.h"
+#include "syncplan.h"
+#include "bisync.h"
+
+static const char *state_names[] = { "missing" , "unchanged" , "new" , "modified" , "deleted" };
+
+static bool changed(int state)
+{
+    return state == BISYNC_NEW || state == BISYNC_MODIFIED || state == BISYNC_DELETED;
+}
+
+static bool present(int state)
+{
+    return state == BISYNC_UNCHANGED || state == BISYNC_NEW || state == BISYNC_MODIFIED;
+}
+
+/* The folder of the path, empty string on the top level */
+static void parentpath(const char *path,char *parent)
+{
+    int i;
+    if(parent != path)
+        strcpy(parent,path);
+    for(i = strlen(parent) - 1 ; i >= 0 && parent[i] != '/' && parent[i] != '\\' ; --i);
+    parent[i < 0 ? 0 : i] = '\0';
+}
+
+ThreeWaySync::ThreeWaySync(UniSyncConfig *ucp,const char *left_bp,const char *right_bp)
+{
+    uc = ucp;
+    folders[BISYNC_LEFT] = left_bp;
+    folders[BISYNC_RIGHT] = right_bp;
+    for(int s = 0 ; s < 2 ; ++s)
+    {
+        sides[s] = new UniCatalog(uc);
+        //The unchanged files are kept: they are in the new base, and they tell the unchanged from the missing
+        sides[s]->setKeepMatched(true);
+        files[s] = new HashIndex();
+        dirs[s] = new HashIndex();
+        needed[s] = new HashIndex();
+        entries[s] = NULL;
+        diffresult[s] = 0;
+        copies[s] = deletes[s] = mkdirs[s] = rmdirs[s] = 0;
+    }
+    base = baselast = NULL;
+    items = NULL;
+    plan = NULL;
+    agreed = conflictcount = 0;
+}
+
+ThreeWaySync::~ThreeWaySync(void)
+{
+    struct BiSyncEntry *e;
+    struct BiSyncBase *b;
+    struct cItem *item;
+
+    for(int s = 0 ; s < 2 ; ++s)
+    {
+        while(entries[s] != NULL)
+        {
+            e = entries[s];
+            entries[s] = e->n;
+            delete e;
+        }
+        delete needed[s];
+        delete dirs[s];
+        delete files[s];
+        delete sides[s];
+    }
+    while(base != NULL)
+    {
+        b = base;
+        base = b->n;
+        delete b;
+    }
+    while(items != NULL)
+    {
+        item = items;
+        items = item->n;
+        delete item;
+    }
+}
+
+/* Reads the base catalog to both sides. A missing catalog is the first sync: everything is new */
+int ThreeWaySync::read_base(const char *catalogfile)
+{
+    struct stat st;
+
+    if(stat(catalogfile,&st) != 0)
+    {
+        if(uc->verbose > 0)
+        {
+            printf("The base catalog does not exist, the folders are merged\n");
+            if(uc->guicall)
+                fflush(stdout);
+        }
+        return 0;
+    }
+    if(sides[BISYNC_LEFT]->read(catalogfile))
+        return 1;
+    sides[BISYNC_RIGHT]->copy_from(sides[BISYNC_LEFT]);
+    //The new files are hashed as the base was
+    if(uc->hashmode == HASH_EMPTY)
+        for(struct cItem *r = sides[BISYNC_LEFT]->cat_file ; r != NULL && uc->hashmode == HASH_EMPTY ; r = r->n)
+            uc->hashmode = r->htype;
+    return 0;
+}
+
+void ThreeWaySync::diff_side(int s)
+{
+    diffresult[s] = sides[s]->scandir_diff(folders[s]);
+}
+
+/* Diffs the two folders to the base on parallel threads, then indexes the states */
+int ThreeWaySync::diff(void)
+{
+    std::thread left(&ThreeWaySync::diff_side,this,BISYNC_LEFT);
+    diff_side(BISYNC_RIGHT);
+    left.join();
+    if(diffresult[BISYNC_LEFT] || diffresult[BISYNC_RIGHT])
+        return 1;
+    index_side(BISYNC_LEFT);
+    index_side(BISYNC_RIGHT);
+    return 0;
+}
+
+void ThreeWaySync::index_side(int s)
+{
+    struct cItem *r;
+    struct BiSyncEntry *e,*last = NULL;
+    UniCatalog *c = sides[s];
+    struct cItem *lists[8] = { c->cat_file_ok , c->cat_file_new , c->cat_file_mod , c->cat_file_fixtime , c->cat_file ,
+                               c->cat_dir_ok , c->cat_dir_new , c->cat_dir };
+    int states[8] = { BISYNC_UNCHANGED , BISYNC_NEW , BISYNC_MODIFIED , BISYNC_MODIFIED , BISYNC_DELETED ,
+                      BISYNC_UNCHANGED , BISYNC_NEW , BISYNC_DELETED };
+
+    for(int l = 0 ; l < 8 ; ++l)
+        for(r = lists[l] ; r != NULL ; r = r->n)
+        {
+            e = new BiSyncEntry();
+            e->state = states[l];
+            e->item = r;
+            e->n = NULL;
+            if(last == NULL)
+                entries[s] = e;
+            else
+                last->n = e;
+            last = e;
+            (l < 5 ? files[s] : dirs[s])->add(r->pathname,e);
+        }
+}
+
+int ThreeWaySync::state(HashIndex *index,const char *path)
+{
+    struct BiSyncEntry *e = (struct BiSyncEntry *)index->find(path);
+    return e == NULL ? BISYNC_ABSENT : e->state;
+}
+
+/* The file is on the side after the sync (it is not deleted by the other side's delete) */
+bool ThreeWaySync::file_stays(int s,const char *path)
+{
+    int st = state(files[s],path);
+    return present(st) && !(st == BISYNC_UNCHANGED && state(files[1-s],path) == BISYNC_DELETED);
+}
+
+/* Something which stays on the side is in the way of the file: a folder with the same name or a file in place of a folder */
+bool ThreeWaySync::clash(int s,const char *path)
+{
+    char parent[300];
+    int st = state(dirs[s],path);
+
+    if(present(st) && !(st == BISYNC_UNCHANGED && state(dirs[1-s],path) == BISYNC_DELETED))
+        return true;
+    parentpath(path,parent);
+    while(parent[0] != '\0')
+    {
+        if(file_stays(s,parent))
+            return true;
+        parentpath(parent,parent);
+    }
+    return false;
+}
+
+/* Something stays in these folders on the side, they are not deleted (or they are created) */
+void ThreeWaySync::keep_parents(int s,const char *path)
+{
+    char parent[300];
+
+    strncpy(parent,path,299);
+    parent[299] = '\0';
+    parentpath(parent,parent);
+    while(parent[0] != '\0' && needed[s]->find(parent) == NULL)
+    {
+        needed[s]->add(parent,this);
+        parentpath(parent,parent);
+    }
+}
+
+struct cItem *ThreeWaySync::new_item(const char *path)
+{
+    struct cItem *item = new cItem();
+    item->status = STATUS_NULL;
+    item->size = 0;
+    item->htype = HASH_EMPTY;
+    //The paths come from the catalog items, so they fit
+    snprintf(item->pathname,sizeof(item->pathname),"%s",path);
+    item->n = items;
+    items = item;
+    return item;
+}
+
+/* The item of the file as it is on the side now: the new files are known by the diff, the modified ones are read */
+struct cItem *ThreeWaySync::current(int s,struct BiSyncEntry *e)
+{
+    char fullpath[512];
+    char strbuf[32];
+    struct stat st;
+    struct cItem *item;
+
+    if(e->state == BISYNC_NEW)
+        return e->item;
+    snprintf(fullpath,512,"%s/%s",folders[s],wods(e->item->pathname));
+    if(stat(fullpath,&st) != 0)
+        return NULL;
+    item = new_item(e->item->pathname);
+    item->size = (unsigned long long)st.st_size;
+    time_to_str(&st.st_mtime,strbuf);
+    strcpy(item->time,strbuf);
+    return item;
+}
+
+void ThreeWaySync::base_add(struct cItem *item,bool isdir,int statside)
+{
+    struct BiSyncBase *b = new BiSyncBase();
+    b->item = item;
+    b->isdir = isdir;
+    b->statside = statside;
+    b->n = NULL;
+    if(baselast == NULL)
+        base = b;
+    else
+        baselast->n = b;
+    baselast = b;
+}
+
+/* The operation is executed on side s (the other side is its source) */
+void ThreeWaySync::operation(int type,int s,const char *path,struct cItem *item)
+{
+    struct SyncOp *op = plan->add(type,path,NULL,item);
+    op->target = s;
+}
+
+/* The conflicts are always printed, they are left as is */
+void ThreeWaySync::conflict(const char *path,const int *st,bool isdir,bool inway)
+{
+    ++conflictcount;
+    if(inway)
+        printf("Conflict: %s (a file and a folder with the same name)\n",path);
+    else
+        printf("Conflict: %s%s (left: %s, right: %s)\n",path,isdir ? "/" : "",
+                    state_names[st[BISYNC_LEFT]],state_names[st[BISYNC_RIGHT]]);
+    if(uc->guicall)
+        fflush(stdout);
+}
+
+void ThreeWaySync::decide_file(const char *path)
+{
+    struct BiSyncEntry *e[2];
+    struct cItem *a,*b,*item;
+    int st[2],s,t;
+
+    for(s = 0 ; s < 2 ; ++s)
+    {
+        e[s] = (struct BiSyncEntry *)files[s]->find(path);
+        st[s] = e[s] == NULL ? BISYNC_ABSENT : e[s]->state;
+    }
+
+    //Changed on one side: synced to the other
+    if(changed(st[BISYNC_LEFT]) != changed(st[BISYNC_RIGHT]))
+    {
+        s = changed(st[BISYNC_LEFT]) ? BISYNC_LEFT : BISYNC_RIGHT;
+        t = 1 - s;
+        if(st[s] == BISYNC_DELETED)
+        {
+            operation(OP_DELFILE,t,path,NULL);
+            ++deletes[t];
+            return;
+        }
+        if(clash(t,path))
+        {
+            conflict(path,st,false,true);
+            keep_parents(s,path);
+            if(file_stays(t,path))
+                keep_parents(t,path);
+            if(st[s] == BISYNC_MODIFIED)
+                base_add(e[s]->item,false,-1);
+            return;
+        }
+        //The hash of the new base is computed while copying
+        item = new_item(path);
+        operation(OP_COPY,t,path,item);
+        base_add(item,false,t);
+        keep_parents(BISYNC_LEFT,path);
+        keep_parents(BISYNC_RIGHT,path);
+        ++copies[t];
+        return;
+    }
+
+    if(!changed(st[BISYNC_LEFT]))
+    {
+        base_add(e[BISYNC_LEFT]->item,false,-1);
+        keep_parents(BISYNC_LEFT,path);
+        keep_parents(BISYNC_RIGHT,path);
+        return;
+    }
+    if(st[BISYNC_LEFT] == BISYNC_DELETED && st[BISYNC_RIGHT] == BISYNC_DELETED)
+        return;
+
+    //Changed on both sides: no conflict if the sides became the same
+    if(present(st[BISYNC_LEFT]) && present(st[BISYNC_RIGHT]))
+    {
+        a = current(BISYNC_LEFT,e[BISYNC_LEFT]);
+        b = current(BISYNC_RIGHT,e[BISYNC_RIGHT]);
+        if(a != NULL && b != NULL && a->size == b->size &&
+           sides[BISYNC_LEFT]->same_content(a,folders[BISYNC_LEFT],b,folders[BISYNC_RIGHT]))
+        {
+            if(strcmp(a->time,b->time))
+                operation(OP_FIXTIME,BISYNC_RIGHT,path,NULL);
+            //Hashed for the compare only
+            if(uc->hashmode == HASH_EMPTY)
+                a->htype = HASH_EMPTY;
+            base_add(a,false,-1);
+            keep_parents(BISYNC_LEFT,path);
+            keep_parents(BISYNC_RIGHT,path);
+            ++agreed;
+            return;
+        }
+    }
+    conflict(path,st,false,false);
+    for(s = 0 ; s < 2 ; ++s)
+        if(present(st[s]))
+            keep_parents(s,path);
+    //The base keeps the old state, the conflict is reported until it is resolved
+    if(st[BISYNC_LEFT] != BISYNC_NEW && st[BISYNC_RIGHT] != BISYNC_NEW)
+        base_add(e[BISYNC_LEFT]->item,false,-1);
+}
+
+void ThreeWaySync::decide_dir(const char *path)
+{
+    struct BiSyncEntry *e[2];
+    int st[2],s,o;
+    bool after[2];
+
+    for(s = 0 ; s < 2 ; ++s)
+    {
+        e[s] = (struct BiSyncEntry *)dirs[s]->find(path);
+        st[s] = e[s] == NULL ? BISYNC_ABSENT : e[s]->state;
+    }
+    for(s = 0 ; s < 2 ; ++s)
+    {
+        o = 1 - s;
+        after[s] = false;
+        if(present(st[s]))
+        {
+            //Deleted on the other side: removed if nothing stays in it
+            if(st[s] == BISYNC_UNCHANGED && st[o] == BISYNC_DELETED && needed[s]->find(path) == NULL)
+            {
+                operation(OP_RMDIR,s,path,NULL);
+                ++rmdirs[s];
+            }
+            else
+                after[s] = true;
+        }
+        else if(st[o] == BISYNC_NEW || needed[s]->find(path) != NULL)
+        {
+            if(file_stays(s,path))
+            {
+                conflict(path,st,true,true);
+                continue;
+            }
+            operation(OP_MKDIR,s,path,NULL);
+            ++mkdirs[s];
+            after[s] = true;
+        }
+    }
+    //A folder of the base which stays on one side only is kept in the base
+    if((after[BISYNC_LEFT] && after[BISYNC_RIGHT]) ||
+       ((after[BISYNC_LEFT] || after[BISYNC_RIGHT]) && (st[BISYNC_LEFT] == BISYNC_UNCHANGED || st[BISYNC_LEFT] == BISYNC_DELETED)))
+        base_add(e[BISYNC_LEFT] != NULL ? e[BISYNC_LEFT]->item : e[BISYNC_RIGHT]->item,true,-1);
+}
+
+/* Classifies every changed path and adds the operations of both directions to the plan.
+   The plan's targets are the left (0) and the right (1) folder, each reads the other */
+void ThreeWaySync::build_sync_plan(SyncPlan *syncplan)
+{
+    struct BiSyncEntry *e;
+    int s;
+
+    plan = syncplan;
+    plan->settarget(folders[BISYNC_LEFT],folders[BISYNC_RIGHT]);
+    plan->settarget(folders[BISYNC_RIGHT],folders[BISYNC_LEFT]);
+
+    //The files first: the folders are not deleted while something stays in them
+    for(s = 0 ; s < 2 ; ++s)
+        for(e = entries[s] ; e != NULL ; e = e->n)
+            if(files[s]->find(e->item->pathname) == e && (s == BISYNC_LEFT || files[BISYNC_LEFT]->find(e->item->pathname) == NULL))
+                decide_file(e->item->pathname);
+    for(s = 0 ; s < 2 ; ++s)
+        for(e = entries[s] ; e != NULL ; e = e->n)
+            if(e->state == BISYNC_NEW && dirs[s]->find(e->item->pathname) == e)
+            {
+                keep_parents(BISYNC_LEFT,e->item->pathname);
+                keep_parents(BISYNC_RIGHT,e->item->pathname);
+            }
+    for(s = 0 ; s < 2 ; ++s)
+        for(e = entries[s] ; e != NULL ; e = e->n)
+            if(dirs[s]->find(e->item->pathname) == e && (s == BISYNC_LEFT || dirs[BISYNC_LEFT]->find(e->item->pathname) == NULL))
+                decide_dir(e->item->pathname);
+}
+
+void ThreeWaySync::print_sync_procedures(void)
+{
+    printf("-------------------------\nRequired actions to sync:\n");
+    for(int s = 0 ; s < 2 ; ++s)
+    {
+        if(deletes[s] > 0)
+            printf(" DELETE FILES: %d file(s) -> \"%s\"\n",deletes[s],folders[s]);
+        if(rmdirs[s] > 0)
+            printf(" DELETE FOLDERS: %d folder(s) -> \"%s\"\n",rmdirs[s],folders[s]);
+        if(mkdirs[s] > 0)
+            printf(" CREATE FOLDERS: %d folder(s) -> \"%s\"\n",mkdirs[s],folders[s]);
+        if(copies[s] > 0)
+            printf(" COPY FILES: \"%s\" -> %d file(s) -> \"%s\"\n",folders[1-s],copies[s],folders[s]);
+    }
+    if(agreed > 0)
+        printf(" SAME CHANGES: %d file(s) are changed on both sides to the same content\n",agreed);
+    printf(" CONFLICTS: %d (left as is)\n",conflictcount);
+    printf("-------------------------\n");
+    if(uc->guicall)
+        fflush(stdout);
+}
+
+/* Writes the new base catalog after the sync. It is written to a temporary file and renamed,
+   an interrupted write leaves the old base */
+int ThreeWaySync::write_base(const char *catalogfile)
+{
+    char tmpname[512];
+    char fullpath[512];
+    char strbuf[32];
+    struct stat st;
+    struct BiSyncBase *b;
+    FILE *catf;
+
+    snprintf(tmpname,512,"%s.tmp",catalogfile);
+    if((catf = fopen(tmpname,"w")) == NULL)
+    {
+        fprintf(stderr,"Error, Cannot open catalog file for writing: %s\n",tmpname);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+    for(b = base ; b != NULL ; b = b->n)
+        if(b->isdir)
+            sides[BISYNC_LEFT]->write_catalog_item(catf,b->item,true);
+    for(b = base ; b != NULL ; b = b->n)
+    {
+        if(b->isdir)
+            continue;
+        //The copied files: the state of the target (the copy keeps the modification time)
+        if(b->statside >= 0)
+        {
+            snprintf(fullpath,512,"%s/%s",folders[b->statside],wods(b->item->pathname));
+            if(stat(fullpath,&st) != 0)
+                continue;
+            b->item->size = (unsigned long long)st.st_size;
+            time_to_str(&st.st_mtime,strbuf);
+            strcpy(b->item->time,strbuf);
+        }
+        sides[BISYNC_LEFT]->write_catalog_item(catf,b->item,false);
+    }
+    if(fclose(catf) != 0)
+    {
+        fprintf(stderr,"Error, Cannot write catalog file: %s\n",tmpname);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+#ifdef _WIN32
+    unlink(catalogfile);
+#endif
+    if(rename(tmpname,catalogfile) != 0)
+    {
+        fprintf(stderr,"Error, Cannot write catalog file: %s\n",catalogfile);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+    return 0;
+}
+
+/* end code */
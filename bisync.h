@@ -0,0 +1,95 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+#ifndef UNISYNC_BISYNC_H
+#define UNISYNC_BISYNC_H
+
+#include "unisync.h"
+#include "utils.h"
+#include "catalog.h"
+
+class SyncPlan;
+
+#define BISYNC_LEFT         0
+#define BISYNC_RIGHT        1
+
+/* The state of a path on one side, compared to the base catalog */
+#define BISYNC_ABSENT       0   //Not in the base and not on the side
+#define BISYNC_UNCHANGED    1
+#define BISYNC_NEW          2
+#define BISYNC_MODIFIED     3
+#define BISYNC_DELETED      4
+
+struct BiSyncEntry
+{
+    int state;
+    struct cItem *item;         //The item of the diff (the base item if the path is in the base)
+    struct BiSyncEntry *n;
+};
+
+/* An item of the new base catalog */
+struct BiSyncBase
+{
+    struct cItem *item;
+    bool isdir;
+    int statside;               //The size and time are read from this side after the sync, -1: the item has them
+    struct BiSyncBase *n;
+};
+
+/* Three-way bidirectional sync (bisync). Both folders are diffed against the base catalog (the last agreed
+   state) on parallel threads, and every path is classified: changed on the left only, on the right only,
+   or on both sides. The one sided changes are synced to the other side (copy, delete, mkdir, rmdir),
+   the operations of both directions run as one sync plan. A path changed on both sides is a conflict
+   (unless the content became the same), it is reported and left as is, the base keeps its old state.
+   A folder is not deleted while something stays in it on that side.
+   After the sync the new base catalog is written from the known states, without scanning again. */
+class ThreeWaySync
+{
+public:
+    ThreeWaySync(UniSyncConfig *ucp,const char *left_bp,const char *right_bp);
+    ~ThreeWaySync(void);
+
+    int  read_base(const char *catalogfile);
+    int  diff(void);
+    void build_sync_plan(SyncPlan *plan);
+    void print_sync_procedures(void);
+    int  write_base(const char *catalogfile);
+    int  conflicts(void) { return conflictcount; }
+
+private:
+    UniSyncConfig *uc;
+    const char *folders[2];
+    UniCatalog *sides[2];
+    HashIndex *files[2];
+    HashIndex *dirs[2];
+    HashIndex *needed[2];       //The folders which have to exist on the side after the sync
+    struct BiSyncEntry *entries[2];
+    struct BiSyncBase *base,*baselast;
+    struct cItem *items;        //The items created by the classification
+    SyncPlan *plan;
+    int diffresult[2];
+
+    int copies[2],deletes[2],mkdirs[2],rmdirs[2];
+    int agreed,conflictcount;
+
+    void diff_side(int s);
+    void index_side(int s);
+    int  state(HashIndex *index,const char *path);
+    bool file_stays(int s,const char *path);
+    bool clash(int s,const char *path);
+    void keep_parents(int s,const char *path);
+    struct cItem *new_item(const char *path);
+    struct cItem *current(int s,struct BiSyncEntry *e);
+    void base_add(struct cItem *item,bool isdir,int statside);
+    void operation(int type,int s,const char *path,struct cItem *item);
+    void conflict(const char *path,const int *st,bool isdir,bool inway);
+    void decide_file(const char *path);
+    void decide_dir(const char *path);
+};
+
+#endif // UNISYNC_BISYNC_H
@@ -25,11 +25,21 @@
 #include "unisync.h"
 #include "catalog.h"
 #include "utils.h"
+#include "scheduler.h"
+#include "syncplan.h"
+#include "subtree.h"
+#include "throttle.h"
+#include "journal.h"
 
 void time_to_str(const time_t * t,char *buffer) //need >32 byte char buffer
 {
     struct tm * timeinfo;
+#ifdef _WIN32
     timeinfo = localtime(t);
+#else
+    struct tm tmbuf;
+    timeinfo = localtime_r(t,&tmbuf); //The folders can be scanned on parallel threads (bisync)
+#endif
     if(timeinfo == NULL)
     {
         snprintf(buffer,32,"2000-01-01_00:00:00");
@@ -72,10 +82,23 @@ UniCatalog::UniCatalog(UniSyncConfig *ucp)
     cat_file_mod     = NULL;
     cat_file_new     = NULL;
     cat_file_fixtime = NULL;
+    cat_file_moved   = NULL;
     cat_dir          = NULL;
     cat_dir_ok       = NULL;
     cat_dir_mod      = NULL;
     cat_dir_new      = NULL;
+    keep_matched     = false;
+    chunkindex       = NULL;
+    chunkfiles       = NULL;
+    chunkrefs        = NULL;
+    origin[0]        = '\0';
+}
+
+/* Keep the matched file items in cat_file_ok instead of drop them,
+   so the full catalog of the synced destination can be written. */
+void UniCatalog::setKeepMatched(bool keep)
+{
+    keep_matched = keep;
 }
 
 UniCatalog::~UniCatalog(void)
@@ -102,6 +125,9 @@ int UniCatalog::read(const char *filename)
 {
     int i;
     char *tok,buffer[1024];
+    struct cItem *lastfile = NULL;
+    struct ChunkFile *lastchunkfile = NULL;
+    unsigned int blockalloc = 0;
 
     if(uc->verbose > 0)
     {
@@ -136,7 +162,7 @@ int UniCatalog::read(const char *filename)
                         if(i == 2)
                             strcpy(item->time,tok);
                         if(i == 3)
-                            item->size = atoi(tok);
+                            item->size = strtoull(tok,NULL,10);
                         if(i > 3)
                         {
                             if(!strncmp(tok,"MD5:",4))
@@ -149,12 +175,90 @@ int UniCatalog::read(const char *filename)
                                 item->htype = HASH_SHA256;
                                 strcpy(item->hash,tok+5);
                             }
+                            if(!strncmp(tok,"FP:",3))
+                                strcpy(item->fprint,tok+3);
+                            if(!strncmp(tok,"BS:",3))
+                                item->blocksize = strtoul(tok+3,NULL,10);
+                            if(!strncmp(tok,"I:",2))
+                                sscanf(tok+2,"%llu:%llu:%u",&item->dev,&item->ino,&item->nlink);
                         }
                         ++i;
                         tok = strtok(NULL,"*");
                     }
 
                     catalog_push(&cat_file,item);
+                    lastfile = item;
+                    lastchunkfile = NULL;
+                    blockalloc = 0;
+                }
+                if(buffer[0] == 'O')
+                {
+                    //The scanned folder of a -moves catalog: O*origin*
+                    tok = strtok(buffer,"*");
+                    if((tok = strtok(NULL,"*")) != NULL && strlen(tok) < sizeof(origin))
+                        strcpy(origin,tok);
+                }
+                if(buffer[0] == 'K')
+                {
+                    //Chunking parameters of the catalog: K*min*avg*max*
+                    unsigned int cp[3];
+                    tok = strtok(buffer,"*");
+                    for(i = 0 ; i < 3 && (tok = strtok(NULL,"*")) != NULL ; ++i)
+                        cp[i] = strtoul(tok,NULL,10);
+                    if(i == 3 && cp[0] > 0 && cp[0] < cp[1] && cp[1] < cp[2])
+                    {
+                        uc->chunking = 1;
+                        uc->chunkmin = cp[0];
+                        uc->chunkavg = cp[1];
+                        uc->chunkmax = cp[2];
+                    }
+                }
+                if(buffer[0] == 'C' && lastfile != NULL)
+                {
+                    //Chunk of the previous file: C*offset*length*hash*
+                    struct ChunkInfo ci;
+                    char *ctok[3];
+                    tok = strtok(buffer,"*");
+                    for(i = 0 ; i < 3 && (tok = strtok(NULL,"*")) != NULL ; ++i)
+                        ctok[i] = tok;
+                    if(i == 3)
+                    {
+                        ci.offset = strtoull(ctok[0],NULL,10);
+                        ci.length = strtoul(ctok[1],NULL,10);
+                        strncpy(ci.hash,ctok[2],79);
+                        ci.hash[79] = '\0';
+                        if(lastchunkfile == NULL)
+                            lastchunkfile = chunkfile_new(lastfile->pathname);
+                        chunk_add(chunkindex,lastchunkfile,&ci);
+                    }
+                }
+                if(buffer[0] == 'B' && lastfile != NULL && lastfile->blocksize > 0)
+                {
+                    //Block hash list of the previous file: B*index*hash*
+                    unsigned int idx;
+                    tok = strtok(buffer,"*");
+                    tok = strtok(NULL,"*");
+                    if(tok != NULL)
+                    {
+                        idx = strtoul(tok,NULL,10);
+                        tok = strtok(NULL,"*");
+                    }
+                    if(tok != NULL && idx == lastfile->blockcount)
+                    {
+                        if(lastfile->blockcount == blockalloc)
+                        {
+                            unsigned int needed = (unsigned int)((lastfile->size + lastfile->blocksize - 1) / lastfile->blocksize);
+                            blockalloc = needed > blockalloc ? needed : blockalloc * 2 + 16;
+                            char *nb = new char[blockalloc * BLOCKHASH_WIDTH];
+                            if(lastfile->blockhashes != NULL)
+                                memcpy(nb,lastfile->blockhashes,lastfile->blockcount * BLOCKHASH_WIDTH);
+                            delete[] lastfile->blockhashes;
+                            lastfile->blockhashes = nb;
+                        }
+                        strncpy(lastfile->blockhashes + idx * BLOCKHASH_WIDTH,tok,BLOCKHASH_WIDTH-1);
+                        lastfile->blockhashes[idx * BLOCKHASH_WIDTH + BLOCKHASH_WIDTH - 1] = '\0';
+                        ++lastfile->blockcount;
+                    }
                 }
                 if(buffer[0] == 'D')
                 {
@@ -234,11 +338,36 @@ void UniCatalog::createFullPath(char *fullpath,const char *basedir,const char *p
     }
 }
 
+/* The identity of the scanned folder: the host, and the device and inode of the folder.
+   The inodes of a catalog can be compared to a new scan only if it has the same origin. */
+static int folder_origin(const char *bp,char *origin)
+{
+#ifdef _WIN32
+    (void)bp;
+    origin[0] = '\0';
+    return 1;
+#else
+    char host[64];
+    struct stat st;
+    if(gethostname(host,sizeof(host)) != 0 || stat(bp,&st) != 0)
+        return 1;
+    host[sizeof(host) - 1] = '\0';
+    if(strchr(host,'*') != NULL)
+        return 1;
+    snprintf(origin,128,"%s:%llu:%llu",host,(unsigned long long)st.st_dev,(unsigned long long)st.st_ino);
+    return 0;
+#endif
+}
+
 int UniCatalog::scandir(const char *basedir,FILE *catstream,bool build_icat)
 {
     int r;
     sizec = 0.0;
     ts = time(NULL);
+    if(catstream != NULL && uc->chunking)
+        fprintf(catstream,"K*%u*%u*%u*\n",uc->chunkmin,uc->chunkavg,uc->chunkmax);
+    if(catstream != NULL && uc->moves && folder_origin(basedir,origin) == 0)
+        fprintf(catstream,"O*%s*\n",origin);
 #ifdef _WIN32
     if(uc->usestd)
         r = scandir_in(basedir,"",catstream,build_icat);
@@ -269,9 +398,96 @@ void UniCatalog::printStatistics(const char *funcname)
         fflush(stdout);
 }
 
+void UniCatalog::write_catalog_item(FILE *catstream,struct cItem *item,bool isdir)
+{
+    char sizestrbuf[32];
+
+    if(isdir)
+    {
+        fprintf(catstream,"D*%s*%s*\n",item->pathname,item->time);
+        return;
+    }
+    snprintf(sizestrbuf,32,"%llu",item->size);
+    fprintf(catstream,"F*%s*%s*%s*",item->pathname,item->time,sizestrbuf);
+    if(item->htype == HASH_MD5)
+        fprintf(catstream,"MD5:%s",item->hash);
+    if(item->htype == HASH_SHA256)
+        fprintf(catstream,"SHA2:%s",item->hash);
+    fputs("*",catstream);
+    if(item->fprint[0] != '\0')
+        fprintf(catstream,"FP:%s*",item->fprint);
+    if(item->blockhashes != NULL)
+        fprintf(catstream,"BS:%u*",item->blocksize);
+    fputs("\n",catstream);
+    if(item->blockhashes != NULL)
+        write_block_hashes(catstream,item->blocksize,item->blockcount,item->blockhashes);
+}
+
+void UniCatalog::write_block_hashes(FILE *catstream,unsigned int blocksize,unsigned int blockcount,const char *blockhashes)
+{
+    unsigned int b;
+    for(b = 0 ; b < blockcount ; ++b)
+        fprintf(catstream,"B*%u*%s*\n",b,blockhashes + b * BLOCKHASH_WIDTH);
+}
+
+/* Hash the blocks of the file and mark the changed ones in item->blockdiff.
+   Sets the item's status according to the full hash computed in the same pass. */
+void UniCatalog::compare_block_hashes(struct cItem *item,const char *fullpath)
+{
+    char hexhash[80];
+    char *blocks;
+    unsigned int count,b;
+
+    if(getblockhashes(fullpath,hexhash,item->htype,item->blocksize,&blocks,&count,0))
+    {
+        item->status = STATUS_HASHDIFF;
+        return;
+    }
+    if(strcmp(hexhash,item->hash))
+        item->status = STATUS_HASHDIFF;
+
+    delete[] item->blockdiff;
+    item->blockdiff = new unsigned char[item->blockcount > 0 ? item->blockcount : 1];
+    for(b = 0 ; b < item->blockcount ; ++b)
+        item->blockdiff[b] = (b >= count || strcmp(blocks + b * BLOCKHASH_WIDTH,item->blockhashes + b * BLOCKHASH_WIDTH)) ? 1 : 0;
+    delete[] blocks;
+}
+
+/* Prints the changed byte ranges according to blockdiff, the neighbour blocks are merged */
+void UniCatalog::print_block_ranges(struct cItem *item)
+{
+    unsigned int b,first;
+    unsigned long long start,end;
+    bool any = false;
+
+    if(item->blockdiff == NULL)
+        return;
+    b = 0;
+    while(b < item->blockcount)
+    {
+        if(!item->blockdiff[b])
+        {
+            ++b;
+            continue;
+        }
+        first = b;
+        while(b < item->blockcount && item->blockdiff[b])
+            ++b;
+        start = (unsigned long long)first * item->blocksize;
+        end = (unsigned long long)b * item->blocksize;
+        if(end > item->size)
+            end = item->size;
+        printf("%s%llu-%llu",any ? "," : " changed bytes: ",start,end);
+        any = true;
+    }
+}
+
 int UniCatalog::scandir_in(const char *basedir,const char *dirname,FILE *catstream,bool build_icat)
 {
     char hexhash[300];
+    char fprintstr[80];
+    char *blockhashes;
+    unsigned int blockcount;
     char fullpath[512];
     char mypath[512];
     char *umypath;
@@ -300,6 +516,7 @@ int UniCatalog::scandir_in(const char *basedir,const char *dirname,FILE *catstre
 
         while ((ent = readdir (dir)) != NULL)
         {
+            Throttle::consume(THROTTLE_META,1);
             snprintf(mypath,512,"%s/%s",dirname,ent->d_name);
             umypath = unifypath(mypath);
             if(!strcmp(basedir,"/") || !strcmp(basedir,"\\"))
@@ -353,10 +570,18 @@ int UniCatalog::scandir_in(const char *basedir,const char *dirname,FILE *catstre
                         if(needExclude(EXCL_FILE,ent->d_name))
                             continue;
 
-                    gethash(fullpath,hexhash,uc->hashmode);
+                    blockhashes = NULL;
+                    blockcount = 0;
+                    if(uc->blocksize > 0)
+                        getblockhashes(fullpath,hexhash,uc->hashmode,uc->blocksize,&blockhashes,&blockcount);
+                    else
+                        gethash(fullpath,hexhash,uc->hashmode);
+                    fprintstr[0] = '\0';
+                    if(uc->fprint)
+                        getfingerprint(fullpath,fprintstr,uc->hashmode);
                     time_to_str(&s.st_mtime,timestrbuf);
-                    snprintf(sizestrbuf,32,"%d",(unsigned int)s.st_size);
-                    sizec += ((double)((unsigned int)s.st_size)) / 1024;
+                    snprintf(sizestrbuf,32,"%llu",(unsigned long long)s.st_size);
+                    sizec += ((double)s.st_size) / 1024;
 
                     if(catstream != NULL)
                     {
@@ -368,13 +593,29 @@ int UniCatalog::scandir_in(const char *basedir,const char *dirname,FILE *catstre
                         fputs(sizestrbuf,catstream);
                         fputs("*"       ,catstream);
                         fputs(hexhash   ,catstream);
-                        fputs("*\n"     ,catstream);
+                        fputs("*"       ,catstream);
+                        if(fprintstr[0] != '\0')
+                        {
+                            fputs(fprintstr ,catstream);
+                            fputs("*"       ,catstream);
+                        }
+                        if(blockhashes != NULL)
+                            fprintf(catstream,"BS:%u*",uc->blocksize);
+                        //The link groups are the items with the same device and inode
+                        if((uc->moves || (uc->hardlinks && s.st_nlink > 1)) && s.st_ino != 0)
+                            fprintf(catstream,"I:%llu:%llu:%u*",(unsigned long long)s.st_dev,(unsigned long long)s.st_ino,(unsigned int)s.st_nlink);
+                        fputs("\n"      ,catstream);
+                        if(blockhashes != NULL)
+                            write_block_hashes(catstream,uc->blocksize,blockcount,blockhashes);
                     }
                     if(build_icat)
                     {
                         cItem *item = new cItem();
                         item->status = STATUS_NULL;
-                        item->size = (unsigned int)s.st_size;
+                        item->size = (unsigned long long)s.st_size;
+                        item->dev = (unsigned long long)s.st_dev;
+                        item->ino = (unsigned long long)s.st_ino;
+                        item->nlink = (unsigned int)s.st_nlink;
 
                         strcpy(item->pathname,umypath);
                         strcpy(item->time,timestrbuf);
@@ -383,8 +624,26 @@ int UniCatalog::scandir_in(const char *basedir,const char *dirname,FILE *catstre
                         if(uc->hashmode == HASH_MD5)    hb += 4;
                         if(uc->hashmode == HASH_SHA256) hb += 5;
                         strcpy(item->hash,hb);
+                        if(fprintstr[0] != '\0')
+                            strcpy(item->fprint,fprintstr+3);
+                        if(blockhashes != NULL)
+                        {
+                            item->blocksize = uc->blocksize;
+                            item->blockcount = blockcount;
+                            item->blockhashes = blockhashes;
+                            blockhashes = NULL;
+                        }
                         catalog_push(&cat_file,item);
                     }
+                    delete[] blockhashes;
+
+                    if(uc->chunking && scan_chunks(fullpath,umypath,catstream,build_icat))
+                    {
+                        fprintf(stderr,"Error, Cannot read file to chunk: %s\n",fullpath);
+                        if(uc->guicall)
+                            fflush(stderr);
+                        return 1;
+                    }
                 }
             }
             else
@@ -404,6 +663,9 @@ int UniCatalog::scandir_in(const char *basedir,const char *dirname,FILE *catstre
 int UniCatalog::scandir_in_win(const char *basedir,const char *dirname,FILE *catstream,bool build_icat)
 {
     char hexhash[300];
+    char fprintstr[80];
+    char *blockhashes;
+    unsigned int blockcount;
     char fullpath[512];
     char mypath[512];
     char *umypath;
@@ -433,6 +695,7 @@ int UniCatalog::scandir_in_win(const char *basedir,const char *dirname,FILE *cat
 
         do
         {
+            Throttle::consume(THROTTLE_META,1);
             snprintf(mypath,512,"%s/%s",dirname,FindFileData.cFileName);
             umypath = unifypath(mypath);
             if(!strcmp(basedir,"/") || !strcmp(basedir,"\\"))
@@ -487,10 +750,18 @@ int UniCatalog::scandir_in_win(const char *basedir,const char *dirname,FILE *cat
 
                 filesize.LowPart = FindFileData.nFileSizeLow;
                 filesize.HighPart = FindFileData.nFileSizeHigh;
-                gethash(fullpath,hexhash,uc->hashmode);
+                blockhashes = NULL;
+                blockcount = 0;
+                if(uc->blocksize > 0)
+                    getblockhashes(fullpath,hexhash,uc->hashmode,uc->blocksize,&blockhashes,&blockcount);
+                else
+                    gethash(fullpath,hexhash,uc->hashmode);
+                fprintstr[0] = '\0';
+                if(uc->fprint)
+                    getfingerprint(fullpath,fprintstr,uc->hashmode);
                 time_to_str_win(&FindFileData.ftLastWriteTime,timestrbuf);
-                snprintf(sizestrbuf,32,"%d",(unsigned int)filesize.QuadPart );
-                sizec += ((double)((unsigned int)filesize.QuadPart)) / 1024;
+                snprintf(sizestrbuf,32,"%llu",(unsigned long long)filesize.QuadPart );
+                sizec += ((double)filesize.QuadPart) / 1024;
 
                 if(catstream != NULL)
                 {
@@ -502,13 +773,23 @@ int UniCatalog::scandir_in_win(const char *basedir,const char *dirname,FILE *cat
                     fputs(sizestrbuf,catstream);
                     fputs("*"       ,catstream);
                     fputs(hexhash   ,catstream);
-                    fputs("*\n"     ,catstream);
+                    fputs("*"       ,catstream);
+                    if(fprintstr[0] != '\0')
+                    {
+                        fputs(fprintstr ,catstream);
+                        fputs("*"       ,catstream);
+                    }
+                    if(blockhashes != NULL)
+                        fprintf(catstream,"BS:%u*",uc->blocksize);
+                    fputs("\n"      ,catstream);
+                    if(blockhashes != NULL)
+                        write_block_hashes(catstream,uc->blocksize,blockcount,blockhashes);
                 }
                 if(build_icat)
                 {
                     cItem *item = new cItem();
                     item->status = STATUS_NULL;
-                    item->size = (unsigned int)filesize.QuadPart;
+                    item->size = (unsigned long long)filesize.QuadPart;
 
                     strcpy(item->pathname,umypath);
                     strcpy(item->time,timestrbuf);
@@ -517,8 +798,26 @@ int UniCatalog::scandir_in_win(const char *basedir,const char *dirname,FILE *cat
                     if(uc->hashmode == HASH_MD5)    hb += 4;
                     if(uc->hashmode == HASH_SHA256) hb += 5;
                     strcpy(item->hash,hb);
+                    if(fprintstr[0] != '\0')
+                        strcpy(item->fprint,fprintstr+3);
+                    if(blockhashes != NULL)
+                    {
+                        item->blocksize = uc->blocksize;
+                        item->blockcount = blockcount;
+                        item->blockhashes = blockhashes;
+                        blockhashes = NULL;
+                    }
                     catalog_push(&cat_file,item);
                 }
+                delete[] blockhashes;
+
+                if(uc->chunking && scan_chunks(fullpath,umypath,catstream,build_icat))
+                {
+                    fprintf(stderr,"Error, Cannot read file to chunk: %s\n",fullpath);
+                    if(uc->guicall)
+                        fflush(stderr);
+                    return 1;
+                }
             }
         }
         while(FindNextFileA(hFind, &FindFileData) != 0);
@@ -577,6 +876,7 @@ int UniCatalog::scandir_diff_in(const char *basedir,const char *dirname)
         }
         while ((ent = readdir (dir)) != NULL)
         {
+            Throttle::consume(THROTTLE_META,1);
             snprintf(mypath,512,"%s/%s",dirname,ent->d_name);
             umypath = unifypath(mypath);
             if(!strcmp(basedir,"/") || !strcmp(basedir,"\\"))
@@ -641,7 +941,10 @@ int UniCatalog::scandir_diff_in(const char *basedir,const char *dirname)
                     {
                         cItem *item = new cItem();
                         item->status = STATUS_NULL;
-                        item->size = (unsigned int)s.st_size;
+                        item->size = (unsigned long long)s.st_size;
+                        item->dev = (unsigned long long)s.st_dev;
+                        item->ino = (unsigned long long)s.st_ino;
+                        item->nlink = (unsigned int)s.st_nlink;
                         item->htype = HASH_EMPTY;
                         strcpy(item->pathname,umypath);
                         time_to_str(&s.st_mtime,strbuf);
@@ -652,18 +955,34 @@ int UniCatalog::scandir_diff_in(const char *basedir,const char *dirname)
                     {
                         bool hash_check_done=false;
                         i->status = STATUS_MATCH;
+                        i->diffdev = (unsigned long long)s.st_dev;
+                        i->diffino = (unsigned long long)s.st_ino;
+                        i->diffnlink = (unsigned int)s.st_nlink;
                         time_to_str(&s.st_mtime,strbuf);
 
-                        if(i->size != (unsigned int)s.st_size)
+                        if(i->size != (unsigned long long)s.st_size)
                             i->status = STATUS_SIZEDIFF;
 
                         if(i->status == STATUS_MATCH && !uc->skiphash &&
                                 (i->htype == HASH_MD5 || i->htype == HASH_SHA256) )
                         {
                             hash_check_done=true;
-                            gethash(fullpath,hexhash,i->htype,0);
-                            if(strcmp(hexhash,i->hash))
-                                i->status = STATUS_HASHDIFF;
+                            //Block hash list: one full read gives the full hash and the changed ranges
+                            if(i->blockhashes != NULL)
+                                compare_block_hashes(i,fullpath);
+                            //Staged compare: the cheap sampled fingerprint first, full hash only if it matches
+                            else if(i->fprint[0] != '\0')
+                            {
+                                getfingerprint(fullpath,hexhash,i->htype,0);
+                                if(strcmp(hexhash,i->fprint))
+                                    i->status = STATUS_HASHDIFF;
+                            }
+                            if(i->status == STATUS_MATCH && i->blockhashes == NULL)
+                            {
+                                gethash(fullpath,hexhash,i->htype,0);
+                                if(strcmp(hexhash,i->hash))
+                                    i->status = STATUS_HASHDIFF;
+                            }
                         }
 
                         if((uc->watchtime || uc->fixmtime) && i->status == STATUS_MATCH && strcmp(i->time,strbuf))
@@ -679,7 +998,9 @@ int UniCatalog::scandir_diff_in(const char *basedir,const char *dirname)
                             }
                         }
 
-                        if(i->status == STATUS_MATCH)
+                        if(i->status == STATUS_MATCH && keep_matched)
+                            catalog_move(&cat_file,i,&cat_file_ok);
+                        else if(i->status == STATUS_MATCH)
                             catalog_delete(&cat_file,i);
                         else if(i->status == STATUS_FIXTIME)
                             catalog_move(&cat_file,i,&cat_file_fixtime);
@@ -733,6 +1054,7 @@ int UniCatalog::scandir_diff_in_win(const char *basedir,const char *dirname)
 
         do
         {
+            Throttle::consume(THROTTLE_META,1);
             snprintf(mypath,512,"%s/%s",dirname,FindFileData.cFileName);
             umypath = unifypath(mypath);
             if(!strcmp(basedir,"/") || !strcmp(basedir,"\\"))
@@ -801,7 +1123,7 @@ int UniCatalog::scandir_diff_in_win(const char *basedir,const char *dirname)
                 {
                     cItem *item = new cItem();
                     item->status = STATUS_NULL;
-                    item->size = (unsigned int)filesize.QuadPart;
+                    item->size = (unsigned long long)filesize.QuadPart;
                     item->htype = HASH_EMPTY;
                     strcpy(item->pathname,umypath);
                     time_to_str_win(&FindFileData.ftLastWriteTime,strbuf);
@@ -814,16 +1136,29 @@ int UniCatalog::scandir_diff_in_win(const char *basedir,const char *dirname)
                     i->status = STATUS_MATCH;
                     time_to_str_win(&FindFileData.ftLastWriteTime,strbuf);
 
-                    if(i->size != (unsigned int)filesize.QuadPart)
+                    if(i->size != (unsigned long long)filesize.QuadPart)
                         i->status = STATUS_SIZEDIFF;
 
                     if(i->status == STATUS_MATCH && !uc->skiphash &&
                             (i->htype == HASH_MD5 || i->htype == HASH_SHA256) )
                     {
                         hash_check_done=true;
-                        gethash(fullpath,hexhash,i->htype,0);
-                        if(strcmp(hexhash,i->hash))
-                            i->status = STATUS_HASHDIFF;
+                        //Block hash list: one full read gives the full hash and the changed ranges
+                        if(i->blockhashes != NULL)
+                            compare_block_hashes(i,fullpath);
+                        //Staged compare: the cheap sampled fingerprint first, full hash only if it matches
+                        else if(i->fprint[0] != '\0')
+                        {
+                            getfingerprint(fullpath,hexhash,i->htype,0);
+                            if(strcmp(hexhash,i->fprint))
+                                i->status = STATUS_HASHDIFF;
+                        }
+                        if(i->status == STATUS_MATCH && i->blockhashes == NULL)
+                        {
+                            gethash(fullpath,hexhash,i->htype,0);
+                            if(strcmp(hexhash,i->hash))
+                                i->status = STATUS_HASHDIFF;
+                        }
                     }
 
                     if((uc->watchtime || uc->fixmtime) && i->status == STATUS_MATCH && strcmp(i->time,strbuf))
@@ -839,7 +1174,9 @@ int UniCatalog::scandir_diff_in_win(const char *basedir,const char *dirname)
                         }
                     }
 
-                    if(i->status == STATUS_MATCH)
+                    if(i->status == STATUS_MATCH && keep_matched)
+                        catalog_move(&cat_file,i,&cat_file_ok);
+                    else if(i->status == STATUS_MATCH)
                         catalog_delete(&cat_file,i);
                     else if(i->status == STATUS_FIXTIME)
                         catalog_move(&cat_file,i,&cat_file_fixtime);
@@ -863,25 +1200,25 @@ void UniCatalog::rawPrint(void)
     r = cat_file;
     while(r != NULL)
     {
-        printf("FILE-RAW: %s (%d bytes)\n",r->pathname,r->size);
+        printf("FILE-RAW: %s (%llu bytes)\n",r->pathname,r->size);
         r = r->n;
     }
     r = cat_file_ok;
     while(r != NULL)
     {
-        printf("FILE-OK : %s (%d bytes)\n",r->pathname,r->size);
+        printf("FILE-OK : %s (%llu bytes)\n",r->pathname,r->size);
         r = r->n;
     }
     r = cat_file_new;
     while(r != NULL)
     {
-        printf("FILE-NEW: %s (%d bytes)\n",r->pathname,r->size);
+        printf("FILE-NEW: %s (%llu bytes)\n",r->pathname,r->size);
         r = r->n;
     }
     r = cat_file_mod;
     while(r != NULL)
     {
-        printf("FILE-MOD: %s (%d bytes) ",r->pathname,r->size);
+        printf("FILE-MOD: %s (%llu bytes) ",r->pathname,r->size);
         if(r->status == STATUS_NULL)     printf("STATUS:NULL");
         if(r->status == STATUS_TIMEDIFF) printf("STATUS:TIMEDIFF");
         if(r->status == STATUS_HASHDIFF) printf("STATUS:HASHDIFF");
@@ -893,7 +1230,7 @@ void UniCatalog::rawPrint(void)
     r = cat_file_fixtime;
     while(r != NULL)
     {
-        printf("FILE-FIXTIME: %s (%d bytes)\n",r->pathname,r->size);
+        printf("FILE-FIXTIME: %s (%llu bytes)\n",r->pathname,r->size);
         r = r->n;
     }
 
@@ -977,6 +1314,17 @@ void UniCatalog::diffresultPrint(void)
         r = r->n;
     }
 
+    r = cat_file_moved;
+    while(r != NULL)
+    {
+        my_dtoa((double)(r->size),sb,128,0,0,1);
+        printf("MOVED FILE: %s -> %s (%s bytes)\n",r->movedfrom,r->pathname,sb);
+        if(uc->guicall)
+            fflush(stdout);
+        pe = true;
+        r = r->n;
+    }
+
     r = cat_dir_mod;
     while(r != NULL)
     {
@@ -998,6 +1346,8 @@ void UniCatalog::diffresultPrint(void)
         if(r->status == STATUS_TIMEDIFF) printf("(time changed)");
         if(r->status == STATUS_HASHDIFF) printf("(hash differs)");
         if(r->status == STATUS_SIZEDIFF) printf("(size differs)");
+        if(r->status == STATUS_HASHDIFF)
+            print_block_ranges(r);
         printf("\n");
         if(uc->guicall)
             fflush(stdout);
@@ -1044,6 +1394,17 @@ int UniCatalog::print_sync_procedures(const char *sourcefolder_bp,const char *ta
     if(cnt > 0)
         printf(" FILE-FIX-TIMES: \"%s\" -> %d file(s) -> \"%s\"\n",sourcefolder_bp,cnt,targetfolder_bp);
 
+    r = cat_file_moved;
+    cnt = 0;
+    while(r != NULL)
+    {
+        ++cnt;
+        r = r->n;
+    }
+    all += cnt;
+    if(cnt > 0)
+        printf(" MOVE FILES: %d file(s) -> \"%s\"\n",cnt,targetfolder_bp);
+
     r = (direction == DIRECTION_CAT_TO_DIFF ? cat_file_new : cat_file);
     if(r != NULL)
         while(r->n != NULL)
@@ -1125,138 +1486,756 @@ int UniCatalog::print_sync_procedures(const char *sourcefolder_bp,const char *ta
     return 0;
 }
 
-int UniCatalog::scandir_sync(const char *sourcefolder_bp,const char *targetfolder_bp,int direction)
+/* Candidates of the move detection with the same size */
+struct MoveCand
 {
-    char srcbuf[512];
-    char dstbuf[512];
+    struct cItem *item;     //NULL if already paired
+    struct MoveCand *n;
+};
 
-    struct cItem *r;
+struct MoveBucket
+{
+    struct MoveCand *first;
+    struct MoveBucket *n;
+};
 
-    if(uc->verbose > 0)
+/* Gets the hash of the item in the requested type: the stored one, or computed from the file if the base path is known.
+   The computed hash is stored to the items without hash. */
+static int move_item_hash(struct cItem *item,const char *bp,int htype,char *hexhash)
+{
+    char fullpath[512];
+    if(item->htype == htype)
     {
-        printf("Sync directory...\n");
-        if(uc->guicall)
-            fflush(stdout);
+        strcpy(hexhash,item->hash);
+        return 0;
     }
-
-    if(PathMaker::mkpath(targetfolder_bp,false))
+    if(bp == NULL)
+        return 1;
+    snprintf(fullpath,512,"%s/%s",bp,wods(item->pathname));
+    if(gethash(fullpath,hexhash,htype,0))
         return 1;
+    if(item->htype == HASH_EMPTY)
+    {
+        item->htype = htype;
+        strcpy(item->hash,hexhash);
+    }
+    return 0;
+}
 
-    FileCopier *copier = new FileCopier(uc);
+bool UniCatalog::same_content(struct cItem *a,const char *a_bp,struct cItem *b,const char *b_bp)
+{
+    char ha[80],hb[80];
+    int htype = a->htype;
+    if(htype == HASH_EMPTY)
+        htype = b->htype;
+    if(htype == HASH_EMPTY)
+        htype = uc->hashmode;
+    if(htype == HASH_EMPTY)
+        htype = HASH_MD5;
+    if(move_item_hash(a,a_bp,htype,ha) || move_item_hash(b,b_bp,htype,hb))
+        return false;
+    return strcmp(ha,hb) == 0;
+}
 
-    r = cat_file_fixtime;
-    while(r != NULL)
+/*  Move detection: pairs the deleted files with the new files of the same content, and moves them to cat_file_moved
+    with the old path in movedfrom. The sync and the update package renames these files instead of delete + copy.
+    catalog_bp is the basepath of the cataloged folder or NULL if only the catalog file is known, diffed_bp is the diffed folder.
+    Every pair has the same size and time. The content is compared by hash (computed if necessary).
+    If the catalog file was made of the diffed folder on this machine (catalog_bp is NULL and the origin recorded
+    by the -moves catalog is the diffed folder) the files with the same device and inode are matched without hashing,
+    the stored hashes are still compared if both items have one. */
+int UniCatalog::detect_moves(int direction,const char *catalog_bp,const char *diffed_bp)
+{
+    char key[64];
+    int moves = 0;
+    struct cItem **gone  = (direction == DIRECTION_CAT_TO_DIFF ? &cat_file_new : &cat_file);
+    struct cItem **added = (direction == DIRECTION_CAT_TO_DIFF ? &cat_file : &cat_file_new);
+    const char *gone_bp  = (direction == DIRECTION_CAT_TO_DIFF ? diffed_bp : catalog_bp);
+    const char *added_bp = (direction == DIRECTION_CAT_TO_DIFF ? catalog_bp : diffed_bp);
+    char current[128];
+    bool useinode = false;
+    struct MoveBucket *buckets = NULL;
+    struct cItem *r,*g;
+
+    if(*gone == NULL || *added == NULL)
+        return 0;
+    //A catalog from an other machine or folder can have the same device and inode numbers for other files
+    if(catalog_bp == NULL && origin[0] != '\0' && folder_origin(diffed_bp,current) == 0)
+        useinode = !strcmp(origin,current);
+
+    if(uc->verbose > 0)
     {
-        snprintf(srcbuf,512,"%s/%s",sourcefolder_bp,wods(r->pathname));
-        snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
-        if(copier->fixtime(srcbuf,dstbuf))
-        {
-            delete copier;
-            return 1;
-        }
-        r = r->n;
+        printf("Detect moved files...\n");
+        if(uc->guicall)
+            fflush(stdout);
     }
 
-    r = (direction == DIRECTION_CAT_TO_DIFF ? cat_file_new : cat_file);
-    if(r != NULL)
-        while(r->n != NULL)
-            r = r->n;
-    while(r != NULL)
+    HashIndex *sizeindex = new HashIndex();
+    for(r = *added ; r != NULL ; r = r->n)
     {
-        snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
-        if(copier->deletefile(dstbuf) != 0)
+        if(r->size == 0)
+            continue;
+        snprintf(key,64,"%llu",r->size);
+        struct MoveBucket *b = (struct MoveBucket *)sizeindex->find(key);
+        if(b == NULL)
         {
-            fprintf(stderr,"Error, cannot delete file: %s\n",dstbuf);
-            delete copier;
-            return 1;
+            b = new MoveBucket();
+            b->n = buckets;
+            buckets = b;
+            sizeindex->add(key,b);
         }
-        r = r->p;
-    }
-
-    r = (direction == DIRECTION_CAT_TO_DIFF ? cat_dir_new : cat_dir);
-    if(r != NULL)
-        while(r->n != NULL)
-            r = r->n;
-    while(r != NULL)
-    {
-        snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
-        if(copier->deletefolder(dstbuf) != 0)
+        struct MoveCand *c = new MoveCand();
+        c->item = r;
+        c->n = b->first;
+        b->first = c;
+    }
+
+    g = *gone;
+    while(g != NULL)
+    {
+        struct cItem *gn = g->n;
+        snprintf(key,64,"%llu",g->size);
+        struct MoveBucket *b = (g->size == 0 ? NULL : (struct MoveBucket *)sizeindex->find(key));
+        struct MoveCand *found = NULL;
+        if(b != NULL && useinode && g->ino != 0)
+            for(struct MoveCand *c = b->first ; c != NULL && found == NULL ; c = c->n)
+                if(c->item != NULL && c->item->dev == g->dev && c->item->ino == g->ino && !strcmp(c->item->time,g->time) &&
+                   (c->item->htype == HASH_EMPTY || c->item->htype != g->htype || !strcmp(c->item->hash,g->hash)))
+                    found = c;
+        if(b != NULL && found == NULL)
+            for(struct MoveCand *c = b->first ; c != NULL && found == NULL ; c = c->n)
+                if(c->item != NULL && !strcmp(c->item->time,g->time) && same_content(g,gone_bp,c->item,added_bp))
+                    found = c;
+        if(found != NULL)
         {
-            fprintf(stderr,"Error, cannot delete folder: %s\n",dstbuf);
-            delete copier;
-            return 1;
+            r = found->item;
+            found->item = NULL;
+            r->movedfrom = strdup(g->pathname);
+            catalog_move(added,r,&cat_file_moved);
+            catalog_delete(gone,g);
+            if(uc->verbose > 2)
+            {
+                printf("Moved: %s -> %s\n",r->movedfrom,r->pathname);
+                if(uc->guicall)
+                    fflush(stdout);
+            }
+            ++moves;
         }
-        r = r->p;
+        g = gn;
     }
 
-    r = (direction == DIRECTION_CAT_TO_DIFF ? cat_dir: cat_dir_new);
-    while(r != NULL)
+    while(buckets != NULL)
     {
-        snprintf(srcbuf,512,"%s/%s",sourcefolder_bp,wods(r->pathname));
-        snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
-        if(PathMaker::mkpath(dstbuf,false))
+        struct MoveBucket *b = buckets;
+        buckets = b->n;
+        while(b->first != NULL)
         {
-            delete copier;
-            return 1;
+            struct MoveCand *c = b->first;
+            b->first = c->n;
+            delete c;
         }
-        r = r->n;
+        delete b;
     }
+    delete sizeindex;
 
-    r = (direction == DIRECTION_CAT_TO_DIFF ? cat_file: cat_file_new);
-    while(r != NULL)
+    if(uc->verbose > 0)
     {
-        snprintf(srcbuf,512,"%s/%s",sourcefolder_bp,wods(r->pathname));
-        snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
-        if(copier->copy(srcbuf,dstbuf))
-        {
-            delete copier;
-            return 1;
-        }
-        r = r->n;
+        printf("%d moved file(s) found\n",moves);
+        if(uc->guicall)
+            fflush(stdout);
     }
+    return 0;
+}
 
-    r = cat_file_mod;
+/* Renames the moved files in the target folder. If a file cannot be moved it is copied by the normal way. */
+int UniCatalog::move_files(const char *sourcefolder_bp,const char *targetfolder_bp,FileCopier *copier)
+{
+    char srcbuf[512];
+    char dstbuf[512];
+    char oldbuf[512];
+    struct cItem *r,*rn;
+
+    r = cat_file_moved;
     while(r != NULL)
     {
+        rn = r->n;
         snprintf(srcbuf,512,"%s/%s",sourcefolder_bp,wods(r->pathname));
         snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
-        if(copier->copy(srcbuf,dstbuf))
-        {
-            delete copier;
+        snprintf(oldbuf,512,"%s/%s",targetfolder_bp,wods(r->movedfrom));
+        if(PathMaker::mkpath(dstbuf,true))
             return 1;
+        if(copier->movefile(oldbuf,dstbuf) != 0)
+        {
+            if(uc->verbose > 0)
+            {
+                printf("Cannot move %s, copy instead\n",oldbuf);
+                if(uc->guicall)
+                    fflush(stdout);
+            }
+            if(copier->deletefile(oldbuf) != 0)
+            {
+                fprintf(stderr,"Error, cannot delete file: %s\n",oldbuf);
+                if(uc->guicall)
+                    fflush(stderr);
+                return 1;
+            }
+            free(r->movedfrom);
+            r->movedfrom = NULL;
+            catalog_move(&cat_file_moved,r,&cat_file_mod);
         }
-        r = r->n;
+        else if(copier->fixtime(srcbuf,dstbuf))
+            return 1;
+        r = rn;
     }
-
-    copier->printStatistics();
-    delete copier;
     return 0;
 }
 
-/*  Make an update which update the cataloged folder to the diffed before this func.
-    sourcefolder_bp is the basepath of the diffed directory
-    updatepack_bp is the basepath of update package
-    DIFFED = CATALOGED + THIS UPDATE */
-int UniCatalog::make_update_package(const char *sourcefolder_bp,const char *updatepack_bp)
+/* A hardlinked inode of the source side: the item which data is copied (or an unchanged file) */
+struct LinkGroup
 {
-    char srcbuf[512];
-    char dstbuf[512];
-
-    struct cItem *r;
+    struct cItem *leader;
+    bool unchanged;
+    struct LinkGroup *n;
+};
 
-    if(uc->verbose > 0)
+/* The identity of the file on the source side: the cataloged folder on sync, the diffed folder on the update packages */
+static unsigned int link_identity(struct cItem *item,bool diffside,char *key)
+{
+    if(diffside && item->diffnlink > 0)
     {
-        printf("Generate the update package...\n");
-        if(uc->guicall)
-            fflush(stdout);
+        snprintf(key,64,"%llu:%llu",item->diffdev,item->diffino);
+        return item->diffnlink;
     }
+    snprintf(key,64,"%llu:%llu",item->dev,item->ino);
+    return item->nlink;
+}
 
-    if(PathMaker::mkpath(updatepack_bp,false))
-        return 1;
+/*  Hardlinks: groups the items to copy by their source inode. The first item of a group is copied (or nothing if an
+    unchanged file belongs to the group), the others get linkto and created as hardlinks. Returns the number of links.
+    The unchanged files are only known if setKeepMatched(true) was called before diff. */
+int UniCatalog::find_links(int direction,struct cItem **copylists,int listcount)
+{
+    char key[64];
+    int links = 0;
+    bool diffside = (direction == DIRECTION_DIFF_TO_CAT);
+    struct LinkGroup *groups = NULL,*g;
+    struct cItem *r;
 
-    FILE *df=NULL;
-    snprintf(dstbuf,512,"%s/.deleted_items",updatepack_bp);
-    if((df=fopen(dstbuf,"w"))==NULL)
+    HashIndex *linkindex = new HashIndex();
+    for(int l = 0 ; l < listcount ; ++l)
+        for(r = copylists[l] ; r != NULL ; r = r->n)
+            if(link_identity(r,diffside,key) > 1 && linkindex->find(key) == NULL)
+            {
+                g = new LinkGroup();
+                g->leader = r;
+                g->n = groups;
+                groups = g;
+                linkindex->add(key,g);
+            }
+
+    //An unchanged name of the inode is already in the target: every copied name can be linked to it
+    if(groups != NULL)
+        for(r = cat_file_ok ; r != NULL ; r = r->n)
+            if(link_identity(r,diffside,key) > 1 && (g = (struct LinkGroup *)linkindex->find(key)) != NULL && !g->unchanged)
+            {
+                g->leader = r;
+                g->unchanged = true;
+            }
+
+    if(groups != NULL)
+        for(int l = 0 ; l < listcount ; ++l)
+            for(r = copylists[l] ; r != NULL ; r = r->n)
+                if(link_identity(r,diffside,key) > 1 && (g = (struct LinkGroup *)linkindex->find(key)) != NULL && g->leader != r)
+                {
+                    r->linkto = g->leader;
+                    ++links;
+                }
+
+    while(groups != NULL)
+    {
+        g = groups;
+        groups = g->n;
+        delete g;
+    }
+    delete linkindex;
+
+    if(uc->verbose > 0 && links > 0)
+    {
+        printf("%d file(s) will be hardlinked instead of copied\n",links);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    return links;
+}
+
+/* The hardlinked names share the time too, so they are grouped by the modification time as well */
+void UniCatalog::clone_key(char *key,struct cItem *r)
+{
+    if(uc->dedup == DEDUP_HARDLINK)
+        snprintf(key,160,"%d:%llu:%s:%s",r->htype,r->size,r->hash,r->time);
+    else
+        snprintf(key,160,"%d:%llu:%s",r->htype,r->size,r->hash);
+}
+
+/*  Dedup: the copied items with the same size and hash as an other copied item (or an unchanged file) get cloneof,
+    they are created from the target file of that item by reflink or hardlink after the copy. Returns the number of clones. */
+int UniCatalog::find_clones(struct cItem **copylists,int listcount)
+{
+    char key[160];
+    int clones = 0;
+    double csize = 0.0;
+    struct LinkGroup *groups = NULL,*g;
+    struct cItem *r;
+
+    HashIndex *contentindex = new HashIndex();
+    for(int l = 0 ; l < listcount ; ++l)
+        for(r = copylists[l] ; r != NULL ; r = r->n)
+        {
+            if(r->size == 0 || r->htype == HASH_EMPTY || r->linkto != NULL)
+                continue;
+            clone_key(key,r);
+            if((g = (struct LinkGroup *)contentindex->find(key)) == NULL)
+            {
+                g = new LinkGroup();
+                g->leader = r;
+                g->n = groups;
+                groups = g;
+                contentindex->add(key,g);
+            }
+            else
+            {
+                r->cloneof = g->leader;
+                ++clones;
+                csize += r->size;
+            }
+        }
+
+    //The content is already in the target: the first copied item can be cloned too
+    if(groups != NULL)
+        for(r = cat_file_ok ; r != NULL ; r = r->n)
+        {
+            if(r->size == 0 || r->htype == HASH_EMPTY)
+                continue;
+            clone_key(key,r);
+            if((g = (struct LinkGroup *)contentindex->find(key)) != NULL && !g->unchanged)
+            {
+                g->leader->cloneof = r;
+                g->leader = r;
+                g->unchanged = true;
+                ++clones;
+                csize += r->size;
+            }
+        }
+    if(groups != NULL)
+        for(int l = 0 ; l < listcount ; ++l)
+            for(r = copylists[l] ; r != NULL ; r = r->n)
+                if(r->cloneof != NULL && r->cloneof->cloneof != NULL)
+                    r->cloneof = r->cloneof->cloneof;
+
+    while(groups != NULL)
+    {
+        g = groups;
+        groups = g->n;
+        delete g;
+    }
+    delete contentindex;
+
+    if(uc->verbose > 0 && clones > 0)
+    {
+        char buff[64];
+        my_dtoa(csize / (1024 * 1024),(char *)buff,64,0,2,1);
+        printf("%d duplicated file(s) / %s Mb will be created by %s\n",clones,buff,uc->dedup == DEDUP_HARDLINK ? "hardlink" : "reflink");
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    return clones;
+}
+
+/* The item is directly in one of the folders of the index */
+static bool in_folder(HashIndex *folders,const char *pathname)
+{
+    char parent[512];
+    int i;
+
+    strncpy(parent,pathname,511);
+    parent[511] = '\0';
+    for(i = strlen(parent) - 1 ; i >= 0 && parent[i] != '/' && parent[i] != '\\' ; --i);
+    if(i <= 0)
+        return false;
+    parent[i] = '\0';
+    return folders->find(parent) != NULL;
+}
+
+/*  Sync the diffed directories. If catstream is not NULL the catalog of the synced target folder
+    is written to it. (The unchanged items are only known if setKeepMatched(true) was called before diff) */
+int UniCatalog::scandir_sync(const char *sourcefolder_bp,const char *targetfolder_bp,int direction,FILE *catstream)
+{
+    char srcbuf[512];
+    char dstbuf[512];
+
+    struct cItem *r;
+
+    if(uc->verbose > 0)
+    {
+        printf("Sync directory...\n");
+        if(uc->guicall)
+            fflush(stdout);
+    }
+
+    if(PathMaker::mkpath(targetfolder_bp,false))
+        return 1;
+
+    FileCopier *copier = new FileCopier(uc);
+
+    //Parallel, time budgeted or journaled sync: the whole sync as one dependency graph instead of the serial phases
+    if((uc->copyjobs > 1 && uc->uringdepth == 0) || uc->deadline > 0 || uc->journal != NULL)
+    {
+        SyncPlan *plan = new SyncPlan(uc);
+        build_sync_plan(plan,direction);
+        //The resume continues this plan without scanning
+        int failed = (uc->journal != NULL ? plan->save(uc->journal->planfile(),sourcefolder_bp,targetfolder_bp) : 0);
+        if(!failed)
+            failed = plan->execute(sourcefolder_bp,targetfolder_bp,copier);
+        bool unfinished = plan->unfinished();
+        if(!failed && uc->planout != NULL)
+            failed = plan->save_rest(uc->planout);
+        delete plan;
+        if(failed)
+        {
+            delete copier;
+            return 1;
+        }
+        //The catalog of a partially synced folder would be wrong
+        if(catstream != NULL && !unfinished)
+            write_sync_catalog(catstream,direction);
+        copier->printStatistics();
+        delete copier;
+        return 0;
+    }
+
+    r = cat_file_fixtime;
+    while(r != NULL)
+    {
+        snprintf(srcbuf,512,"%s/%s",sourcefolder_bp,wods(r->pathname));
+        snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
+        if(copier->fixtime(srcbuf,dstbuf))
+        {
+            delete copier;
+            return 1;
+        }
+        r = r->n;
+    }
+
+    //Before the deletions, because the old folders of the moved files can be deleted
+    if(move_files(sourcefolder_bp,targetfolder_bp,copier))
+    {
+        delete copier;
+        return 1;
+    }
+
+    if(delete_items(targetfolder_bp,direction,copier))
+    {
+        delete copier;
+        return 1;
+    }
+
+    struct cItem *copylists[2] = { (direction == DIRECTION_CAT_TO_DIFF ? cat_file: cat_file_new) , cat_file_mod };
+    if(uc->hardlinks)
+        find_links(direction,copylists,2);
+    if(uc->dedup != DEDUP_NONE)
+        find_clones(copylists,2);
+
+    //The new folder trees are copied in one walk, the other new folders are created one by one
+    HashIndex *created = new_folders(direction);
+    SubtreeCopier *trees = new SubtreeCopier(uc,copier);
+    r = (direction == DIRECTION_CAT_TO_DIFF ? cat_dir: cat_dir_new);
+    while(r != NULL)
+    {
+        snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
+        if(created != NULL)
+        {
+            if(!in_folder(created,r->pathname))
+                trees->add(r->pathname);
+        }
+        else if(PathMaker::mkpath(dstbuf,false))
+        {
+            delete trees;
+            delete copier;
+            return 1;
+        }
+        r = r->n;
+    }
+    if(created != NULL)
+    {
+        HashIndex *skip = tree_skips(copylists,2);
+        int failed = trees->run(sourcefolder_bp,targetfolder_bp,skip);
+        delete skip;
+        if(failed)
+        {
+            delete created;
+            delete trees;
+            delete copier;
+            return 1;
+        }
+    }
+    delete trees;
+
+    CopyScheduler *scheduler = new CopyScheduler(uc,copier);
+    for(int l = 0 ; l < 2 ; ++l)
+    {
+        r = copylists[l];
+        while(r != NULL)
+        {
+            snprintf(srcbuf,512,"%s/%s",sourcefolder_bp,wods(r->pathname));
+            snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
+            if(r->linkto == NULL && r->cloneof == NULL && (created == NULL || !in_folder(created,r->pathname)))
+                scheduler->add(srcbuf,dstbuf,direction == DIRECTION_CAT_TO_DIFF ? r : NULL);
+            r = r->n;
+        }
+    }
+    if(created != NULL)
+        delete created;
+    if(scheduler->run())
+    {
+        delete scheduler;
+        delete copier;
+        return 1;
+    }
+    delete scheduler;
+
+    //The deduplicated files, then the linked names after every data is in place
+    for(int l = 0 ; l < 2 ; ++l)
+        for(r = copylists[l] ; r != NULL ; r = r->n)
+            if(r->cloneof != NULL)
+            {
+                char clonebuf[512];
+                snprintf(clonebuf,512,"%s/%s",targetfolder_bp,wods(r->cloneof->pathname));
+                snprintf(srcbuf,512,"%s/%s",sourcefolder_bp,wods(r->pathname));
+                snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
+                if(copier->clonefile(clonebuf,dstbuf,srcbuf,direction == DIRECTION_CAT_TO_DIFF ? r : NULL))
+                {
+                    delete copier;
+                    return 1;
+                }
+            }
+    if(uc->atomiccopy && copier->commit(true))
+    {
+        delete copier;
+        return 1;
+    }
+    for(int l = 0 ; l < 2 ; ++l)
+        for(r = copylists[l] ; r != NULL ; r = r->n)
+            if(r->linkto != NULL)
+            {
+                snprintf(srcbuf,512,"%s/%s",targetfolder_bp,wods(r->linkto->pathname));
+                snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
+                if(copier->linkfile(srcbuf,dstbuf))
+                {
+                    delete copier;
+                    return 1;
+                }
+            }
+
+    if(catstream != NULL)
+        write_sync_catalog(catstream,direction);
+    copier->printStatistics();
+    delete copier;
+    return 0;
+}
+
+/* The deleted folders (which are only in the target). A deleted folder whose parent stays is removed with
+   its whole content by the SubtreeDeleter, the items inside are not deleted one by one.
+   Returns NULL if the folders can contain excluded items, which are not in the catalog and have to be kept. */
+HashIndex *UniCatalog::deleted_folders(int direction)
+{
+    struct cItem *r;
+    HashIndex *index;
+
+    if(uc->exclude)
+        return NULL;
+    index = new HashIndex();
+    for(r = (direction == DIRECTION_CAT_TO_DIFF ? cat_dir_new : cat_dir) ; r != NULL ; r = r->n)
+        index->add(r->pathname,r);
+    return index;
+}
+
+/* The new folders (which are not in the target). A new folder whose parent exists is copied with its whole
+   content by the SubtreeCopier, the items inside are not copied one by one.
+   Returns NULL if the tree copy cannot be used: the source folders can contain excluded items,
+   the verified copy needs the hashes of the items, the io_uring engine copies the files itself,
+   the copy order policies need the file list, a time budgeted or journaled sync stops between the files,
+   the multi-destination sync joins the copies of the same file. */
+HashIndex *UniCatalog::new_folders(int direction)
+{
+    struct cItem *r;
+    HashIndex *index;
+
+    if(uc->exclude || uc->verifycopy || uc->uringdepth > 0 || uc->copyorder != COPYORDER_SCAN || uc->deadline > 0 || uc->journal != NULL || uc->destinations > 1)
+        return NULL;
+    index = new HashIndex();
+    for(r = (direction == DIRECTION_CAT_TO_DIFF ? cat_dir : cat_dir_new) ; r != NULL ; r = r->n)
+        index->add(r->pathname,r);
+    return index;
+}
+
+/* The files which are placed by other way than copy (moved, linked, cloned), the subtree copy skips them */
+HashIndex *UniCatalog::tree_skips(struct cItem **copylists,int listcount)
+{
+    struct cItem *r;
+    HashIndex *skip = new HashIndex();
+
+    for(r = cat_file_moved ; r != NULL ; r = r->n)
+        skip->add(wods(r->pathname),r);
+    for(int l = 0 ; l < listcount ; ++l)
+        for(r = copylists[l] ; r != NULL ; r = r->n)
+            if(r->linkto != NULL || r->cloneof != NULL)
+                skip->add(wods(r->pathname),r);
+    return skip;
+}
+
+/* Deletes the files and folders which are only in the target folder */
+int UniCatalog::delete_items(const char *targetfolder_bp,int direction,FileCopier *copier)
+{
+    char dstbuf[512];
+    struct cItem *r;
+    HashIndex *deleted = deleted_folders(direction);
+    SubtreeDeleter *deleter = new SubtreeDeleter(uc);
+    int failed = 0;
+
+    r = (direction == DIRECTION_CAT_TO_DIFF ? cat_file_new : cat_file);
+    if(r != NULL)
+        while(r->n != NULL)
+            r = r->n;
+    while(r != NULL && !failed)
+    {
+        snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
+        if((deleted == NULL || !in_folder(deleted,r->pathname)) && copier->deletefile(dstbuf) != 0)
+        {
+            fprintf(stderr,"Error, cannot delete file: %s\n",dstbuf);
+            failed = 1;
+        }
+        r = r->p;
+    }
+
+    r = (direction == DIRECTION_CAT_TO_DIFF ? cat_dir_new : cat_dir);
+    if(r != NULL)
+        while(r->n != NULL)
+            r = r->n;
+    while(r != NULL && !failed)
+    {
+        snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
+        if(deleted != NULL)
+        {
+            if(!in_folder(deleted,r->pathname))
+                deleter->add(dstbuf);
+        }
+        else if(copier->deletefolder(dstbuf) != 0)
+        {
+            fprintf(stderr,"Error, cannot delete folder: %s\n",dstbuf);
+            failed = 1;
+        }
+        r = r->p;
+    }
+    if(!failed)
+        failed = deleter->run();
+    if(failed && uc->guicall)
+        fflush(stderr);
+
+    delete deleter;
+    if(deleted != NULL)
+        delete deleted;
+    return failed;
+}
+
+/* Writes the catalog of the synced target folder: every item which is in the target after the sync */
+void UniCatalog::write_sync_catalog(FILE *catstream,int direction)
+{
+    struct cItem *r;
+    struct cItem *lists[5] = { cat_file_fixtime , cat_file_moved , (direction == DIRECTION_CAT_TO_DIFF ? cat_file: cat_file_new) ,
+                               cat_file_mod , cat_file_ok };
+    struct cItem *dirlists[2] = { (direction == DIRECTION_CAT_TO_DIFF ? cat_dir: cat_dir_new) , cat_dir_ok };
+
+    for(int l = 0 ; l < 2 ; ++l)
+        for(r = dirlists[l] ; r != NULL ; r = r->n)
+            write_catalog_item(catstream,r,true);
+    for(int l = 0 ; l < 5 ; ++l)
+        for(r = lists[l] ; r != NULL ; r = r->n)
+            write_catalog_item(catstream,r,false);
+}
+
+/* The sync as operation graph (see SyncPlan) */
+void UniCatalog::build_sync_plan(SyncPlan *plan,int direction)
+{
+    struct cItem *r;
+    struct cItem *copylists[2] = { (direction == DIRECTION_CAT_TO_DIFF ? cat_file: cat_file_new) , cat_file_mod };
+    struct cItem *itemside;
+    HashIndex *deleted,*created;
+
+    if(uc->hardlinks)
+        find_links(direction,copylists,2);
+    if(uc->dedup != DEDUP_NONE)
+        find_clones(copylists,2);
+
+    for(r = cat_file_fixtime ; r != NULL ; r = r->n)
+        plan->add(OP_FIXTIME,r->pathname);
+    for(r = cat_file_moved ; r != NULL ; r = r->n)
+        plan->add(OP_MOVE,r->pathname,r->movedfrom,direction == DIRECTION_CAT_TO_DIFF ? r : NULL);
+    deleted = deleted_folders(direction);
+    for(r = (direction == DIRECTION_CAT_TO_DIFF ? cat_file_new : cat_file) ; r != NULL ; r = r->n)
+        if(deleted == NULL || !in_folder(deleted,r->pathname))
+            plan->add(OP_DELFILE,r->pathname);
+    for(r = (direction == DIRECTION_CAT_TO_DIFF ? cat_dir_new : cat_dir) ; r != NULL ; r = r->n)
+        if(deleted == NULL)
+            plan->add(OP_RMDIR,r->pathname);
+        else if(!in_folder(deleted,r->pathname))
+            plan->add(OP_RMTREE,r->pathname);
+    if(deleted != NULL)
+        delete deleted;
+    created = new_folders(direction);
+    for(r = (direction == DIRECTION_CAT_TO_DIFF ? cat_dir: cat_dir_new) ; r != NULL ; r = r->n)
+        if(created == NULL)
+            plan->add(OP_MKDIR,r->pathname);
+        else if(!in_folder(created,r->pathname))
+            plan->add(OP_TREECOPY,r->pathname);
+    for(int l = 0 ; l < 2 ; ++l)
+        for(r = copylists[l] ; r != NULL ; r = r->n)
+        {
+            itemside = (direction == DIRECTION_CAT_TO_DIFF ? r : NULL);
+            if(r->linkto != NULL)
+                plan->add(OP_LINK,r->pathname,r->linkto->pathname,itemside);
+            else if(r->cloneof != NULL)
+                plan->add(OP_CLONE,r->pathname,r->cloneof->pathname,itemside);
+            else if(created == NULL || !in_folder(created,r->pathname))
+                plan->add(OP_COPY,r->pathname,NULL,itemside);
+        }
+    if(created != NULL)
+        delete created;
+}
+
+/*  Make an update which update the cataloged folder to the diffed before this func.
+    sourcefolder_bp is the basepath of the diffed directory
+    updatepack_bp is the basepath of update package
+    DIFFED = CATALOGED + THIS UPDATE */
+int UniCatalog::make_update_package(const char *sourcefolder_bp,const char *updatepack_bp)
+{
+    char srcbuf[512];
+    char dstbuf[512];
+
+    struct cItem *r;
+
+    if(uc->verbose > 0)
+    {
+        printf("Generate the update package...\n");
+        if(uc->guicall)
+            fflush(stdout);
+    }
+
+    if(PathMaker::mkpath(updatepack_bp,false))
+        return 1;
+
+    FILE *df=NULL;
+    snprintf(dstbuf,512,"%s/.deleted_items",updatepack_bp);
+    if((df=fopen(dstbuf,"w"))==NULL)
     {
         fprintf(stderr,"Error, cannot write file: %s\n",dstbuf);
         return 1;
@@ -1284,43 +2263,127 @@ int UniCatalog::make_update_package(const char *sourcefolder_bp,const char *upda
 
     fclose(df);
 
+    if(cat_file_moved != NULL)
+    {
+        snprintf(dstbuf,512,"%s/.moved_items",updatepack_bp);
+        if((df=fopen(dstbuf,"w"))==NULL)
+        {
+            fprintf(stderr,"Error, cannot write file: %s\n",dstbuf);
+            return 1;
+        }
+        r = cat_file_moved;
+        while(r != NULL)
+        {
+            //The renamed file gets the time and mode of the source
+            struct stat st;
+            snprintf(srcbuf,512,"%s/%s",sourcefolder_bp,wods(r->pathname));
+            if(stat(srcbuf,&st) != 0)
+            {
+                fprintf(stderr,"Error, cannot stat file: %s\n",srcbuf);
+                fclose(df);
+                return 1;
+            }
+            fprintf(df,"M*%s*%s*%ld*%o*\n",wods(r->movedfrom),wods(r->pathname),(long)st.st_mtime,(unsigned int)st.st_mode);
+            r = r->n;
+        }
+        fclose(df);
+    }
+
     FileCopier *copier = new FileCopier(uc);
-    r = cat_dir_new;
-    while(r != NULL)
+
+    FILE *recipe=NULL;
+    HashIndex *packindex=NULL;
+    if(uc->chunking)
     {
-        snprintf(dstbuf,512,"%s/%s",updatepack_bp,wods(r->pathname));
-        if(PathMaker::mkpath(dstbuf,false))
+        snprintf(dstbuf,512,"%s/.chunked_items",updatepack_bp);
+        if((recipe=fopen(dstbuf,"w"))==NULL)
         {
+            fprintf(stderr,"Error, cannot write file: %s\n",dstbuf);
             delete copier;
             return 1;
         }
-        r = r->n;
+        packindex = new HashIndex();
     }
 
-    r = cat_file_new;
+    r = cat_dir_new;
     while(r != NULL)
     {
-        snprintf(srcbuf,512,"%s/%s",sourcefolder_bp,wods(r->pathname));
         snprintf(dstbuf,512,"%s/%s",updatepack_bp,wods(r->pathname));
-        if(copier->copy(srcbuf,dstbuf))
+        if(PathMaker::mkpath(dstbuf,false))
         {
+            if(recipe != NULL)
+                fclose(recipe);
+            delete packindex;
             delete copier;
             return 1;
         }
         r = r->n;
     }
 
-    r = cat_file_mod;
-    while(r != NULL)
+    //The hardlinked names are not stored, the applyupdate links them to the copied (or unchanged) name
+    struct cItem *copylists[2] = { cat_file_new , cat_file_mod };
+    if(uc->hardlinks && find_links(DIRECTION_DIFF_TO_CAT,copylists,2) > 0)
     {
-        snprintf(srcbuf,512,"%s/%s",sourcefolder_bp,wods(r->pathname));
-        snprintf(dstbuf,512,"%s/%s",updatepack_bp,wods(r->pathname));
-        if(copier->copy(srcbuf,dstbuf))
+        snprintf(dstbuf,512,"%s/.linked_items",updatepack_bp);
+        if((df=fopen(dstbuf,"w"))==NULL)
         {
+            fprintf(stderr,"Error, cannot write file: %s\n",dstbuf);
+            if(recipe != NULL)
+                fclose(recipe);
+            delete packindex;
             delete copier;
             return 1;
         }
-        r = r->n;
+        for(int l = 0 ; l < 2 ; ++l)
+            for(r = copylists[l] ; r != NULL ; r = r->n)
+                if(r->linkto != NULL)
+                    fprintf(df,"L*%s*%s*\n",wods(r->linkto->pathname),wods(r->pathname));
+        fclose(df);
+    }
+
+    //The chunked items share the package chunk index, so they are made one after another
+    CopyScheduler *scheduler = new CopyScheduler(uc,copier);
+    for(int l = 0 ; l < 2 ; ++l)
+    {
+        r = copylists[l];
+        while(r != NULL)
+        {
+            if(r->linkto != NULL)
+            {
+                r = r->n;
+                continue;
+            }
+            snprintf(srcbuf,512,"%s/%s",sourcefolder_bp,wods(r->pathname));
+            snprintf(dstbuf,512,"%s/%s",updatepack_bp,wods(r->pathname));
+            if(recipe != NULL)
+            {
+                if(make_chunked_item(sourcefolder_bp,updatepack_bp,r,copier,recipe,packindex))
+                {
+                    fclose(recipe);
+                    delete packindex;
+                    delete scheduler;
+                    delete copier;
+                    return 1;
+                }
+            }
+            else
+                scheduler->add(srcbuf,dstbuf);
+            r = r->n;
+        }
+    }
+    if(scheduler->run())
+    {
+        delete scheduler;
+        delete copier;
+        return 1;
+    }
+    delete scheduler;
+    if(recipe != NULL)
+    {
+        fclose(recipe);
+        if(uc->verbose > 0)
+            printf("%u new chunks stored in the package\n",packindex->count());
+        delete packindex;
     }
     copier->printStatistics();
     delete copier;
@@ -1344,6 +2407,7 @@ int UniCatalog::apply_update_package(const char *updatepack_bp,const char *targe
     uc->verbose = 0;
     uc->watchtime = 0;
     uc->hashmode = HASH_EMPTY;
+    uc->chunking = 0;
     clear();
     scandir(updatepack_bp,NULL,true);
     strcpy(buffer,".deleted_items");
@@ -1355,19 +2419,125 @@ int UniCatalog::apply_update_package(const char *updatepack_bp,const char *targe
         return 1;
     }
     catalog_delete(&cat_file,i);
+    strcpy(buffer,".moved_items");
+    i = catalog_search(&cat_file,buffer);
+    bool moved = (i != NULL);
+    if(moved)
+        catalog_delete(&cat_file,i);
+    strcpy(buffer,".linked_items");
+    i = catalog_search(&cat_file,buffer);
+    bool linked = (i != NULL);
+    if(linked)
+        catalog_delete(&cat_file,i);
+    strcpy(buffer,".chunked_items");
+    i = catalog_search(&cat_file,buffer);
+    bool chunked = (i != NULL);
+    if(chunked)
+    {
+        catalog_delete(&cat_file,i);
+        //The stored chunks are not part of the target tree
+        struct cItem **lists[2] = { &cat_file , &cat_dir };
+        for(int l = 0 ; l < 2 ; ++l)
+        {
+            r = *lists[l];
+            while(r != NULL)
+            {
+                i = r;
+                r = r->n;
+                if(!strcmp(i->pathname,".chunks") || !strncmp(i->pathname,".chunks/",8))
+                    catalog_delete(lists[l],i);
+            }
+        }
+    }
     uc->restore();
 
+    //The chunks are read from the target files, which are changed by the interrupted run
+    if(chunked && uc->journal != NULL)
+    {
+        fprintf(stderr,"Error, The journal cannot be used with chunked update packages\n");
+        if(uc->guicall)
+            fflush(stderr);
+        clear();
+        return 1;
+    }
+
     if(PathMaker::mkpath(targetfolder_bp,false))
         return 1;
 
+    //Rebuild the chunked files to temporary files first, because they can refer
+    //to chunks of files which are deleted or overwritten by this update
+    struct RebuildItem *rebuilt = NULL;
+    if(chunked && rebuild_chunked_items(updatepack_bp,targetfolder_bp,&rebuilt))
+    {
+        finish_chunked_items(rebuilt,false);
+        clear();
+        return 1;
+    }
+
     FileCopier *copier = new FileCopier(uc);
 
     FILE *ef=NULL;
+    if(moved)
+    {
+        snprintf(srcbuf,512,"%s/.moved_items",updatepack_bp);
+        if((ef = fopen(srcbuf,"r")) == NULL)
+        {
+            fprintf(stderr,"Error, cannot open .moved_items file!");
+            finish_chunked_items(rebuilt,false);
+            clear();
+            delete copier;
+            return 1;
+        }
+        while(fgets(buffer,1024,ef) != NULL)
+        {
+            char *from,*to,*end,*mtime,*mode;
+            chop(buffer);
+            if(strncmp(buffer,"M*",2) || (to = strchr(buffer+2,'*')) == NULL || (end = strchr(to+1,'*')) == NULL)
+                continue;
+            from = buffer+2;
+            *to++ = '\0';
+            *end = '\0';
+            //M*from*to*mtime*mode* (the older packages have no time and mode)
+            mtime = mode = NULL;
+            if((mode = strchr(end+1,'*')) != NULL && strchr(mode+1,'*') != NULL)
+            {
+                mtime = end+1;
+                *mode++ = '\0';
+                *strchr(mode,'*') = '\0';
+            }
+            if(snprintf(srcbuf,512,"%s/%s",targetfolder_bp,from) >= 512 ||
+               snprintf(dstbuf,512,"%s/%s",targetfolder_bp,to) >= 512 ||
+               PathMaker::mkpath(dstbuf,true) || copier->movefile(srcbuf,dstbuf) != 0)
+            {
+                fprintf(stderr,"Error, cannot move file: %s -> %s\n",srcbuf,dstbuf);
+                finish_chunked_items(rebuilt,false);
+                delete copier;
+                fclose(ef);
+                return 1;
+            }
+            if(mtime != NULL)
+            {
+                struct utimbuf d_mt;
+                d_mt.actime = d_mt.modtime = (time_t)strtol(mtime,NULL,10);
+                if(utime(dstbuf,&d_mt) != 0 || chmod(dstbuf,strtoul(mode,NULL,8)) != 0)
+                {
+                    fprintf(stderr,"Error, cannot set times/mode of target file: %s\n",dstbuf);
+                    finish_chunked_items(rebuilt,false);
+                    delete copier;
+                    fclose(ef);
+                    return 1;
+                }
+            }
+        }
+        fclose(ef);
+    }
+
     snprintf(srcbuf,512,"%s/.deleted_items",updatepack_bp);
     ef = fopen(srcbuf,"r");
     if(ef == NULL)
     {
         fprintf(stderr,"Error, cannot open .deleted_items file!");
+        finish_chunked_items(rebuilt,false);
         clear();
         delete copier;
         return 1;
@@ -1383,6 +2553,7 @@ int UniCatalog::apply_update_package(const char *updatepack_bp,const char *targe
                 if(copier->deletefile(dstbuf) != 0)
                 {
                     fprintf(stderr,"Error, cannot delete file: %s\n",dstbuf);
+                    finish_chunked_items(rebuilt,false);
                     delete copier;
                     fclose(ef);
                     return 1;
@@ -1394,6 +2565,7 @@ int UniCatalog::apply_update_package(const char *updatepack_bp,const char *targe
                 if(copier->deletefolder(dstbuf) != 0)
                 {
                     fprintf(stderr,"Error, cannot delete folder: %s\n",dstbuf);
+                    finish_chunked_items(rebuilt,false);
                     delete copier;
                     fclose(ef);
                     return 1;
@@ -1409,29 +2581,375 @@ int UniCatalog::apply_update_package(const char *updatepack_bp,const char *targe
         snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
         if(PathMaker::mkpath(dstbuf,false))
         {
+            finish_chunked_items(rebuilt,false);
             delete copier;
             return 1;
         }
         r = r->n;
     }
 
+    CopyScheduler *scheduler = new CopyScheduler(uc,copier);
     r = cat_file;
     while(r != NULL)
     {
         snprintf(srcbuf,512,"%s/%s",updatepack_bp,wods(r->pathname));
         snprintf(dstbuf,512,"%s/%s",targetfolder_bp,wods(r->pathname));
-        if(copier->copy(srcbuf,dstbuf))
+        scheduler->add(srcbuf,dstbuf);
+        r = r->n;
+    }
+    if(scheduler->run())
+    {
+        finish_chunked_items(rebuilt,false);
+        delete scheduler;
+        delete copier;
+        return 1;
+    }
+    delete scheduler;
+    if(finish_chunked_items(rebuilt,true))
+    {
+        delete copier;
+        return 1;
+    }
+
+    if(linked)
+    {
+        snprintf(srcbuf,512,"%s/.linked_items",updatepack_bp);
+        if((ef = fopen(srcbuf,"r")) == NULL)
         {
+            fprintf(stderr,"Error, cannot open .linked_items file!");
             delete copier;
             return 1;
         }
-        r = r->n;
+        while(fgets(buffer,1024,ef) != NULL)
+        {
+            char *existing,*name,*end;
+            chop(buffer);
+            if(strncmp(buffer,"L*",2) || (name = strchr(buffer+2,'*')) == NULL || (end = strchr(name+1,'*')) == NULL)
+                continue;
+            existing = buffer+2;
+            *name++ = '\0';
+            *end = '\0';
+            if(snprintf(srcbuf,512,"%s/%s",targetfolder_bp,existing) >= 512 ||
+               snprintf(dstbuf,512,"%s/%s",targetfolder_bp,name) >= 512 ||
+               PathMaker::mkpath(dstbuf,true) || copier->linkfile(srcbuf,dstbuf))
+            {
+                fprintf(stderr,"Error, cannot link file: %s -> %s\n",dstbuf,srcbuf);
+                delete copier;
+                fclose(ef);
+                return 1;
+            }
+        }
+        fclose(ef);
     }
     copier->printStatistics();
     delete copier;
     return 0;
 }
 
+struct ChunkScanParam
+{
+    UniCatalog *catalog;
+    FILE *catstream;
+    struct ChunkFile *file;
+};
+
+int UniCatalog::scan_chunks_callback(const struct ChunkInfo *chunk,const unsigned char *data,void *param)
+{
+    struct ChunkScanParam *csp = (struct ChunkScanParam *)param;
+    if(csp->catstream != NULL)
+        fprintf(csp->catstream,"C*%llu*%u*%s*\n",chunk->offset,chunk->length,chunk->hash);
+    if(csp->file != NULL)
+        csp->catalog->chunk_add(NULL,csp->file,chunk);
+    return 0;
+}
+
+/* Chunk the scanned file, write the chunk list to the catalog and/or add chunks to the chunk index */
+int UniCatalog::scan_chunks(const char *fullpath,const char *path,FILE *catstream,bool build_icat)
+{
+    struct ChunkScanParam csp;
+    csp.catalog = this;
+    csp.catstream = catstream;
+    csp.file = build_icat ? chunkfile_new(path) : NULL;
+    return chunkfile(fullpath,uc->chunkmin,uc->chunkavg,uc->chunkmax,scan_chunks_callback,&csp);
+}
+
+struct ChunkCollect
+{
+    struct ChunkInfo *items;
+    unsigned int count,alloc;
+};
+
+static int collect_chunks_callback(const struct ChunkInfo *chunk,const unsigned char *data,void *param)
+{
+    struct ChunkCollect *cc = (struct ChunkCollect *)param;
+    if(cc->count == cc->alloc)
+    {
+        cc->alloc = cc->alloc * 2 + 64;
+        struct ChunkInfo *ni = new ChunkInfo[cc->alloc];
+        if(cc->items != NULL)
+            memcpy(ni,cc->items,cc->count * sizeof(struct ChunkInfo));
+        delete[] cc->items;
+        cc->items = ni;
+    }
+    cc->items[cc->count++] = *chunk;
+    return 0;
+}
+
+/* Puts a new or modified file to the update package as a list of chunks.
+   The chunks known by the catalog's chunk index are refered as local (L) chunks,
+   the others are stored in the package once (P). If none of the chunks are known
+   the file is copied as is, and its chunks are refered from the copied file. */
+int UniCatalog::make_chunked_item(const char *sourcefolder_bp,const char *updatepack_bp,struct cItem *item,
+                                  FileCopier *copier,FILE *recipe,HashIndex *packindex)
+{
+    char srcbuf[512];
+    char dstbuf[512];
+    struct ChunkCollect cc;
+    struct ChunkRef *ref;
+    struct stat st;
+    unsigned int c,known = 0;
+
+    snprintf(srcbuf,512,"%s/%s",sourcefolder_bp,wods(item->pathname));
+    snprintf(dstbuf,512,"%s/%s",updatepack_bp,wods(item->pathname));
+
+    cc.items = NULL;
+    cc.count = cc.alloc = 0;
+    if(stat(srcbuf,&st) != 0 || chunkfile(srcbuf,uc->chunkmin,uc->chunkavg,uc->chunkmax,collect_chunks_callback,&cc))
+    {
+        fprintf(stderr,"Error, Cannot read file to chunk: %s\n",srcbuf);
+        if(uc->guicall)
+            fflush(stderr);
+        delete[] cc.items;
+        return 1;
+    }
+    for(c = 0 ; c < cc.count ; ++c)
+        if((chunkindex != NULL && chunkindex->find(cc.items[c].hash) != NULL) || packindex->find(cc.items[c].hash) != NULL)
+            ++known;
+
+    if(known == 0)
+    {
+        if(copier->copy(srcbuf,dstbuf))
+        {
+            delete[] cc.items;
+            return 1;
+        }
+        struct ChunkFile *file = chunkfile_new(wods(item->pathname));
+        for(c = 0 ; c < cc.count ; ++c)
+            chunk_add(packindex,file,&cc.items[c]);
+        delete[] cc.items;
+        return 0;
+    }
+
+    if(uc->verbose > 1)
+    {
+        printf("Chunk %s (%u of %u chunks known)...\n",srcbuf,known,cc.count);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+
+    FILE *src = fopen(srcbuf,"rb");
+    if(src == NULL)
+    {
+        delete[] cc.items;
+        return 1;
+    }
+    unsigned char *buff = new unsigned char[uc->chunkmax];
+    fprintf(recipe,"F*%s*%llu*%ld*%o*\n",wods(item->pathname),(unsigned long long)st.st_size,(long)st.st_mtime,(unsigned int)st.st_mode);
+    for(c = 0 ; c < cc.count ; ++c)
+    {
+        struct ChunkInfo *ci = &cc.items[c];
+        if(chunkindex != NULL && (ref = (struct ChunkRef *)chunkindex->find(ci->hash)) != NULL)
+        {
+            fprintf(recipe,"L*%u*%s*%llu*%s*\n",ci->length,ci->hash,ref->offset,ref->file->path);
+            continue;
+        }
+        if((ref = (struct ChunkRef *)packindex->find(ci->hash)) == NULL)
+        {
+            FILE *cf;
+            snprintf(dstbuf,512,"%s/.chunks/%s",updatepack_bp,ci->hash);
+            Throttle::consume(THROTTLE_READ,ci->length);
+            Throttle::consume(THROTTLE_WRITE,ci->length);
+            if(PathMaker::mkpath(dstbuf,true) ||
+               fseeko(src,ci->offset,SEEK_SET) != 0 || fread(buff,1,ci->length,src) != ci->length ||
+               (cf = fopen(dstbuf,"wb")) == NULL)
+            {
+                fprintf(stderr,"Error, cannot store chunk: %s\n",dstbuf);
+                delete[] buff;
+                delete[] cc.items;
+                fclose(src);
+                return 1;
+            }
+            if(fwrite(buff,1,ci->length,cf) != ci->length)
+            {
+                fprintf(stderr,"Error, cannot store chunk: %s\n",dstbuf);
+                fclose(cf);
+                delete[] buff;
+                delete[] cc.items;
+                fclose(src);
+                return 1;
+            }
+            fclose(cf);
+            copier->ckbytes += ((double)ci->length) / 1024;
+            struct ChunkInfo stored = *ci;
+            stored.offset = 0;
+            ref = chunk_add(packindex,NULL,&stored);
+        }
+        if(ref->file == NULL)
+            fprintf(recipe,"P*%u*%s*0*.chunks/%s*\n",ci->length,ci->hash,ci->hash);
+        else
+            fprintf(recipe,"P*%u*%s*%llu*%s*\n",ci->length,ci->hash,ref->offset,ref->file->path);
+    }
+    delete[] buff;
+    delete[] cc.items;
+    fclose(src);
+    return 0;
+}
+
+/* Rebuilds every file of the .chunked_items recipe to a temporary file in the target folder.
+   The chunks are read from the target folder (L) or from the package (P) and checked by hash. */
+int UniCatalog::rebuild_chunked_items(const char *updatepack_bp,const char *targetfolder_bp,struct RebuildItem **rebuilt)
+{
+    char buffer[1024];
+    char srcbuf[512];
+    char openedpath[512];
+    char hexhash[80];
+    char *tok,*ftok[5];
+    int i,count = 0;
+    FILE *rf,*src = NULL,*dst = NULL;
+    struct RebuildItem *ri = NULL;
+
+    snprintf(srcbuf,512,"%s/.chunked_items",updatepack_bp);
+    if((rf = fopen(srcbuf,"r")) == NULL)
+    {
+        fprintf(stderr,"Error, cannot open .chunked_items file!\n");
+        return 1;
+    }
+
+    unsigned char *buff = new unsigned char[CHUNK_MAX_DEFAULT];
+    unsigned int buffsize = CHUNK_MAX_DEFAULT;
+    openedpath[0] = '\0';
+    bool error = false;
+    while(!error && fgets(buffer,1024,rf) != NULL)
+    {
+        chop(buffer);
+        char typ = buffer[0];
+        tok = strtok(buffer,"*");
+        for(i = 0 ; i < 5 && (tok = strtok(NULL,"*")) != NULL ; ++i)
+            ftok[i] = tok;
+
+        if(typ == 'F' && i >= 4)
+        {
+            if(dst != NULL && fclose(dst) != 0)
+                error = true;
+            ri = new RebuildItem();
+            snprintf(ri->tmppath,512,"%s/.unisync_rebuild_%d",targetfolder_bp,++count);
+            snprintf(ri->path,512,"%s/%s",targetfolder_bp,ftok[0]);
+            ri->mtime = (time_t)strtol(ftok[2],NULL,10);
+            ri->mode = strtoul(ftok[3],NULL,8);
+            ri->n = *rebuilt;
+            *rebuilt = ri;
+            if(uc->verbose > 1)
+            {
+                printf("Rebuild %s from chunks...\n",ri->path);
+                if(uc->guicall)
+                    fflush(stdout);
+            }
+            if((dst = fopen(ri->tmppath,"wb")) == NULL)
+            {
+                fprintf(stderr,"Error, cannot write file: %s\n",ri->tmppath);
+                error = true;
+            }
+            continue;
+        }
+        if((typ == 'L' || typ == 'P') && i == 4 && dst != NULL)
+        {
+            unsigned int length = strtoul(ftok[0],NULL,10);
+            unsigned long long offset = strtoull(ftok[2],NULL,10);
+            snprintf(srcbuf,512,"%s/%s",typ == 'L' ? targetfolder_bp : updatepack_bp,ftok[3]);
+            if(strcmp(srcbuf,openedpath))
+            {
+                if(src != NULL)
+                    fclose(src);
+                strcpy(openedpath,srcbuf);
+                src = fopen(srcbuf,"rb");
+            }
+            if(length > buffsize)
+            {
+                delete[] buff;
+                buffsize = length;
+                buff = new unsigned char[buffsize];
+            }
+            Throttle::consume(THROTTLE_READ,length);
+            Throttle::consume(THROTTLE_WRITE,length);
+            if(src == NULL || fseeko(src,offset,SEEK_SET) != 0 || fread(buff,1,length,src) != length)
+            {
+                fprintf(stderr,"Error, cannot read chunk from: %s\n",srcbuf);
+                error = true;
+                continue;
+            }
+            Hasher hasher(HASH_SHA256);
+            hasher.update(buff,length);
+            hasher.final(hexhash,0);
+            if(strcmp(hexhash,ftok[1]))
+            {
+                fprintf(stderr,"Error, chunk content changed in: %s\n",srcbuf);
+                error = true;
+                continue;
+            }
+            if(fwrite(buff,1,length,dst) != length)
+            {
+                fprintf(stderr,"Error, cannot write file: %s\n",ri->tmppath);
+                error = true;
+            }
+        }
+    }
+    if(dst != NULL && fclose(dst) != 0)
+        error = true;
+    if(src != NULL)
+        fclose(src);
+    fclose(rf);
+    delete[] buff;
+    return error ? 1 : 0;
+}
+
+/* Moves the rebuilt temporary files to their final place (commit) or removes them */
+int UniCatalog::finish_chunked_items(struct RebuildItem *rebuilt,bool commit)
+{
+    int r = 0;
+    struct RebuildItem *old;
+    struct utimbuf d_mt;
+
+    while(rebuilt != NULL)
+    {
+        if(commit && r == 0)
+        {
+            if(PathMaker::mkpath(rebuilt->path,true))
+                r = 1;
+#ifdef _WIN32
+            unlink(rebuilt->path);
+#endif
+            if(r == 0 && rename(rebuilt->tmppath,rebuilt->path) != 0)
+            {
+                fprintf(stderr,"Error, cannot rename rebuilt file to: %s\n",rebuilt->path);
+                r = 1;
+            }
+            d_mt.actime = rebuilt->mtime;
+            d_mt.modtime = rebuilt->mtime;
+            if(r == 0 && (utime(rebuilt->path,&d_mt) != 0 || chmod(rebuilt->path,rebuilt->mode) != 0))
+            {
+                fprintf(stderr,"Error, cannot set times/mode of target file: %s\n",rebuilt->path);
+                r = 1;
+            }
+        }
+        if(!commit || r != 0)
+            unlink(rebuilt->tmppath);
+        old = rebuilt;
+        rebuilt = rebuilt->n;
+        delete old;
+    }
+    return r;
+}
+
 /* ******************************************************************************** */
 void UniCatalog::free_catalog(struct cItem** cpointer)
 {
@@ -1445,6 +2963,42 @@ void UniCatalog::free_catalog(struct cItem** cpointer)
     *cpointer = NULL;
 }
 
+/* Replaces the catalog with a copy of the scanned (not yet diffed) other catalog.
+   The multi-destination sync scans and hashes the source once and diffs a copy for every destination. */
+void UniCatalog::copy_from(UniCatalog *other)
+{
+    struct cItem *r,*item,*tail;
+    struct cItem **lists[2] = { &cat_file , &cat_dir };
+    struct cItem *from[2] = { other->cat_file , other->cat_dir };
+
+    clear();
+    for(int l = 0 ; l < 2 ; ++l)
+    {
+        tail = NULL;
+        for(r = from[l] ; r != NULL ; r = r->n)
+        {
+            item = new cItem();
+            *item = *r;
+            item->blockdiff = NULL;
+            item->movedfrom = NULL;
+            item->linkto = item->cloneof = NULL;
+            if(r->blockhashes != NULL)
+            {
+                item->blockhashes = new char[r->blockcount * BLOCKHASH_WIDTH];
+                memcpy(item->blockhashes,r->blockhashes,r->blockcount * BLOCKHASH_WIDTH);
+            }
+            //Appended to the end as catalog_push does
+            item->n = NULL;
+            item->p = tail;
+            if(tail == NULL)
+                *lists[l] = item;
+            else
+                tail->n = item;
+            tail = item;
+        }
+    }
+}
+
 void UniCatalog::catalog_push(struct cItem** cpointer,struct cItem *item)
 {
     item->n = NULL;
@@ -1522,10 +3076,69 @@ void UniCatalog::clear(void)
     free_catalog(&cat_file_mod);
     free_catalog(&cat_file_new);
     free_catalog(&cat_file_fixtime);
+    free_catalog(&cat_file_moved);
     free_catalog(&cat_dir);
     free_catalog(&cat_dir_ok);
     free_catalog(&cat_dir_mod);
     free_catalog(&cat_dir_new);
+    free_chunks();
+    origin[0] = '\0';
+}
+
+void UniCatalog::free_chunks(void)
+{
+    struct ChunkRef *oldref;
+    struct ChunkFile *oldfile;
+
+    while(chunkrefs != NULL)
+    {
+        oldref = chunkrefs;
+        chunkrefs = chunkrefs->n;
+        delete oldref;
+    }
+    while(chunkfiles != NULL)
+    {
+        oldfile = chunkfiles;
+        chunkfiles = chunkfiles->n;
+        delete oldfile;
+    }
+    delete chunkindex;
+    chunkindex = NULL;
+}
+
+struct ChunkFile *UniCatalog::chunkfile_new(const char *path)
+{
+    struct ChunkFile *file = new ChunkFile();
+    snprintf(file->path,sizeof(file->path),"%s",path);
+    file->n = chunkfiles;
+    chunkfiles = file;
+    return file;
+}
+
+/* Registers the chunk to the index if the index does not know it yet.
+   The index is created on first use if NULL passed (the catalog's own chunk index) */
+struct ChunkRef *UniCatalog::chunk_add(HashIndex *index,struct ChunkFile *file,const struct ChunkInfo *ci)
+{
+    struct ChunkRef *ref;
+
+    if(index == NULL)
+    {
+        if(chunkindex == NULL)
+            chunkindex = new HashIndex(1 << 20);
+        index = chunkindex;
+    }
+    ref = (struct ChunkRef *)index->find(ci->hash);
+    if(ref != NULL)
+        return ref;
+
+    ref = new ChunkRef();
+    ref->file = file;
+    ref->offset = ci->offset;
+    ref->length = ci->length;
+    ref->n = chunkrefs;
+    chunkrefs = ref;
+    index->add(ci->hash,ref);
+    return ref;
 }
 
 /* end code */
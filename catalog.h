@@ -9,6 +9,11 @@
 #ifndef UNISYNC_CATALOG_H
 #define UNISYNC_CATALOG_H
 
+#include "utils.h"
+
+class SyncPlan;
+class ThreeWaySync;
+
 #define DIRECTION_CAT_TO_DIFF   0
 #define DIRECTION_DIFF_TO_CAT   1
 
@@ -19,19 +24,74 @@
 #define STATUS_TIMEDIFF         4
 #define STATUS_FIXTIME          9
 
+#define BLOCKHASH_WIDTH         65
+
+void time_to_str(const time_t *t,char *buffer);
+char *wods(char *strptr);
+
 struct cItem
 {
     char pathname[300];
-    unsigned int size;
+    unsigned long long size;
     char time[32];
     char htype;
     char hash[70];
+    char fprint[70];
     char status;
+
+    //Optional block hash list: blockcount hashes of blocksize bytes (BLOCKHASH_WIDTH chars each)
+    unsigned int blocksize;
+    unsigned int blockcount;
+    char *blockhashes;
+    unsigned char *blockdiff; //Filled by diff: non zero means the block is changed
+
+    //Device and inode of the scanned file, or from the catalog (I:dev:ino) if it was created with -moves
+    unsigned long long dev,ino;
+    //Move detection: the item can be made by renaming this file (the path is on the deleted side)
+    char *movedfrom;
+    //Hardlinks: link count of the scanned file, and the identity of the same path found by the diff
+    unsigned int nlink;
+    unsigned long long diffdev,diffino;
+    unsigned int diffnlink;
+    //Hardlinks: the item is created as a link of this item instead of a copy
+    struct cItem *linkto;
+    //Dedup: the item is created from the target file of this item (same size and hash) instead of a copy
+    struct cItem *cloneof;
+
     struct cItem *n,*p;
+
+    ~cItem(void) { delete[] blockhashes; delete[] blockdiff; free(movedfrom); }
+};
+
+/* Chunk index: where the content of a chunk can be found */
+struct ChunkFile
+{
+    char path[300];
+    struct ChunkFile *n;
+};
+
+struct ChunkRef
+{
+    struct ChunkFile *file;
+    unsigned long long offset;
+    unsigned int length;
+    struct ChunkRef *n;
+};
+
+/* A file of an update package which is rebuilt from chunks to a temporary file */
+struct RebuildItem
+{
+    char tmppath[512];
+    char path[512];
+    time_t mtime;
+    unsigned int mode;
+    struct RebuildItem *n;
 };
 
 class UniCatalog
 {
+    friend class ThreeWaySync;
+
 public:
     UniCatalog(UniSyncConfig *ucp);
     ~UniCatalog(void);
@@ -40,14 +100,19 @@ public:
     int  read(const char *filename);
     int  scandir(const char *basedir,FILE *catstream,bool build_icat=false);
     int  scandir_diff(const char *basedir);
-    int  scandir_sync(const char *sourcefolder_bp,const char *targetfolder_bp,int direction);
+    int  scandir_sync(const char *sourcefolder_bp,const char *targetfolder_bp,int direction,FILE *catstream = NULL);
     int  make_update_package(const char *sourcefolder_bp,const char *updatepack_bp);
     int  apply_update_package(const char *updatepack_bp,const char *targetfolder_bp);
     int  print_sync_procedures(const char *sourcefolder_bp,const char *targetfolder_bp,int direction);
+    int  detect_moves(int direction,const char *catalog_bp,const char *diffed_bp);
+    void build_sync_plan(SyncPlan *plan,int direction);
+    void copy_from(UniCatalog *other);
 
     void rawPrint(void);
     void diffresultPrint(void);
 
+    void setKeepMatched(bool keep);
+
 private:
     int  scandir_in(const char *basedir,const char *dirname,FILE *catstream,bool build_icat);
     int  scandir_diff_in(const char *basedir,const char *dirname);
@@ -64,6 +129,30 @@ private:
     void catalog_delete(struct cItem** fromcatalog,struct cItem* item);
     void catalog_move(struct cItem** fromcatalog,struct cItem* item,struct cItem** targetcatalog);
     void printStatistics(const char *funcname);
+    void write_catalog_item(FILE *catstream,struct cItem *item,bool isdir);
+    void write_block_hashes(FILE *catstream,unsigned int blocksize,unsigned int blockcount,const char *blockhashes);
+    void compare_block_hashes(struct cItem *item,const char *fullpath);
+    void print_block_ranges(struct cItem *item);
+    bool same_content(struct cItem *a,const char *a_bp,struct cItem *b,const char *b_bp);
+    int  move_files(const char *sourcefolder_bp,const char *targetfolder_bp,FileCopier *copier);
+    int  find_links(int direction,struct cItem **copylists,int listcount);
+    int  find_clones(struct cItem **copylists,int listcount);
+    void clone_key(char *key,struct cItem *r);
+    void write_sync_catalog(FILE *catstream,int direction);
+    HashIndex *deleted_folders(int direction);
+    int  delete_items(const char *targetfolder_bp,int direction,FileCopier *copier);
+    HashIndex *new_folders(int direction);
+    HashIndex *tree_skips(struct cItem **copylists,int listcount);
+
+    struct ChunkRef *chunk_add(HashIndex *index,struct ChunkFile *file,const struct ChunkInfo *ci);
+    struct ChunkFile *chunkfile_new(const char *path);
+    int  scan_chunks(const char *fullpath,const char *path,FILE *catstream,bool build_icat);
+    static int scan_chunks_callback(const struct ChunkInfo *chunk,const unsigned char *data,void *param);
+    int  make_chunked_item(const char *sourcefolder_bp,const char *updatepack_bp,struct cItem *item,
+                           FileCopier *copier,FILE *recipe,HashIndex *packindex);
+    int  rebuild_chunked_items(const char *updatepack_bp,const char *targetfolder_bp,struct RebuildItem **rebuilt);
+    int  finish_chunked_items(struct RebuildItem *rebuilt,bool commit);
+    void free_chunks(void);
 
     bool needExclude(int typ,char *name);
 
@@ -77,12 +166,20 @@ private:
     struct cItem *cat_file_mod;
     struct cItem *cat_file_new;
     struct cItem *cat_file_fixtime;
+    struct cItem *cat_file_moved;
 
     struct cItem *cat_dir;
     struct cItem *cat_dir_ok;
     struct cItem *cat_dir_mod;
     struct cItem *cat_dir_new;
 
+    bool keep_matched;
+    char origin[128];           //The scanned folder of the -moves catalog (host:device:inode), see detect_moves
+
+    HashIndex *chunkindex;
+    struct ChunkFile *chunkfiles;
+    struct ChunkRef *chunkrefs;
+
     double sizec;
     time_t ts,te;
 };
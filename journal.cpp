@@ -0,0 +1,263 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <mutex>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "unisync.h"
+#include "utils.h"
+#include "journal.h"
+
+static std::mutex journal_mutex;
+
+SyncJournal::SyncJournal(UniSyncConfig *ucp,const char *filename)
+{
+    uc = ucp;
+    //A too long name is rejected by open(), the empty names are never resumable
+    toolong = strlen(filename) + strlen(JOURNAL_PLANSUFFIX) >= 512;
+    this->filename[0] = '\0';
+    planname[0] = '\0';
+    if(!toolong)
+    {
+        strcpy(this->filename,filename);
+        strcpy(planname,filename);
+        strcat(planname,JOURNAL_PLANSUFFIX);
+    }
+    f = NULL;
+    records = new HashIndex();
+    progresses = NULL;
+    unsynced = 0;
+    resumed = false;
+    byops = false;
+    kept = false;
+    failed = false;
+}
+
+SyncJournal::~SyncJournal(void)
+{
+    struct JournalProgress *p;
+    if(f != NULL)
+        fclose(f);
+    delete records;
+    while(progresses != NULL)
+    {
+        p = progresses;
+        progresses = p->n;
+        delete p;
+    }
+}
+
+/* The journal and the plan of an interrupted sync exist */
+bool SyncJournal::resumable(void)
+{
+    struct stat st;
+    return stat(filename,&st) == 0 && stat(planname,&st) == 0;
+}
+
+/* Opens the journal for append. With resume the records of the interrupted run are read first
+   (a missing journal starts a new one), otherwise the journal is started empty. */
+int SyncJournal::open(bool resume)
+{
+    struct stat st;
+
+    if(toolong)
+    {
+        fprintf(stderr,"Error, the journal file name is too long\n");
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+    if(resume && stat(filename,&st) == 0)
+    {
+        if(read())
+            return 1;
+        resumed = true;
+        f = fopen(filename,"a");
+    }
+    else
+    {
+        unlink(planname);
+        if((f = fopen(filename,"w")) != NULL)
+            append(JOURNAL_HEADER "\n",true);
+    }
+    if(f == NULL)
+    {
+        fprintf(stderr,"Error, cannot write the journal file: %s\n",filename);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+    return 0;
+}
+
+/* Reads the records. The lines are: KIND*PATH* and P*OFFSET*SIZE*MTIME*PATH* */
+int SyncJournal::read(void)
+{
+    char buffer[1024];
+    char key[600];
+    char *path,*end;
+    unsigned long long offset,size;
+    long long mtime;
+    int used,count = 0;
+    FILE *jf;
+
+    if((jf = fopen(filename,"r")) == NULL || fgets(buffer,1024,jf) == NULL || strcmp(buffer,JOURNAL_HEADER "\n"))
+    {
+        fprintf(stderr,"Error, invalid journal file: %s\n",filename);
+        if(uc->guicall)
+            fflush(stderr);
+        if(jf != NULL)
+            fclose(jf);
+        return 1;
+    }
+    while(fgets(buffer,1024,jf) != NULL)
+    {
+        //The last line can be torn by the interruption
+        if(buffer[0] == '\0' || buffer[strlen(buffer)-1] != '\n' || buffer[1] != '*' || (end = strrchr(buffer,'*')) == buffer+1)
+            continue;
+        *end = '\0';
+        path = buffer+2;
+        if(buffer[0] == JOURNAL_PROGRESS)
+        {
+            if(sscanf(path,"%llu*%llu*%lld*%n",&offset,&size,&mtime,&used) != 3)
+                continue;
+            path += used;
+            if(snprintf(key,600,"%c*%s",JOURNAL_PROGRESS,path) >= 600)
+                continue;
+            struct JournalProgress *p = (struct JournalProgress *)records->find(key);
+            if(p == NULL)
+            {
+                p = new JournalProgress();
+                p->n = progresses;
+                progresses = p;
+                records->add(key,p);
+            }
+            p->offset = offset;
+            p->size = size;
+            p->mtime = mtime;
+            continue;
+        }
+        //Not written by done(), the paths are shorter
+        if(snprintf(key,600,"%c*%s",buffer[0],path) >= 600)
+            continue;
+        if(records->find(key) == NULL)
+        {
+            records->add(key,this);
+            ++count;
+        }
+    }
+    fclose(jf);
+    if(uc->verbose > 0)
+    {
+        printf("Resume: %d operations are done by the interrupted run\n",count);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    return 0;
+}
+
+/* Called with locked mutex */
+void SyncJournal::append(const char *line,bool sync)
+{
+    if(f == NULL || failed)
+        return;
+    if(fputs(line,f) < 0 || fflush(f) != 0)
+    {
+        //The run goes on, the resume redoes the unrecorded operations
+        fprintf(stderr,"Error, cannot write the journal file: %s\n",filename);
+        if(uc->guicall)
+            fflush(stderr);
+        failed = true;
+        return;
+    }
+#ifndef _WIN32
+    if(sync || ++unsynced >= JOURNAL_SYNC_RECORDS)
+    {
+        fdatasync(fileno(f));
+        unsynced = 0;
+    }
+#else
+    (void)sync;
+#endif
+}
+
+void SyncJournal::done(char kind,const char *path)
+{
+    char line[600];
+    snprintf(line,600,"%c*%s*\n",kind,path);
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    append(line,false);
+}
+
+bool SyncJournal::isdone(char kind,const char *path)
+{
+    char key[600];
+    if(!resumed)
+        return false;
+    snprintf(key,600,"%c*%s",kind,path);
+    return records->find(key) != NULL;
+}
+
+/* The first offset bytes of path are copied and synced, src is the source file */
+void SyncJournal::progress(const char *path,unsigned long long offset,const struct stat *src)
+{
+    char line[600];
+    snprintf(line,600,"%c*%llu*%llu*%lld*%s*\n",JOURNAL_PROGRESS,offset,
+             (unsigned long long)src->st_size,(long long)src->st_mtime,path);
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    append(line,true);
+}
+
+/* The offset where the copy of path can be continued, 0 if it is not recorded or the source changed since */
+unsigned long long SyncJournal::resumeoffset(const char *path,const struct stat *src)
+{
+    char key[600];
+    struct JournalProgress *p;
+    if(!resumed)
+        return 0;
+    snprintf(key,600,"%c*%s",JOURNAL_PROGRESS,path);
+    if((p = (struct JournalProgress *)records->find(key)) == NULL ||
+       p->size != (unsigned long long)src->st_size || p->mtime != (long long)src->st_mtime)
+        return 0;
+    return p->offset;
+}
+
+/* Closes the journal. It is removed with the plan if the run is complete (result 0, nothing left) */
+int SyncJournal::close(int result)
+{
+    if(f != NULL)
+    {
+#ifndef _WIN32
+        fdatasync(fileno(f));
+#endif
+        fclose(f);
+        f = NULL;
+    }
+    if(result == 0 && !kept)
+    {
+        unlink(filename);
+        unlink(planname);
+    }
+    else if(uc->verbose > 0)
+    {
+        printf("The journal is kept, continue with -resume: %s\n",filename);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    return result;
+}
+
+/* end code */
@@ -0,0 +1,88 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+#ifndef UNISYNC_JOURNAL_H
+#define UNISYNC_JOURNAL_H
+
+#include "unisync.h"
+#include "utils.h"
+
+/* The kinds of the journal records */
+#define JOURNAL_COPY        'C'
+#define JOURNAL_DELETE      'X'
+#define JOURNAL_RMDIR       'R'
+#define JOURNAL_MOVE        'M'
+#define JOURNAL_LINK        'L'
+#define JOURNAL_OP          'O'     //An operation of the sync plan: type:path
+#define JOURNAL_PROGRESS    'P'     //Copied and synced part of a big file
+
+#define JOURNAL_HEADER      "J*unisync-journal*"
+#define JOURNAL_PLANSUFFIX  ".plan"
+
+/* The big files are copied in pieces of JOURNAL_CHECKPOINT bytes, the end of every piece is synced
+   and recorded, so an interrupted copy can be continued. The journal itself is synced after
+   JOURNAL_SYNC_RECORDS records (the lost records are redone, the operations can be repeated). */
+#define JOURNAL_CHECKPOINT      (128*1024*1024)
+#define JOURNAL_SYNC_RECORDS    1000
+#define JOURNAL_VERIFY_BLOCK    65536
+
+struct stat;
+
+struct JournalProgress
+{
+    unsigned long long offset;
+    unsigned long long size;    //The state of the source when the piece was copied
+    long long mtime;
+    struct JournalProgress *n;
+};
+
+/* Append-only journal of the completed operations (-journal=FILE). Every record is one text line,
+   a torn last line is ignored. With -resume the records of the interrupted run are read back:
+   the done operations are skipped and the partially copied big files are continued.
+   The sync stores its plan beside the journal (FILE.plan), so the resume does not scan the folders.
+   The journal is removed when the run is complete. */
+class SyncJournal
+{
+public:
+    SyncJournal(UniSyncConfig *ucp,const char *filename);
+    ~SyncJournal(void);
+
+    int  open(bool resume);
+    int  close(int result);
+    bool resumable(void);
+    bool resuming(void) { return resumed; }
+    const char *planfile(void) { return planname; }
+
+    void planned(void) { byops = true; }
+    bool perfile(void) { return !byops; }
+    void keep(void) { kept = true; }
+
+    void done(char kind,const char *path);
+    bool isdone(char kind,const char *path);
+    void progress(const char *path,unsigned long long offset,const struct stat *src);
+    unsigned long long resumeoffset(const char *path,const struct stat *src);
+
+private:
+    UniSyncConfig *uc;
+    char filename[512];
+    char planname[512];
+    bool toolong;
+    FILE *f;
+    HashIndex *records;
+    struct JournalProgress *progresses;
+    int unsynced;
+    bool resumed;
+    bool byops;
+    bool kept;
+    bool failed;
+
+    int  read(void);
+    void append(const char *line,bool sync);
+};
+
+#endif // UNISYNC_JOURNAL_H
@@ -0,0 +1,232 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <thread>
+#include <mutex>
+
+#include "unisync.h"
+#include "utils.h"
+#include "catalog.h"
+#include "scheduler.h"
+#include "uringcopy.h"
+
+static std::mutex scheduler_mutex;
+
+/* The time of the catalog item (local time, see time_to_str) */
+static long long item_mtime(const char *str)
+{
+    struct tm tm;
+    memset(&tm,0,sizeof(tm));
+    if(sscanf(str,"%d-%d-%d_%d:%d:%d",&tm.tm_year,&tm.tm_mon,&tm.tm_mday,&tm.tm_hour,&tm.tm_min,&tm.tm_sec) != 6)
+        return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    return (long long)mktime(&tm);
+}
+
+static int compare_small(const void *a,const void *b)
+{
+    const struct CopyOrderKey *ka = (const struct CopyOrderKey *)a,*kb = (const struct CopyOrderKey *)b;
+    return ka->size < kb->size ? -1 : (ka->size > kb->size ? 1 : 0);
+}
+
+static int compare_large(const void *a,const void *b)
+{
+    return compare_small(b,a);
+}
+
+static int compare_newest(const void *a,const void *b)
+{
+    const struct CopyOrderKey *ka = (const struct CopyOrderKey *)a,*kb = (const struct CopyOrderKey *)b;
+    return ka->mtime > kb->mtime ? -1 : (ka->mtime < kb->mtime ? 1 : 0);
+}
+
+/* Sorts the copies by the policy: small files first (most files done early), large files first (sustained
+   bandwidth), newest first (the recently modified data is protected first), or mixed: the smallest and the
+   largest files alternately, so the parallel workers keep the metadata and the data path busy at the same time */
+void order_copies(int policy,struct CopyOrderKey *keys,int count)
+{
+    if(count < 2 || policy == COPYORDER_SCAN)
+        return;
+    if(policy == COPYORDER_NEWEST)
+    {
+        qsort(keys,count,sizeof(struct CopyOrderKey),compare_newest);
+        return;
+    }
+    qsort(keys,count,sizeof(struct CopyOrderKey),policy == COPYORDER_LARGE ? compare_large : compare_small);
+    if(policy == COPYORDER_MIXED)
+    {
+        struct CopyOrderKey *sorted = new CopyOrderKey[count];
+        memcpy(sorted,keys,count * sizeof(struct CopyOrderKey));
+        for(int i = 0,lo = 0,hi = count - 1 ; i < count ; ++i)
+            keys[i] = sorted[(i % 2) == 0 ? lo++ : hi--];
+        delete[] sorted;
+    }
+}
+
+CopyScheduler::CopyScheduler(UniSyncConfig *ucp,FileCopier *mastercopier)
+{
+    uc = ucp;
+    master = mastercopier;
+    first = last = next = NULL;
+    failed = 0;
+}
+
+CopyScheduler::~CopyScheduler(void)
+{
+    struct CopyJob *old;
+    while(first != NULL)
+    {
+        old = first;
+        first = first->n;
+        delete old;
+    }
+}
+
+void CopyScheduler::add(const char *source,const char *dest,struct cItem *item)
+{
+    struct CopyJob *job = new CopyJob();
+    strncpy(job->source,source,511);
+    strncpy(job->dest,dest,511);
+    job->item = item;
+    job->size = 0;
+    job->mtime = 0;
+    if(uc->copyorder != COPYORDER_SCAN)
+    {
+        struct stat st;
+        //The scanned item knows the size and time already
+        if(item != NULL)
+        {
+            job->size = item->size;
+            job->mtime = item_mtime(item->time);
+        }
+        else if(stat(source,&st) == 0)
+        {
+            job->size = (unsigned long long)st.st_size;
+            job->mtime = (long long)st.st_mtime;
+        }
+    }
+    job->n = NULL;
+    if(last == NULL)
+        first = job;
+    else
+        last->n = job;
+    last = job;
+}
+
+struct CopyJob *CopyScheduler::take(void)
+{
+    struct CopyJob *job;
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    if(failed || next == NULL)
+        return NULL;
+    job = next;
+    next = next->n;
+    return job;
+}
+
+void CopyScheduler::worker(void)
+{
+    struct CopyJob *job;
+    FileCopier *copier = new FileCopier(uc);
+    while((job = take()) != NULL)
+    {
+        if(copier->copy(job->source,job->dest,job->item))
+        {
+            std::lock_guard<std::mutex> lock(scheduler_mutex);
+            failed = 1;
+        }
+    }
+    int r = copier->commit(true);
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    if(r)
+        failed = 1;
+    master->addCounters(copier);
+    delete copier;
+}
+
+/* Reorders the job list by uc->copyorder */
+void CopyScheduler::order(void)
+{
+    struct CopyJob *job;
+    int i,count = 0;
+
+    for(job = first ; job != NULL ; job = job->n)
+        ++count;
+    if(count < 2 || uc->copyorder == COPYORDER_SCAN)
+        return;
+    struct CopyOrderKey *keys = new CopyOrderKey[count];
+    for(i = 0,job = first ; job != NULL ; job = job->n,++i)
+    {
+        keys[i].size = job->size;
+        keys[i].mtime = job->mtime;
+        keys[i].data = job;
+    }
+    order_copies(uc->copyorder,keys,count);
+    first = (struct CopyJob *)keys[0].data;
+    for(i = 0 ; i < count ; ++i)
+        ((struct CopyJob *)keys[i].data)->n = (i + 1 < count ? (struct CopyJob *)keys[i + 1].data : NULL);
+    last = (struct CopyJob *)keys[count - 1].data;
+    delete[] keys;
+}
+
+int CopyScheduler::run(void)
+{
+    int w,workers;
+
+    order();
+    next = first;
+    failed = 0;
+#ifdef __linux__
+    //The io_uring engine copies through user space buffers, the verified copy is done by FileCopier
+    if(uc->uringdepth > 0 && !uc->verifycopy && !uc->usestd)
+    {
+        UringCopier *uring = new UringCopier(uc,master);
+        if(uring->init())
+        {
+            failed = uring->run(first);
+            delete uring;
+            return master->commit(true) || failed;
+        }
+        delete uring;
+        if(uc->verbose > 2)
+            printf("The io_uring is not available, fall back to the normal copy.\n");
+    }
+#endif
+    workers = uc->copyjobs;
+    if(workers <= 1)
+    {
+        struct CopyJob *job;
+        while((job = take()) != NULL)
+            if(master->copy(job->source,job->dest,job->item))
+            {
+                master->commit(true);
+                return 1;
+            }
+        return master->commit(true);
+    }
+
+    std::thread **threads = new std::thread*[workers];
+    for(w = 0 ; w < workers ; ++w)
+        threads[w] = new std::thread(&CopyScheduler::worker,this);
+    for(w = 0 ; w < workers ; ++w)
+    {
+        threads[w]->join();
+        delete threads[w];
+    }
+    delete[] threads;
+    return failed;
+}
+
+/* end code */
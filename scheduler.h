@@ -0,0 +1,58 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+#ifndef UNISYNC_SCHEDULER_H
+#define UNISYNC_SCHEDULER_H
+
+#include "unisync.h"
+#include "utils.h"
+
+struct CopyJob
+{
+    char source[512];
+    char dest[512];
+    struct cItem *item; //Passed to FileCopier::copy, can be NULL
+    unsigned long long size;
+    long long mtime;
+    struct CopyJob *n;
+};
+
+/* The sort key of a copy for the ordering policies (uc->copyorder) */
+struct CopyOrderKey
+{
+    unsigned long long size;
+    long long mtime;
+    void *data;
+};
+
+void order_copies(int policy,struct CopyOrderKey *keys,int count);
+
+/* Executes a list of file copies on uc->copyjobs worker threads.
+   Every worker uses an own FileCopier, their counters are merged to the master copier at the end.
+   After the first failed copy no more job is started. */
+class CopyScheduler
+{
+public:
+    CopyScheduler(UniSyncConfig *ucp,FileCopier *mastercopier);
+    ~CopyScheduler(void);
+
+    void add(const char *source,const char *dest,struct cItem *item = NULL);
+    int  run(void);
+
+private:
+    UniSyncConfig *uc;
+    FileCopier *master;
+    struct CopyJob *first,*last,*next;
+    int failed;
+
+    struct CopyJob *take(void);
+    void order(void);
+    void worker(void);
+};
+
+#endif // UNISYNC_SCHEDULER_H
@@ -0,0 +1,573 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "unisync.h"
+#include "utils.h"
+#include "subtree.h"
+#include "throttle.h"
+
+static std::mutex subtree_mutex;
+static std::condition_variable subtree_cond;
+
+SubtreeDeleter::SubtreeDeleter(UniSyncConfig *ucp)
+{
+    uc = ucp;
+    stack = NULL;
+    running = 0;
+    failed = 0;
+}
+
+SubtreeDeleter::~SubtreeDeleter(void)
+{
+    struct SubtreeDir *old;
+    while(stack != NULL)
+    {
+        old = stack;
+        stack = stack->n;
+        delete old;
+    }
+}
+
+void SubtreeDeleter::add(const char *path)
+{
+    struct SubtreeDir *d = new SubtreeDir();
+    strncpy(d->name,path,511);
+    d->parent = NULL;
+    if(uc->verbose > 1)
+    {
+        printf("Delete folder tree %s\n",path);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    push(d);
+}
+
+void SubtreeDeleter::push(struct SubtreeDir *d)
+{
+    std::lock_guard<std::mutex> lock(subtree_mutex);
+    d->fd = -1;
+    d->pending = 1;
+    d->keep = false;
+    if(d->parent != NULL)
+        ++d->parent->pending;
+    d->n = stack;
+    stack = d;
+    subtree_cond.notify_all();
+}
+
+struct SubtreeDir *SubtreeDeleter::take(void)
+{
+    struct SubtreeDir *d;
+    std::unique_lock<std::mutex> lock(subtree_mutex);
+    while(stack == NULL && running > 0)
+        subtree_cond.wait(lock);
+    if(stack == NULL)
+        return NULL;
+    d = stack;
+    stack = d->n;
+    ++running;
+    return d;
+}
+
+/* The path of name in the folder d (the path of d if name is NULL) for the messages (and the path based calls on Windows).
+   Returns 1 if the path is too long, the buffer contains the path of the folder only then. */
+int SubtreeDeleter::fullpath(struct SubtreeDir *d,const char *name,char *buffer)
+{
+    char dirpath[512];
+    int r = 0;
+    if(d->parent == NULL)
+        strcpy(dirpath,d->name);
+    else
+        r = fullpath(d->parent,d->name,dirpath);
+    strcpy(buffer,dirpath);
+    if(name == NULL)
+        return r;
+    if(strlen(dirpath) + strlen(name) + 2 > 512)
+        return 1;
+    strcat(buffer,"/");
+    strcat(buffer,name);
+    return r;
+}
+
+/* Deletes the files of the folder and queues the subfolders */
+void SubtreeDeleter::process(struct SubtreeDir *d)
+{
+    char pathbuf[512];
+    struct dirent *ent;
+    struct stat st;
+    DIR *dir = NULL;
+    bool isdir,keep = false;
+
+#ifdef _WIN32
+    if(fullpath(d,NULL,pathbuf) == 0)
+        dir = opendir(pathbuf);
+#else
+    int parentfd = (d->parent == NULL ? AT_FDCWD : d->parent->fd);
+    Throttle::consume(THROTTLE_META,1);
+    d->fd = openat(parentfd,d->name,O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if(d->fd < 0 && (errno == ENOTDIR || errno == ELOOP) && unlinkat(parentfd,d->name,0) == 0)
+    {
+        //A symlink to a folder: only the link is removed
+        struct SubtreeDir *parent = d->parent;
+        delete d;
+        if(parent != NULL)
+            finish(parent,false);
+        return;
+    }
+    if(d->fd >= 0)
+    {
+        int dupfd = dup(d->fd);
+        if(dupfd >= 0 && (dir = fdopendir(dupfd)) == NULL)
+            close(dupfd);
+    }
+#endif
+    if(dir == NULL)
+    {
+        fullpath(d,NULL,pathbuf);
+        fprintf(stderr,"Error, cannot read folder: %s\n",pathbuf);
+        if(uc->guicall)
+            fflush(stderr);
+        std::lock_guard<std::mutex> lock(subtree_mutex);
+        failed = 1;
+        keep = true;
+    }
+    while(dir != NULL && (ent = readdir(dir)) != NULL)
+    {
+        if(!strcmp(ent->d_name,".") || !strcmp(ent->d_name,".."))
+            continue;
+#ifdef _WIN32
+        if(fullpath(d,ent->d_name,pathbuf))
+        {
+            fprintf(stderr,"Error, too long path: %s\n",pathbuf);
+            if(uc->guicall)
+                fflush(stderr);
+            std::lock_guard<std::mutex> lock(subtree_mutex);
+            failed = 1;
+            keep = true;
+            continue;
+        }
+        isdir = (stat(pathbuf,&st) == 0 && S_ISDIR(st.st_mode));
+#else
+        isdir = (ent->d_type == DT_DIR);
+        if(ent->d_type == DT_UNKNOWN && fstatat(d->fd,ent->d_name,&st,AT_SYMLINK_NOFOLLOW) == 0)
+            isdir = S_ISDIR(st.st_mode);
+#endif
+        if(isdir)
+        {
+            struct SubtreeDir *child = new SubtreeDir();
+            strncpy(child->name,ent->d_name,511);
+            child->parent = d;
+            push(child);
+            continue;
+        }
+        Throttle::consume(THROTTLE_META,1);
+#ifdef _WIN32
+        if(unlink(pathbuf) != 0)
+#else
+        if(unlinkat(d->fd,ent->d_name,0) != 0)
+#endif
+        {
+            fullpath(d,ent->d_name,pathbuf);
+            fprintf(stderr,"Error, cannot delete file: %s\n",pathbuf);
+            if(uc->guicall)
+                fflush(stderr);
+            std::lock_guard<std::mutex> lock(subtree_mutex);
+            failed = 1;
+            keep = true;
+        }
+    }
+    if(dir != NULL)
+        closedir(dir);
+    finish(d,keep);
+}
+
+/* One reference of the folder is done (its reading or a subfolder). The folder is removed after the last one,
+   which can finish the parent folders too. */
+void SubtreeDeleter::finish(struct SubtreeDir *d,bool keep)
+{
+    char pathbuf[512];
+    struct SubtreeDir *parent;
+
+    while(d != NULL)
+    {
+        {
+            std::lock_guard<std::mutex> lock(subtree_mutex);
+            if(keep)
+                d->keep = true;
+            if(--d->pending > 0)
+                return;
+            keep = d->keep;
+        }
+#ifdef _WIN32
+        if(!keep)
+        {
+            Throttle::consume(THROTTLE_META,1);
+            if(fullpath(d,NULL,pathbuf) != 0 || rmdir(pathbuf) != 0)
+#else
+        if(d->fd >= 0)
+            close(d->fd);
+        if(!keep)
+        {
+            Throttle::consume(THROTTLE_META,1);
+            if(unlinkat(d->parent == NULL ? AT_FDCWD : d->parent->fd,d->name,AT_REMOVEDIR) != 0)
+#endif
+            {
+                fullpath(d,NULL,pathbuf);
+                fprintf(stderr,"Error, cannot delete folder: %s\n",pathbuf);
+                if(uc->guicall)
+                    fflush(stderr);
+                std::lock_guard<std::mutex> lock(subtree_mutex);
+                failed = 1;
+                keep = true;
+            }
+        }
+        parent = d->parent;
+        delete d;
+        d = parent;
+    }
+}
+
+void SubtreeDeleter::worker(void)
+{
+    struct SubtreeDir *d;
+    while((d = take()) != NULL)
+    {
+        process(d);
+        std::lock_guard<std::mutex> lock(subtree_mutex);
+        --running;
+        subtree_cond.notify_all();
+    }
+}
+
+/* Deletes the added trees on jobs threads (0: uc->copyjobs).
+   Returns nonzero if something could not be deleted. */
+int SubtreeDeleter::run(int jobs)
+{
+    int w,workers;
+
+    workers = jobs > 0 ? jobs : (uc->copyjobs < 1 ? 1 : uc->copyjobs);
+    if(workers == 1)
+    {
+        worker();
+        return failed;
+    }
+    std::thread **threads = new std::thread*[workers];
+    for(w = 0 ; w < workers ; ++w)
+        threads[w] = new std::thread(&SubtreeDeleter::worker,this);
+    for(w = 0 ; w < workers ; ++w)
+    {
+        threads[w]->join();
+        delete threads[w];
+    }
+    delete[] threads;
+    return failed;
+}
+
+SubtreeCopier::SubtreeCopier(UniSyncConfig *ucp,FileCopier *mastercopier)
+{
+    uc = ucp;
+    master = mastercopier;
+    source_bp = target_bp = NULL;
+    skip = NULL;
+    stack = NULL;
+    running = 0;
+    failed = 0;
+}
+
+SubtreeCopier::~SubtreeCopier(void)
+{
+    struct SubtreeCopyDir *old;
+    while(stack != NULL)
+    {
+        old = stack;
+        stack = stack->n;
+        delete old;
+    }
+}
+
+/* Adds a new folder (relative path) which is copied with its whole content */
+void SubtreeCopier::add(const char *path)
+{
+    struct SubtreeCopyDir *d = new SubtreeCopyDir();
+    while(path[0] == '/' || path[0] == '\\')
+        ++path;
+    strncpy(d->path,path,511);
+    d->name = d->path;
+    d->parent = NULL;
+    push(d);
+}
+
+void SubtreeCopier::push(struct SubtreeCopyDir *d)
+{
+    std::lock_guard<std::mutex> lock(subtree_mutex);
+    d->srcfd = d->dstfd = -1;
+    d->pending = 1;
+    if(d->parent != NULL)
+        ++d->parent->pending;
+    d->n = stack;
+    stack = d;
+    subtree_cond.notify_all();
+}
+
+struct SubtreeCopyDir *SubtreeCopier::take(void)
+{
+    struct SubtreeCopyDir *d;
+    std::unique_lock<std::mutex> lock(subtree_mutex);
+    while(stack == NULL && running > 0)
+        subtree_cond.wait(lock);
+    if(stack == NULL)
+        return NULL;
+    d = stack;
+    stack = d->n;
+    ++running;
+    return d;
+}
+
+/* Creates the target folder, copies the files and queues the subfolders.
+   After a failure the remaining folders are only released. */
+void SubtreeCopier::process(struct SubtreeCopyDir *d,FileCopier *copier)
+{
+    char srcbuf[512];
+    char dstbuf[512];
+    char relbuf[512];
+    struct dirent *ent;
+    struct stat st;
+    DIR *dir = NULL;
+    int r = 0;
+
+    if(failed)
+    {
+        finish(d);
+        return;
+    }
+    if(snprintf(srcbuf,512,"%s/%s",source_bp,d->path) >= 512 || snprintf(dstbuf,512,"%s/%s",target_bp,d->path) >= 512)
+    {
+        fprintf(stderr,"Error, too long path: %s/%s\n",source_bp,d->path);
+        if(uc->guicall)
+            fflush(stderr);
+        std::lock_guard<std::mutex> lock(subtree_mutex);
+        failed = 1;
+        finish(d);
+        return;
+    }
+    if(d->parent == NULL && uc->verbose > 1)
+    {
+        printf("Copy folder tree %s ..\n",srcbuf);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+#ifdef _WIN32
+    if(PathMaker::mkpath(dstbuf,false) == 0)
+        dir = opendir(srcbuf);
+#else
+    //The subfolders are created by the parent (see below)
+    Throttle::consume(THROTTLE_META,2);
+    if(d->parent == NULL)
+    {
+        d->srcfd = open(srcbuf,O_RDONLY | O_DIRECTORY);
+        if(d->srcfd >= 0 && (mkdir(dstbuf,0775) == 0 || errno == EEXIST))
+            d->dstfd = open(dstbuf,O_RDONLY | O_DIRECTORY);
+    }
+    else
+    {
+        d->srcfd = openat(d->parent->srcfd,d->name,O_RDONLY | O_DIRECTORY);
+        if(d->srcfd >= 0)
+            d->dstfd = openat(d->parent->dstfd,d->name,O_RDONLY | O_DIRECTORY);
+    }
+    if(d->dstfd >= 0)
+    {
+        int dupfd = dup(d->srcfd);
+        if(dupfd >= 0 && (dir = fdopendir(dupfd)) == NULL)
+            close(dupfd);
+    }
+#endif
+    if(dir == NULL)
+    {
+        fprintf(stderr,"Error, cannot copy the folder: %s (%d)\n",srcbuf,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        r = 1;
+    }
+    while(!r && !failed && (ent = readdir(dir)) != NULL)
+    {
+        if(!strcmp(ent->d_name,".") || !strcmp(ent->d_name,".."))
+            continue;
+        //Like the scanner: the symlinks are followed, the special files are skipped
+#ifdef _WIN32
+        if(snprintf(relbuf,512,"%s/%s",srcbuf,ent->d_name) >= 512)
+        {
+            r = toolong(srcbuf,ent->d_name);
+            break;
+        }
+        if(stat(relbuf,&st) != 0)
+            continue;
+#else
+        if(ent->d_type == DT_DIR)
+            st.st_mode = S_IFDIR;
+        else if(ent->d_type == DT_REG)
+            st.st_mode = S_IFREG;
+        else if(fstatat(d->srcfd,ent->d_name,&st,0) != 0)
+            continue;
+#endif
+        if(S_ISDIR(st.st_mode))
+        {
+#ifndef _WIN32
+            //Creating the folders before their files is much faster on some filesystems (ext4)
+            Throttle::consume(THROTTLE_META,1);
+            if(mkdirat(d->dstfd,ent->d_name,0775) != 0 && errno != EEXIST)
+            {
+                fprintf(stderr,"Error, cannot create the folder: %s/%s (%d)\n",dstbuf,ent->d_name,errno);
+                if(uc->guicall)
+                    fflush(stderr);
+                r = 1;
+                break;
+            }
+#endif
+            struct SubtreeCopyDir *child = new SubtreeCopyDir();
+            if(snprintf(child->path,512,"%s/%s",d->path,ent->d_name) >= 512)
+            {
+                delete child;
+                r = toolong(srcbuf,ent->d_name);
+                break;
+            }
+            child->name = child->path + strlen(child->path) - strlen(ent->d_name);
+            child->parent = d;
+            push(child);
+            continue;
+        }
+        if(!S_ISREG(st.st_mode))
+            continue;
+        if(skip != NULL && skip->count() > 0)
+        {
+            if(snprintf(relbuf,512,"%s/%s",d->path,ent->d_name) >= 512)
+            {
+                r = toolong(srcbuf,ent->d_name);
+                break;
+            }
+            if(skip->find(relbuf) != NULL)
+                continue;
+        }
+#ifndef _WIN32
+        if(!uc->usestd && !uc->atomiccopy)
+        {
+            r = copier->copy_at(d->srcfd,d->dstfd,ent->d_name,srcbuf);
+            continue;
+        }
+#endif
+        char srcfile[512],dstfile[512];
+        if(snprintf(srcfile,512,"%s/%s",srcbuf,ent->d_name) >= 512 || snprintf(dstfile,512,"%s/%s",dstbuf,ent->d_name) >= 512)
+        {
+            r = toolong(srcbuf,ent->d_name);
+            break;
+        }
+        r = copier->copy(srcfile,dstfile);
+    }
+    if(dir != NULL)
+        closedir(dir);
+    if(r)
+    {
+        std::lock_guard<std::mutex> lock(subtree_mutex);
+        failed = 1;
+    }
+    finish(d);
+}
+
+int SubtreeCopier::toolong(const char *folder,const char *name)
+{
+    fprintf(stderr,"Error, too long path: %s/%s\n",folder,name);
+    if(uc->guicall)
+        fflush(stderr);
+    return 1;
+}
+
+/* One reference of the folder is done, the folders are closed after their last subfolder */
+void SubtreeCopier::finish(struct SubtreeCopyDir *d)
+{
+    struct SubtreeCopyDir *parent;
+
+    while(d != NULL)
+    {
+        {
+            std::lock_guard<std::mutex> lock(subtree_mutex);
+            if(--d->pending > 0)
+                return;
+        }
+        if(d->srcfd >= 0)
+            close(d->srcfd);
+        if(d->dstfd >= 0)
+            close(d->dstfd);
+        parent = d->parent;
+        delete d;
+        d = parent;
+    }
+}
+
+void SubtreeCopier::worker(FileCopier *copier)
+{
+    struct SubtreeCopyDir *d;
+    bool own = (copier == NULL);
+
+    if(own)
+        copier = new FileCopier(uc);
+    while((d = take()) != NULL)
+    {
+        process(d,copier);
+        std::lock_guard<std::mutex> lock(subtree_mutex);
+        --running;
+        subtree_cond.notify_all();
+    }
+    int r = copier->commit(true);
+    std::lock_guard<std::mutex> lock(subtree_mutex);
+    if(r)
+        failed = 1;
+    if(own)
+    {
+        master->addCounters(copier);
+        delete copier;
+    }
+}
+
+/* Copies the added trees from the source to the target folder on jobs threads (0: uc->copyjobs),
+   one job copies with the master copier. Returns nonzero on error. */
+int SubtreeCopier::run(const char *sourcefolder_bp,const char *targetfolder_bp,HashIndex *skipindex,int jobs)
+{
+    int w,workers;
+
+    source_bp = sourcefolder_bp;
+    target_bp = targetfolder_bp;
+    skip = skipindex;
+    workers = jobs > 0 ? jobs : (uc->copyjobs < 1 ? 1 : uc->copyjobs);
+    if(workers == 1)
+    {
+        worker(master);
+        return failed;
+    }
+    std::thread **threads = new std::thread*[workers];
+    for(w = 0 ; w < workers ; ++w)
+        threads[w] = new std::thread(&SubtreeCopier::worker,this,(FileCopier *)NULL);
+    for(w = 0 ; w < workers ; ++w)
+    {
+        threads[w]->join();
+        delete threads[w];
+    }
+    delete[] threads;
+    return failed;
+}
+
+/* end code */
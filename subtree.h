@@ -0,0 +1,99 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+#ifndef UNISYNC_SUBTREE_H
+#define UNISYNC_SUBTREE_H
+
+#include "unisync.h"
+#include "utils.h"
+
+/* A folder under deletion */
+struct SubtreeDir
+{
+    char name[512];             //The name in the parent folder (the full path on the top level)
+    struct SubtreeDir *parent;
+    int fd;                     //Open while its content is deleted
+    int pending;                //The unfinished subfolders, +1 while it is read
+    bool keep;                  //Something could not be deleted inside
+    struct SubtreeDir *n;       //Work stack
+};
+
+/* Deletes whole folder trees. The folders are read and emptied relative to the file descriptor of the
+   folder (openat, unlinkat), so the kernel does not resolve the full path for every item.
+   The subfolders are processed on uc->copyjobs threads (or on the calling thread only, see run),
+   a folder is removed when its last subfolder is done.
+   If something cannot be deleted, the other parts are deleted and the folders above it are kept. */
+class SubtreeDeleter
+{
+public:
+    SubtreeDeleter(UniSyncConfig *ucp);
+    ~SubtreeDeleter(void);
+
+    void add(const char *path);
+    int  run(int jobs = 0);
+
+private:
+    UniSyncConfig *uc;
+    struct SubtreeDir *stack;
+    int running;
+    int failed;
+
+    void push(struct SubtreeDir *d);
+    struct SubtreeDir *take(void);
+    void process(struct SubtreeDir *d);
+    void finish(struct SubtreeDir *d,bool keep);
+    int  fullpath(struct SubtreeDir *d,const char *name,char *buffer);
+    void worker(void);
+};
+
+/* A folder under copy */
+struct SubtreeCopyDir
+{
+    char path[512];             //Relative to the source and the target folder
+    const char *name;           //The last part of the path
+    struct SubtreeCopyDir *parent;
+    int srcfd,dstfd;            //Open while its subfolders are copied
+    int pending;                //The unfinished subfolders, +1 while it is read
+    struct SubtreeCopyDir *n;   //Work stack
+};
+
+/* Copies whole new folder trees (which are not in the target at all) without processing them file by file:
+   the folders are read, created and the files are copied relative to the file descriptors of the folders
+   (openat, mkdirat), there is no path building and path cache lookup for the files.
+   The subfolders are processed on uc->copyjobs threads (or on the calling thread only, see run).
+   The copy uses the reflink/copy_file_range
+   methods of the FileCopier (path based copy with -std and -atomic).
+   The files listed in the skip index (relative paths) are not copied: they are moved, linked or
+   cloned to their place by the sync. */
+class SubtreeCopier
+{
+public:
+    SubtreeCopier(UniSyncConfig *ucp,FileCopier *mastercopier);
+    ~SubtreeCopier(void);
+
+    void add(const char *path);
+    int  run(const char *sourcefolder_bp,const char *targetfolder_bp,HashIndex *skipindex = NULL,int jobs = 0);
+
+private:
+    UniSyncConfig *uc;
+    FileCopier *master;
+    const char *source_bp,*target_bp;
+    HashIndex *skip;
+    struct SubtreeCopyDir *stack;
+    int running;
+    int failed;
+
+    void push(struct SubtreeCopyDir *d);
+    struct SubtreeCopyDir *take(void);
+    void process(struct SubtreeCopyDir *d,FileCopier *copier);
+    void finish(struct SubtreeCopyDir *d);
+    void worker(FileCopier *copier);
+    int  toolong(const char *folder,const char *name);
+};
+
+#endif // UNISYNC_SUBTREE_H
@@ -0,0 +1,1076 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "unisync.h"
+#include "utils.h"
+#include "catalog.h"
+#include "syncplan.h"
+#include "subtree.h"
+#include "scheduler.h"
+#include "journal.h"
+
+static std::mutex plan_mutex;
+static std::condition_variable plan_cond;
+
+static void get_state(const char *path,struct SyncOpState *state,bool subtree = false);
+
+static const char *relpath(const char *path)
+{
+    while(path[0] == '/' || path[0] == '\\')
+        ++path;
+    return path;
+}
+
+/* The folder of the path, empty string on the top level */
+static void parentpath(const char *path,char *parent)
+{
+    int i;
+    if(parent != path)
+        strcpy(parent,path);
+    for(i = strlen(parent) - 1 ; i >= 0 && parent[i] != '/' && parent[i] != '\\' ; --i);
+    parent[i < 0 ? 0 : i] = '\0';
+}
+
+/* The operation of the nearest folder above path in the index (the new folder trees contain deep items) */
+static struct SyncOp *folder_op(HashIndex *index,const char *path)
+{
+    char parent[300];
+    struct SyncOp *op;
+
+    parentpath(path,parent);
+    while(parent[0] != '\0')
+    {
+        if((op = (struct SyncOp *)index->find(parent)) != NULL)
+            return op;
+        parentpath(parent,parent);
+    }
+    return NULL;
+}
+
+SyncPlan::SyncPlan(UniSyncConfig *ucp)
+{
+    uc = ucp;
+    master = NULL;
+    source_bp = target_bp = NULL;
+    targetcount = 0;
+    first = last = NULL;
+    readyfirst = readylast = NULL;
+    opcount = remaining = running = 0;
+    failed = 0;
+    stopped = 0;
+    planfolders[0][0] = planfolders[1][0] = '\0';
+    planitems = NULL;
+    treeskips = NULL;
+    copyheap = NULL;
+    heapcount = 0;
+}
+
+SyncPlan::~SyncPlan(void)
+{
+    struct SyncOp *old;
+    struct SyncOpDep *d;
+    while(first != NULL)
+    {
+        old = first;
+        first = first->n;
+        while(old->dependents != NULL)
+        {
+            d = old->dependents;
+            old->dependents = d->n;
+            delete d;
+        }
+        delete old;
+    }
+    if(treeskips != NULL)
+        delete treeskips;
+    delete[] copyheap;
+    while(planitems != NULL)
+    {
+        struct cItem *item = planitems;
+        planitems = item->n;
+        delete item;
+    }
+}
+
+struct SyncOp *SyncPlan::add(int type,const char *path,const char *from,struct cItem *item)
+{
+    struct SyncOp *op = new SyncOp();
+    op->type = type;
+    strncpy(op->path,relpath(path),299);
+    if(from != NULL)
+        strncpy(op->from,relpath(from),299);
+    op->item = item;
+    op->target = targetcount > 0 ? targetcount - 1 : 0;
+    if(last == NULL)
+        first = op;
+    else
+        last->n = op;
+    last = op;
+    ++opcount;
+    return op;
+}
+
+/* The operations added after this write into targetfolder_bp (multi-destination sync).
+   With sourcefolder_bp they read from it instead of the source of execute (bidirectional sync) */
+void SyncPlan::settarget(const char *targetfolder_bp,const char *sourcefolder_bp)
+{
+    if(targetcount < PLAN_MAXTARGETS)
+    {
+        sources[targetcount] = sourcefolder_bp;
+        targets[targetcount++] = targetfolder_bp;
+    }
+}
+
+const char *SyncPlan::sourceof(struct SyncOp *op)
+{
+    return sources[op->target] != NULL ? sources[op->target] : source_bp;
+}
+
+void SyncPlan::depend(struct SyncOp *op,struct SyncOp *on)
+{
+    if(on == NULL || on == op)
+        return;
+    struct SyncOpDep *d = new SyncOpDep();
+    d->op = op;
+    d->n = on->dependents;
+    on->dependents = d;
+    ++op->waitfor;
+}
+
+void SyncPlan::build_dependencies(void)
+{
+    //The files in the new folder trees which are placed by an own operation
+    if(treeskips != NULL)
+        delete treeskips;
+    treeskips = new HashIndex();
+    //The targets are independent of each other
+    for(int t = 0 ; t < targetcount ; ++t)
+        build_dependencies(t);
+}
+
+void SyncPlan::build_dependencies(int target)
+{
+    struct SyncOp *op,*on;
+    HashIndex *mkdirs    = new HashIndex();
+    HashIndex *deletes   = new HashIndex();
+    HashIndex *producers = new HashIndex();
+
+    for(op = first ; op != NULL ; op = op->n)
+    {
+        if(op->target != target)
+            continue;
+        if(op->type == OP_MKDIR || op->type == OP_TREECOPY)
+            mkdirs->add(op->path,op);
+        if(op->type == OP_DELFILE || op->type == OP_RMDIR || op->type == OP_RMTREE)
+            deletes->add(op->path,op);
+        if(op->type == OP_COPY || op->type == OP_CLONE || op->type == OP_TREECOPY)
+            producers->add(op->path,op);
+        if(op->type == OP_MOVE || op->type == OP_CLONE || op->type == OP_LINK)
+            treeskips->add(op->path,op);
+    }
+
+    for(op = first ; op != NULL ; op = op->n)
+    {
+        if(op->target != target)
+            continue;
+        //Creates something at path: the parent folder is made and the name is freed first
+        if(op->type == OP_MKDIR || op->type == OP_TREECOPY || op->type == OP_COPY || op->type == OP_CLONE ||
+           op->type == OP_LINK || op->type == OP_MOVE)
+        {
+            depend(op,folder_op(mkdirs,op->path));
+            depend(op,(struct SyncOp *)deletes->find(op->path));
+        }
+        //The data of the cloned/linked file has to be in place (it can be in a copied tree)
+        if(op->type == OP_CLONE || op->type == OP_LINK)
+        {
+            on = (struct SyncOp *)producers->find(op->from);
+            depend(op,on != NULL ? on : folder_op(producers,op->from));
+        }
+        //Removes something from a folder: the folder is deleted after it (a moved file can be deep in a deleted tree)
+        if(op->type == OP_DELFILE || op->type == OP_RMDIR || op->type == OP_RMTREE || op->type == OP_MOVE)
+        {
+            on = folder_op(deletes,op->type == OP_MOVE ? op->from : op->path);
+            if(on != NULL && (on->type == OP_RMDIR || on->type == OP_RMTREE))
+                depend(on,op);
+        }
+    }
+
+    delete producers;
+    delete deletes;
+    delete mkdirs;
+}
+
+/* Multi-destination sync: the copies of the same source file to the other targets are joined to the copy
+   of the first target, which reads the file once and writes every target. The joined copy waits for the
+   operations which the others wait for (their folders are made, their names are freed), the others wait
+   for the joined copy, so the operations which need them (links, clones, folder deletes) keep their order.
+   The plain copies are joined only: the atomic, verified and journaled copies are made one by one. */
+void SyncPlan::join_copies(void)
+{
+#ifndef _WIN32
+    struct SyncOp *op,*leader;
+    struct SyncOpDep *d;
+
+    if(targetcount < 2 || uc->atomiccopy || uc->verifycopy || uc->usestd || uc->journal != NULL)
+        return;
+    HashIndex *leaders = new HashIndex();
+    int joined = 0;
+    for(op = first ; op != NULL ; op = op->n)
+    {
+        if(op->type != OP_COPY)
+            continue;
+        if((leader = (struct SyncOp *)leaders->find(op->path)) == NULL)
+        {
+            leaders->add(op->path,op);
+            continue;
+        }
+        if(sourceof(leader) != sourceof(op))
+            continue;
+        op->leader = leader;
+        op->nfanout = leader->fanout;
+        leader->fanout = op;
+        ++joined;
+    }
+    delete leaders;
+    if(joined == 0)
+        return;
+    //The prerequisites of the joined copies are taken over by their leader
+    for(op = first ; op != NULL ; op = op->n)
+        for(d = op->dependents ; d != NULL ; d = d->n)
+            if(d->op->leader != NULL)
+                depend(d->op->leader,op);
+    for(op = first ; op != NULL ; op = op->n)
+        if(op->leader != NULL)
+            depend(op,op->leader);
+    if(uc->verbose > 2)
+    {
+        printf("Sync plan: %d copies are joined to an other target's copy\n",joined);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+#endif
+}
+
+/* Ordered copies (uc->copyorder): ranks the copy operations by the policy.
+   The ready copies wait in a heap by rank, the other operations (which unblock the copies) go first. */
+void SyncPlan::rank_copies(void)
+{
+    char srcbuf[512];
+    struct SyncOp *op;
+    int i,count = 0;
+
+    for(op = first ; op != NULL ; op = op->n)
+        if(op->type == OP_COPY || op->type == OP_CLONE)
+            ++count;
+    if(count == 0)
+        return;
+    struct CopyOrderKey *keys = new CopyOrderKey[count];
+    for(i = 0,op = first ; op != NULL ; op = op->n)
+        if(op->type == OP_COPY || op->type == OP_CLONE)
+        {
+            //The saved plans contain the state of the source
+            if(!op->src.exists)
+            {
+                snprintf(srcbuf,512,"%s/%s",sourceof(op),op->path);
+                get_state(srcbuf,&op->src);
+            }
+            keys[i].size = op->src.size;
+            keys[i].mtime = op->src.mtime;
+            keys[i].data = op;
+            ++i;
+        }
+    order_copies(uc->copyorder,keys,count);
+    for(i = 0 ; i < count ; ++i)
+        ((struct SyncOp *)keys[i].data)->rank = i;
+    delete[] keys;
+    delete[] copyheap;
+    copyheap = new struct SyncOp*[count];
+    heapcount = 0;
+}
+
+/* Called with locked mutex */
+void SyncPlan::heap_push(struct SyncOp *op)
+{
+    int i = heapcount++,parent;
+    while(i > 0 && copyheap[parent = (i - 1) / 2]->rank > op->rank)
+    {
+        copyheap[i] = copyheap[parent];
+        i = parent;
+    }
+    copyheap[i] = op;
+}
+
+/* Called with locked mutex */
+struct SyncOp *SyncPlan::heap_pop(void)
+{
+    struct SyncOp *top = copyheap[0],*moved = copyheap[--heapcount];
+    int i = 0,child;
+    while((child = 2 * i + 1) < heapcount)
+    {
+        if(child + 1 < heapcount && copyheap[child + 1]->rank < copyheap[child]->rank)
+            ++child;
+        if(copyheap[child]->rank >= moved->rank)
+            break;
+        copyheap[i] = copyheap[child];
+        i = child;
+    }
+    copyheap[i] = moved;
+    return top;
+}
+
+/* Called with locked mutex */
+void SyncPlan::push_ready(struct SyncOp *op)
+{
+    if(copyheap != NULL && (op->type == OP_COPY || op->type == OP_CLONE))
+    {
+        heap_push(op);
+        return;
+    }
+    op->nready = NULL;
+    if(readylast == NULL)
+        readyfirst = op;
+    else
+        readylast->nready = op;
+    readylast = op;
+}
+
+struct SyncOp *SyncPlan::take(void)
+{
+    struct SyncOp *op;
+    std::unique_lock<std::mutex> lock(plan_mutex);
+    //Time budget: no new operation is started after the deadline, the running ones are finished
+    if(!failed && !stopped && remaining > 0 && uc->deadline > 0 && time(NULL) >= uc->deadline)
+    {
+        stopped = 1;
+        plan_cond.notify_all();
+    }
+    while(!failed && !stopped && readyfirst == NULL && heapcount == 0 && remaining > 0 && running > 0)
+        plan_cond.wait(lock);
+    if(stopped)
+        return NULL;
+    if(!failed && readyfirst == NULL && heapcount == 0 && remaining > 0)
+    {
+        fprintf(stderr,"Error, Sync plan: %d operations wait for each other\n",remaining);
+        if(uc->guicall)
+            fflush(stderr);
+        failed = 1;
+        plan_cond.notify_all();
+    }
+    if(failed || (readyfirst == NULL && heapcount == 0))
+        return NULL;
+    if(readyfirst == NULL)
+    {
+        ++running;
+        return heap_pop();
+    }
+    op = readyfirst;
+    readyfirst = op->nready;
+    if(readyfirst == NULL)
+        readylast = NULL;
+    ++running;
+    return op;
+}
+
+void SyncPlan::finish(struct SyncOp *op,int result)
+{
+    std::lock_guard<std::mutex> lock(plan_mutex);
+    --running;
+    --remaining;
+    if(result)
+        failed = 1;
+    else
+    {
+        op->done = true;
+        for(struct SyncOpDep *d = op->dependents ; d != NULL ; d = d->n)
+            if(--d->op->waitfor == 0)
+                push_ready(d->op);
+    }
+    plan_cond.notify_all();
+}
+
+static int plan_path(char *buffer,const char *folder,const char *path)
+{
+    return snprintf(buffer,512,"%s/%s",folder,path) >= 512 ? 1 : 0;
+}
+
+int SyncPlan::perform(struct SyncOp *op,FileCopier *copier)
+{
+    char srcbuf[512];
+    char dstbuf[512];
+    char auxbuf[512];
+    const char *target = targets[op->target];
+    int r;
+
+    snprintf(srcbuf,512,"%s/%s",sourceof(op),op->path);
+    snprintf(dstbuf,512,"%s/%s",target,op->path);
+    snprintf(auxbuf,512,"%s/%s",target,op->from);
+    switch(op->type)
+    {
+        case OP_FIXTIME:
+            return copier->fixtime(srcbuf,dstbuf);
+        case OP_MOVE:
+            if(PathMaker::mkpath(dstbuf,true))
+                return 1;
+            if(copier->movefile(auxbuf,dstbuf) == 0)
+                return copier->fixtime(srcbuf,dstbuf);
+            if(copier->deletefile(auxbuf) != 0)
+            {
+                fprintf(stderr,"Error, cannot delete file: %s\n",auxbuf);
+                if(uc->guicall)
+                    fflush(stderr);
+                return 1;
+            }
+            return copier->copy(srcbuf,dstbuf,op->item);
+        case OP_DELFILE:
+            if(copier->deletefile(dstbuf) != 0)
+            {
+                fprintf(stderr,"Error, cannot delete file: %s\n",dstbuf);
+                if(uc->guicall)
+                    fflush(stderr);
+                return 1;
+            }
+            return 0;
+        case OP_RMDIR:
+            if(copier->deletefolder(dstbuf) != 0)
+            {
+                fprintf(stderr,"Error, cannot delete folder: %s\n",dstbuf);
+                if(uc->guicall)
+                    fflush(stderr);
+                return 1;
+            }
+            return 0;
+        case OP_RMTREE:
+        {
+            struct stat st;
+            //Deleted by the interrupted run, but the record is lost
+            if(uc->journal != NULL && lstat(dstbuf,&st) != 0 && errno == ENOENT)
+                return 0;
+            //The operations of the plan run on the copy threads already, the tree is walked on this one
+            SubtreeDeleter *deleter = new SubtreeDeleter(uc);
+            deleter->add(dstbuf);
+            r = deleter->run(1);
+            delete deleter;
+            return r;
+        }
+        case OP_MKDIR:
+            return PathMaker::mkpath(dstbuf,false);
+        case OP_TREECOPY:
+        {
+            //Copied on this worker thread with its copier, like the OP_RMTREE
+            SubtreeCopier *trees = new SubtreeCopier(uc,copier);
+            trees->add(op->path);
+            r = trees->run(sourceof(op),target,treeskips,1);
+            delete trees;
+            return r;
+        }
+        case OP_COPY:
+            if(op->leader != NULL)
+                return 0;
+            if(op->fanout != NULL)
+                return perform_fanout(op,copier);
+            r = copier->copy(srcbuf,dstbuf,op->item);
+            //The clones and links need the file under its final name
+            if(!r && op->dependents != NULL)
+                r = copier->commit(false);
+            return r;
+        case OP_CLONE:
+            r = copier->clonefile(auxbuf,dstbuf,srcbuf,op->item);
+            if(!r && op->dependents != NULL)
+                r = copier->commit(false);
+            return r;
+        case OP_LINK:
+            return copier->linkfile(auxbuf,dstbuf);
+    }
+    return 1;
+}
+
+/* A copy joined with the copies of the same file to the other targets */
+int SyncPlan::perform_fanout(struct SyncOp *op,FileCopier *copier)
+{
+#ifndef _WIN32
+    char srcbuf[512];
+    char dstbufs[PLAN_MAXTARGETS][512];
+    const char *dsts[PLAN_MAXTARGETS];
+    struct SyncOp *members[PLAN_MAXTARGETS];
+    int i,count = 0;
+
+    members[count++] = op;
+    for(struct SyncOp *m = op->fanout ; m != NULL && count < PLAN_MAXTARGETS ; m = m->nfanout)
+        members[count++] = m;
+    snprintf(srcbuf,512,"%s/%s",sourceof(op),op->path);
+    for(i = 0 ; i < count ; ++i)
+    {
+        snprintf(dstbufs[i],512,"%s/%s",targets[members[i]->target],members[i]->path);
+        dsts[i] = dstbufs[i];
+    }
+    return copier->copy_fanout(srcbuf,dsts,count);
+#else
+    (void)op;
+    (void)copier;
+    return 1;
+#endif
+}
+
+/* An operation recorded as done by the interrupted run: the copied, cloned or linked target is checked,
+   the data of the last operations can be lost by the crash even if the journal record is not. */
+bool SyncPlan::resumed_done(struct SyncOp *op)
+{
+    char srcbuf[512],dstbuf[512];
+    struct stat s_st,d_st;
+
+    if(op->type != OP_COPY && op->type != OP_CLONE && op->type != OP_LINK)
+        return true;
+    if(plan_path(dstbuf,targets[op->target],op->path) || stat(dstbuf,&d_st) != 0)
+        return false;
+    if(op->type == OP_LINK)
+        return !plan_path(srcbuf,targets[op->target],op->from) && stat(srcbuf,&s_st) == 0 &&
+               s_st.st_dev == d_st.st_dev && s_st.st_ino == d_st.st_ino;
+    return !plan_path(srcbuf,sourceof(op),op->path) && stat(srcbuf,&s_st) == 0 &&
+           s_st.st_size == d_st.st_size && s_st.st_mtime == d_st.st_mtime;
+}
+
+/* Syncs the result of the operation to the disk before the journal records it as done (-journal) */
+int SyncPlan::make_durable(struct SyncOp *op,FileCopier *copier)
+{
+    char buffer[512];
+    const char *target = targets[op->target];
+    int r;
+
+    if(op->type == OP_RMTREE || op->type == OP_TREECOPY)
+        r = copier->syncdest(target);
+    else if(plan_path(buffer,target,op->path) || copier->syncentry(buffer))
+        r = 1;
+    else
+        r = (op->type == OP_MOVE && (plan_path(buffer,target,op->from) || copier->syncentry(buffer)));
+    if(r)
+    {
+        fprintf(stderr,"Error, cannot sync the target: %s/%s (%d)\n",target,op->path,errno);
+        if(uc->guicall)
+            fflush(stderr);
+    }
+    return r;
+}
+
+void SyncPlan::worker(void)
+{
+    struct SyncOp *op;
+    char key[320];
+    int r;
+    FileCopier *copier = new FileCopier(uc);
+    while((op = take()) != NULL)
+    {
+        //Done by the interrupted run (-resume)
+        if(op->done && resumed_done(op))
+        {
+            finish(op,0);
+            continue;
+        }
+        r = perform(op,copier);
+        if(!r && uc->journal != NULL)
+        {
+            r = make_durable(op,copier);
+            snprintf(key,320,"%d:%s",op->type,op->path);
+            if(!r)
+                uc->journal->done(JOURNAL_OP,key);
+        }
+        finish(op,r);
+    }
+    r = copier->commit(true);
+    std::lock_guard<std::mutex> lock(plan_mutex);
+    if(r)
+        failed = 1;
+    master->addCounters(copier);
+    delete copier;
+}
+
+/* Executes the operations in dependency order on uc->copyjobs threads.
+   After the first failed operation no more operation is started. */
+int SyncPlan::execute(const char *sourcefolder_bp,const char *targetfolder_bp,FileCopier *mastercopier)
+{
+    int w,workers;
+    struct SyncOp *op;
+
+    master = mastercopier;
+    source_bp = sourcefolder_bp;
+    target_bp = targetfolder_bp;
+    if(targetcount == 0)
+        settarget(targetfolder_bp);
+    build_dependencies();
+    join_copies();
+    if(uc->journal != NULL)
+        uc->journal->planned();
+
+    failed = 0;
+    stopped = 0;
+    running = 0;
+    remaining = opcount;
+    readyfirst = readylast = NULL;
+    if(uc->copyorder != COPYORDER_SCAN)
+        rank_copies();
+    for(op = first ; op != NULL ; op = op->n)
+        if(op->waitfor == 0)
+            push_ready(op);
+
+    workers = uc->copyjobs < 1 ? 1 : uc->copyjobs;
+    if(uc->verbose > 2)
+    {
+        printf("Sync plan: %d operations on %d threads\n",opcount,workers);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+
+    std::thread **threads = new std::thread*[workers];
+    for(w = 0 ; w < workers ; ++w)
+        threads[w] = new std::thread(&SyncPlan::worker,this);
+    for(w = 0 ; w < workers ; ++w)
+    {
+        threads[w]->join();
+        delete threads[w];
+    }
+    delete[] threads;
+    if(stopped && !failed && uc->verbose > 0)
+    {
+        printf("The time budget is over, %d of %d operations are not done.\n",remaining,opcount);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    if(uc->journal != NULL && unfinished())
+        uc->journal->keep();
+    return failed;
+}
+
+/* Marks the operations which are done by the interrupted run (journal). Returns their number */
+int SyncPlan::resume(void)
+{
+    char key[320];
+    int count = 0;
+    for(struct SyncOp *op = first ; op != NULL ; op = op->n)
+    {
+        snprintf(key,320,"%d:%s",op->type,op->path);
+        if(uc->journal->isdone(JOURNAL_OP,key))
+        {
+            op->done = true;
+            ++count;
+        }
+    }
+    return count;
+}
+
+/* The time budget is over before every operation was done */
+bool SyncPlan::unfinished(void)
+{
+    return stopped && remaining > 0;
+}
+
+/* Writes the operations which are not done (time budget) as a new plan, the next window continues with it.
+   If everything is done, the plan file of an earlier window is removed, so it is not executed again. */
+int SyncPlan::save_rest(const char *filename)
+{
+    if(!unfinished())
+    {
+        if(unlink(filename) == 0)
+        {
+            if(uc->verbose > 0)
+            {
+                printf("Every operation is done, the plan file %s is removed\n",filename);
+                if(uc->guicall)
+                    fflush(stdout);
+            }
+        }
+        else if(errno != ENOENT)
+        {
+            fprintf(stderr,"Error, cannot remove the finished plan file: %s (%d)\n",filename,errno);
+            if(uc->guicall)
+                fflush(stderr);
+            return 1;
+        }
+        return 0;
+    }
+    if(uc->verbose > 0)
+    {
+        printf("The remaining %d operations are written to %s\n",remaining,filename);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    return save(filename,source_bp,target_bp);
+}
+
+// ************** Saved plans **************
+
+static void put_u8(FILE *f,unsigned int v)
+{
+    fputc(v & 0xff,f);
+}
+
+static void put_u64(FILE *f,unsigned long long v)
+{
+    for(int i = 0 ; i < 8 ; ++i)
+        fputc((int)((v >> (8 * i)) & 0xff),f);
+}
+
+static void put_str(FILE *f,const char *str)
+{
+    size_t l = strlen(str);
+    fputc((int)(l & 0xff),f);
+    fputc((int)((l >> 8) & 0xff),f);
+    fwrite(str,1,l,f);
+}
+
+static int get_u8(FILE *f,unsigned int *v)
+{
+    int c = fgetc(f);
+    if(c == EOF)
+        return 1;
+    *v = (unsigned int)c;
+    return 0;
+}
+
+static int get_u64(FILE *f,unsigned long long *v)
+{
+    unsigned char b[8];
+    if(fread(b,1,8,f) != 8)
+        return 1;
+    *v = 0;
+    for(int i = 7 ; i >= 0 ; --i)
+        *v = (*v << 8) | b[i];
+    return 0;
+}
+
+static int get_str(FILE *f,char *str,size_t size)
+{
+    int lo = fgetc(f),hi = fgetc(f);
+    size_t l;
+    if(lo == EOF || hi == EOF)
+        return 1;
+    l = (size_t)lo | ((size_t)hi << 8);
+    if(l >= size || fread(str,1,l,f) != l)
+        return 1;
+    str[l] = '\0';
+    return 0;
+}
+
+static unsigned long long sign_mix(unsigned long long h,unsigned long long v)
+{
+    for(int i = 0 ; i < 8 ; ++i)
+    {
+        h ^= (v >> (8 * i)) & 0xff;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Adds every entry of the folder to the signature: the path, type, size and time. The entries are summed,
+   so the signature does not depend on the order of readdir. */
+static void sign_subtree(const char *path,const char *rel,unsigned long long *sig)
+{
+    char fullpath[512],subrel[512];
+    struct dirent *ent;
+    struct stat st;
+    DIR *dir;
+
+    if((dir = opendir(path)) == NULL)
+    {
+        *sig = sign_mix(*sig,1);
+        return;
+    }
+    while((ent = readdir(dir)) != NULL)
+    {
+        if(!strcmp(ent->d_name,".") || !strcmp(ent->d_name,".."))
+            continue;
+        if(snprintf(fullpath,512,"%s/%s",path,ent->d_name) >= 512 ||
+           snprintf(subrel,512,"%s/%s",rel,ent->d_name) >= 512)
+        {
+            *sig = sign_mix(*sig,2);
+            continue;
+        }
+#ifdef _WIN32
+        if(stat(fullpath,&st) != 0)
+#else
+        if(lstat(fullpath,&st) != 0)
+#endif
+            continue;
+        unsigned long long h = 14695981039346656037ULL;
+        for(const char *c = subrel ; *c != '\0' ; ++c)
+            h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+        h = sign_mix(h,S_ISDIR(st.st_mode) ? 1 : 0);
+        if(S_ISDIR(st.st_mode))
+            sign_subtree(fullpath,subrel,sig);
+        else
+            h = sign_mix(sign_mix(h,(unsigned long long)st.st_size),(unsigned long long)st.st_mtime);
+        *sig += h;
+    }
+    closedir(dir);
+}
+
+/* The state of a file or folder. The folders have their time (it changes when an entry is added or removed),
+   with subtree the size of a folder is the signature of its whole content. */
+static void get_state(const char *path,struct SyncOpState *state,bool subtree)
+{
+    struct stat st;
+    memset(state,0,sizeof(struct SyncOpState));
+#ifdef _WIN32
+    if(stat(path,&st) != 0)
+#else
+    if(lstat(path,&st) != 0)
+#endif
+        return;
+    state->exists = true;
+    state->isdir = S_ISDIR(st.st_mode);
+    state->mtime = (long long)st.st_mtime;
+    if(!state->isdir)
+        state->size = (unsigned long long)st.st_size;
+    else if(subtree)
+        sign_subtree(path,"",&state->size);
+}
+
+static bool same_state(const struct SyncOpState *a,const struct SyncOpState *b)
+{
+    return a->exists == b->exists && a->isdir == b->isdir && a->size == b->size && a->mtime == b->mtime;
+}
+
+/* The from of OP_CLONE and OP_LINK is an existing target file, the operation reads it */
+static bool reads_from(struct SyncOp *op)
+{
+    return op->type == OP_CLONE || op->type == OP_LINK;
+}
+
+bool SyncPlan::reads_source(struct SyncOp *op)
+{
+    return op->type == OP_FIXTIME || op->type == OP_MOVE || op->type == OP_COPY || op->type == OP_CLONE || op->type == OP_TREECOPY;
+}
+
+/* Writes the plan with the current state of the touched files. The folders are stored as absolute paths.
+   The plan is written to a temporary file and renamed over the old one, so it is never left half written. */
+int SyncPlan::save(const char *filename,const char *sourcefolder_bp,const char *targetfolder_bp)
+{
+    char buffer[512];
+    char tmpname[512];
+    struct SyncOp *op;
+    FILE *f;
+
+    if(targetcount > 1)
+    {
+        fprintf(stderr,"Error, The plan of a multi-destination sync cannot be saved\n");
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+    if(snprintf(tmpname,512,"%s.tmp",filename) >= 512 || (f = fopen(tmpname,"wb")) == NULL)
+    {
+        fprintf(stderr,"Error, cannot write the plan file: %s\n",filename);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+    strncpy(planfolders[0],sourcefolder_bp,511);
+    strncpy(planfolders[1],targetfolder_bp,511);
+#ifndef _WIN32
+    for(int i = 0 ; i < 2 ; ++i)
+    {
+        char *absolute = realpath(planfolders[i],NULL);
+        if(absolute != NULL)
+        {
+            strncpy(planfolders[i],absolute,511);
+            free(absolute);
+        }
+    }
+#endif
+    fwrite(PLAN_MAGIC,1,8,f);
+    put_str(f,planfolders[0]);
+    put_str(f,planfolders[1]);
+    put_u8(f,uc->hardlinks);
+    put_u8(f,uc->dedup);
+    int count = 0;
+    for(op = first ; op != NULL ; op = op->n)
+        if(!op->done)
+            ++count;
+    put_u64(f,count);
+    for(op = first ; op != NULL ; op = op->n)
+    {
+        if(op->done)
+            continue;
+        if(reads_source(op) && !plan_path(buffer,planfolders[0],op->path))
+            get_state(buffer,&op->src,op->type == OP_TREECOPY);
+        if(!plan_path(buffer,planfolders[1],op->type == OP_MOVE ? op->from : op->path))
+            get_state(buffer,&op->dst,op->type == OP_RMTREE);
+        if(reads_from(op) && !plan_path(buffer,planfolders[1],op->from))
+            get_state(buffer,&op->org);
+
+        bool hash = (op->item != NULL && op->item->htype != HASH_EMPTY);
+        put_u8(f,op->type);
+        put_str(f,op->path);
+        put_str(f,op->from);
+        put_u8(f,(op->src.exists ? 1 : 0) | (op->src.isdir ? 2 : 0) | (op->dst.exists ? 4 : 0) | (op->dst.isdir ? 8 : 0) | (hash ? 16 : 0) |
+                 (op->org.exists ? 32 : 0));
+        put_u64(f,op->src.size);
+        put_u64(f,(unsigned long long)op->src.mtime);
+        put_u64(f,op->dst.size);
+        put_u64(f,(unsigned long long)op->dst.mtime);
+        if(reads_from(op))
+        {
+            put_u64(f,op->org.size);
+            put_u64(f,(unsigned long long)op->org.mtime);
+        }
+        if(hash)
+        {
+            put_u8(f,op->item->htype);
+            put_str(f,op->item->hash);
+        }
+    }
+    if(fclose(f) != 0)
+    {
+        fprintf(stderr,"Error, cannot write the plan file: %s\n",filename);
+        if(uc->guicall)
+            fflush(stderr);
+        unlink(tmpname);
+        return 1;
+    }
+#ifdef _WIN32
+    unlink(filename);
+#endif
+    if(rename(tmpname,filename) != 0)
+    {
+        fprintf(stderr,"Error, cannot write the plan file: %s (%d)\n",filename,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        unlink(tmpname);
+        return 1;
+    }
+    return 0;
+}
+
+int SyncPlan::load(const char *filename)
+{
+    char magic[8];
+    char path[300],from[300];
+    unsigned long long count,smtime = 0,dmtime = 0,omtime = 0;
+    unsigned int type,flags,hardlinks,dedup,v = 0;
+    FILE *f;
+
+    if((f = fopen(filename,"rb")) == NULL)
+    {
+        fprintf(stderr,"Error, cannot open the plan file: %s\n",filename);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+    int bad = (fread(magic,1,8,f) != 8 || memcmp(magic,PLAN_MAGIC,8) ||
+               get_str(f,planfolders[0],512) || get_str(f,planfolders[1],512) ||
+               get_u8(f,&hardlinks) || get_u8(f,&dedup) || get_u64(f,&count));
+    if(!bad)
+    {
+        //The plan is executed with the same link/dedup mode as it was made
+        uc->hardlinks = hardlinks;
+        uc->dedup = dedup;
+    }
+    for(unsigned long long i = 0 ; !bad && i < count ; ++i)
+    {
+        if(get_u8(f,&type) || get_str(f,path,300) || get_str(f,from,300) || get_u8(f,&flags))
+        {
+            bad = 1;
+            break;
+        }
+        struct SyncOp *op = add(type,path,from);
+        op->src.exists = (flags & 1);
+        op->src.isdir  = (flags & 2);
+        op->dst.exists = (flags & 4);
+        op->dst.isdir  = (flags & 8);
+        bad = (get_u64(f,&op->src.size) || get_u64(f,&smtime) || get_u64(f,&op->dst.size) || get_u64(f,&dmtime));
+        op->src.mtime = (long long)smtime;
+        op->dst.mtime = (long long)dmtime;
+        if(!bad && reads_from(op))
+        {
+            op->org.exists = (flags & 32);
+            bad = (get_u64(f,&op->org.size) || get_u64(f,&omtime));
+            op->org.mtime = (long long)omtime;
+        }
+        if(!bad && (flags & 16))
+        {
+            cItem *item = new cItem();
+            item->n = planitems;
+            planitems = item;
+            strcpy(item->pathname,path);
+            item->size = op->src.size;
+            bad = get_u8(f,&v) || get_str(f,item->hash,70);
+            item->htype = (char)v;
+            op->item = item;
+        }
+        if(type < OP_FIXTIME || type > OP_TREECOPY)
+            bad = 1;
+    }
+    fclose(f);
+    if(bad)
+    {
+        fprintf(stderr,"Error, invalid or truncated plan file: %s\n",filename);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+    return 0;
+}
+
+static int check_state(const char *folder,const char *path,const struct SyncOpState *expected,bool subtree,const char *side)
+{
+    char buffer[512];
+    struct SyncOpState state;
+
+    if(plan_path(buffer,folder,path))
+    {
+        fprintf(stderr,"Error, The path is too long: %s/%s\n",folder,path);
+        return 1;
+    }
+    get_state(buffer,&state,subtree);
+    if(!same_state(&state,expected))
+    {
+        fprintf(stderr,"Error, The %s changed since the plan was made: %s\n",side,buffer);
+        return 1;
+    }
+    return 0;
+}
+
+/* Compares the state of the touched files to the state stored in the plan. Returns 1 if any of them changed. */
+int SyncPlan::check(void)
+{
+    struct SyncOp *op;
+    int changed = 0;
+
+    if(uc->verbose > 0)
+    {
+        printf("Checking the %d operations of the plan...\n",opcount);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    for(op = first ; op != NULL ; op = op->n)
+    {
+        if(reads_source(op))
+            changed += check_state(planfolders[0],op->path,&op->src,op->type == OP_TREECOPY,"source");
+        changed += check_state(planfolders[1],op->type == OP_MOVE ? op->from : op->path,&op->dst,op->type == OP_RMTREE,"destination");
+        if(reads_from(op))
+            changed += check_state(planfolders[1],op->from,&op->org,false,"destination");
+    }
+    if(uc->guicall)
+        fflush(stderr);
+    return changed > 0 ? 1 : 0;
+}
+
+/* end code */
@@ -0,0 +1,136 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+#ifndef UNISYNC_SYNCPLAN_H
+#define UNISYNC_SYNCPLAN_H
+
+#include "unisync.h"
+#include "utils.h"
+
+#define OP_FIXTIME      1
+#define OP_MOVE         2
+#define OP_DELFILE      3
+#define OP_RMDIR        4
+#define OP_MKDIR        5
+#define OP_COPY         6
+#define OP_CLONE        7
+#define OP_LINK         8
+#define OP_RMTREE       9
+#define OP_TREECOPY     10
+
+#define PLAN_MAGIC      "USPLAN02"
+
+#define PLAN_MAXTARGETS 16
+
+/* The state of a file when the plan was made (execplan checks it before the execution) */
+struct SyncOpState
+{
+    bool exists;
+    bool isdir;
+    unsigned long long size;    //Folders: the signature of the content (OP_RMTREE, OP_TREECOPY), 0 otherwise
+    long long mtime;
+};
+
+struct SyncOpDep
+{
+    struct SyncOp *op;
+    struct SyncOpDep *n;
+};
+
+/* One operation of the sync. The paths are relative to the source and the target folder */
+struct SyncOp
+{
+    int type;
+    char path[300];             //The target (and the source) path of the operation
+    char from[300];             //OP_MOVE: the old path, OP_CLONE/OP_LINK: the existing target file
+    struct cItem *item;         //Passed to FileCopier::copy, can be NULL
+    int target;                 //Index of the target folder (multi-destination sync)
+    struct SyncOpState src;     //Expected state of the source file (saved plans)
+    struct SyncOpState dst;     //Expected state of the touched target file: from of OP_MOVE, path of the others
+    struct SyncOpState org;     //Expected state of the from file of OP_CLONE/OP_LINK (saved plans)
+    bool done;                  //Executed (the time budgeted runs save the others, the resume skips it)
+
+    int waitfor;                //Number of the unfinished operations this one depends on
+    struct SyncOpDep *dependents;
+    int rank;                   //Position in the copy order (uc->copyorder)
+    struct SyncOp *fanout;      //OP_COPY: the copies of the same file to the other targets, written by this one
+    struct SyncOp *leader;      //OP_COPY: written by this copy to an other target (nothing to do)
+    struct SyncOp *nfanout;
+    struct SyncOp *n;           //All operations
+    struct SyncOp *nready;      //Ready queue
+};
+
+/* The sync as a dependency graph of operations: a folder is created before the files in it, the files of
+   a deleted folder are deleted before the folder, a name is freed before something else is created there,
+   and the cloned/linked files wait for their data. The independent operations run on uc->copyjobs threads,
+   so the deletes of a subtree overlap the copies into an other one.
+   The plan can be saved to a binary file (sync -planout) with the state of every touched file,
+   and executed later by execplan after checking only these files.
+   With a time budget no operation is started after the deadline, and the rest can be saved as a new plan.
+   With the journal every completed operation is recorded, the resume skips them.
+   The plan can write into several target folders (sync to more destinations): the copies of the same
+   source file are joined, the file is read once and written to every target.
+   Every target can have an own source folder too, so the two directions of a bidirectional sync are one plan. */
+class SyncPlan
+{
+public:
+    SyncPlan(UniSyncConfig *ucp);
+    ~SyncPlan(void);
+
+    struct SyncOp *add(int type,const char *path,const char *from = NULL,struct cItem *item = NULL);
+    void settarget(const char *targetfolder_bp,const char *sourcefolder_bp = NULL);
+    int  execute(const char *sourcefolder_bp,const char *targetfolder_bp,FileCopier *mastercopier);
+    int  count(void) { return opcount; }
+
+    int  save(const char *filename,const char *sourcefolder_bp,const char *targetfolder_bp);
+    int  save_rest(const char *filename);
+    int  resume(void);
+    bool unfinished(void);
+    int  load(const char *filename);
+    int  check(void);
+    const char *sourcefolder(void) { return planfolders[0]; }
+    const char *targetfolder(void) { return planfolders[1]; }
+
+private:
+    UniSyncConfig *uc;
+    FileCopier *master;
+    const char *source_bp,*target_bp;
+    const char *targets[PLAN_MAXTARGETS];
+    const char *sources[PLAN_MAXTARGETS];   //The source of the target, NULL: the source of execute
+    int targetcount;
+    struct SyncOp *first,*last;
+    struct SyncOp *readyfirst,*readylast;
+    int opcount,remaining,running;
+    int failed;
+    int stopped;                //The time budget (uc->deadline) is over
+    char planfolders[2][512];
+    struct cItem *planitems;    //The items created by load (hashes for -verify)
+    HashIndex *treeskips;       //The moved/cloned/linked files, the OP_TREECOPY does not copy them
+    struct SyncOp **copyheap;   //The ready copies by rank (ordered copies only)
+    int heapcount;
+
+    void depend(struct SyncOp *op,struct SyncOp *on);
+    void build_dependencies(void);
+    void build_dependencies(int target);
+    void join_copies(void);
+    void rank_copies(void);
+    void heap_push(struct SyncOp *op);
+    struct SyncOp *heap_pop(void);
+    void push_ready(struct SyncOp *op);
+    struct SyncOp *take(void);
+    void finish(struct SyncOp *op,int result);
+    int  perform(struct SyncOp *op,FileCopier *copier);
+    int  perform_fanout(struct SyncOp *op,FileCopier *copier);
+    const char *sourceof(struct SyncOp *op);
+    void worker(void);
+    bool reads_source(struct SyncOp *op);
+    bool resumed_done(struct SyncOp *op);
+    int  make_durable(struct SyncOp *op,FileCopier *copier);
+};
+
+#endif // UNISYNC_SYNCPLAN_H
@@ -0,0 +1,206 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <chrono>
+#include <thread>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#include "unisync.h"
+#include "utils.h"
+#include "throttle.h"
+
+#ifdef __linux__
+#define IOPRIO_CLASS_IDLE       3
+#define IOPRIO_CLASS_SHIFT      13
+#define IOPRIO_WHO_PROCESS      1
+#endif
+
+struct TokenBucket
+{
+    double rate;    //units per second, 0 means unlimited
+    double tokens;  //negative: debt, have to wait
+};
+
+std::atomic<bool> Throttle::active(false);
+
+static std::mutex throttle_mutex;
+static UniSyncConfig *throttle_uc = NULL;
+static struct TokenBucket buckets[3];
+static std::chrono::steady_clock::time_point lastrefill;
+static std::chrono::steady_clock::time_point lastcheck;
+static time_t ctlmtime = 0;
+static volatile sig_atomic_t reloadrequest = 0;
+
+static double now_seconds(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+#ifndef _WIN32
+static void reload_signal(int sig)
+{
+    (void)sig;
+    reloadrequest = 1;
+}
+#endif
+
+/* Parses the -bwlimit=READ[:WRITE] and -iopslimit=N arguments (the control file contains the same)
+   Returns 0 if parsed, 1 on invalid value, -1 if the argument is not a limit. */
+int Throttle::parseLimit(UniSyncConfig *uc,const char *arg)
+{
+    if(!strncmp(arg,"-bwlimit=",9))
+    {
+        const char *c = strchr(arg+9,':');
+        uc->readlimit = (double)parsesize(arg+9);
+        uc->writelimit = c == NULL ? uc->readlimit : (double)parsesize(c+1);
+        if((arg[9] < '0' || arg[9] > '9') || (c != NULL && (c[1] < '0' || c[1] > '9')))
+            return 1;
+        return 0;
+    }
+    if(!strncmp(arg,"-iopslimit=",11))
+    {
+        if(arg[11] < '0' || arg[11] > '9')
+            return 1;
+        uc->metalimit = atof(arg+11);
+        return 0;
+    }
+    return -1;
+}
+
+void Throttle::setup(UniSyncConfig *uc)
+{
+    throttle_uc = uc;
+#ifdef __linux__
+    //The threads started later inherit the priority
+    if(uc->ioidle && syscall(SYS_ioprio_set,IOPRIO_WHO_PROCESS,0,IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+    {
+        fprintf(stderr,"Warning, cannot set the idle I/O priority class\n");
+        if(uc->guicall)
+            fflush(stderr);
+    }
+#endif
+#ifndef _WIN32
+    if(uc->throttlefile != NULL)
+    {
+        struct sigaction sa;
+        memset(&sa,0,sizeof(sa));
+        sa.sa_handler = reload_signal;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1,&sa,NULL);
+    }
+#endif
+    lastrefill = lastcheck = std::chrono::steady_clock::now();
+    reload();
+}
+
+/* Re-reads the control file if it is modified (or SIGUSR1 received). Called with locked mutex */
+void Throttle::reload(void)
+{
+    UniSyncConfig *uc = throttle_uc;
+    struct stat st;
+
+    if(uc->throttlefile != NULL && stat(uc->throttlefile,&st) == 0 && (reloadrequest || st.st_mtime != ctlmtime))
+    {
+        FILE *f = fopen(uc->throttlefile,"r");
+        char buffer[256],tok[256],*c;
+        int used;
+        reloadrequest = 0;
+        ctlmtime = st.st_mtime;
+        if(f != NULL)
+        {
+            while(fgets(buffer,256,f) != NULL)
+            {
+                if((c = strchr(buffer,'#')) != NULL) //comment till the end of line
+                    *c = '\0';
+                c = buffer;
+                while(sscanf(c,"%255s%n",tok,&used) == 1)
+                {
+                    c += used;
+                    if(parseLimit(uc,tok) != 0)
+                    {
+                        fprintf(stderr,"Warning, unknown or invalid setting in the throttle control file: %s\n",tok);
+                        if(uc->guicall)
+                            fflush(stderr);
+                    }
+                }
+            }
+            fclose(f);
+        }
+        if(uc->verbose > 2)
+        {
+            printf("Throttle: read %.0f byte/s, write %.0f byte/s, %.0f metadata op/s (0: unlimited)\n",
+                    uc->readlimit,uc->writelimit,uc->metalimit);
+            if(uc->guicall)
+                fflush(stdout);
+        }
+    }
+
+    double rates[3] = { uc->readlimit , uc->writelimit , uc->metalimit };
+    for(int k = 0 ; k < 3 ; ++k)
+    {
+        if(buckets[k].rate != rates[k])
+            buckets[k].tokens = 0;
+        buckets[k].rate = rates[k];
+    }
+    active = (uc->readlimit > 0 || uc->writelimit > 0 || uc->metalimit > 0 || uc->throttlefile != NULL);
+}
+
+/* Takes amount tokens from the bucket of kind, sleeps while the bucket is in debt.
+   The bucket can hold one second of tokens (burst). */
+void Throttle::consume(int kind,double amount)
+{
+    double wait = 0;
+
+    if(!active)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(throttle_mutex);
+        if(reloadrequest || now_seconds(lastcheck) >= 1.0)
+        {
+            lastcheck = std::chrono::steady_clock::now();
+            reload();
+        }
+        double elapsed = now_seconds(lastrefill);
+        lastrefill = std::chrono::steady_clock::now();
+        for(int k = 0 ; k < 3 ; ++k)
+        {
+            buckets[k].tokens += elapsed * buckets[k].rate;
+            if(buckets[k].tokens > buckets[k].rate)
+                buckets[k].tokens = buckets[k].rate;
+        }
+        if(buckets[kind].rate <= 0)
+            return;
+        buckets[kind].tokens -= amount;
+        if(buckets[kind].tokens < 0)
+            wait = -buckets[kind].tokens / buckets[kind].rate;
+    }
+    if(wait > 0)
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+}
+
+/* The length can be passed to one copy system call (copy_file_range, sendfile) */
+unsigned long long Throttle::chunk(unsigned long long length)
+{
+    if(active && length > THROTTLE_CHUNK)
+        return THROTTLE_CHUNK;
+    return length;
+}
+
+/* end code */
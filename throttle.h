@@ -0,0 +1,41 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+#ifndef UNISYNC_THROTTLE_H
+#define UNISYNC_THROTTLE_H
+
+#include <atomic>
+
+#include "unisync.h"
+
+#define THROTTLE_READ       0
+#define THROTTLE_WRITE      1
+#define THROTTLE_META       2
+
+/* The copy functions pass at most this much data to one system call when throttled */
+#define THROTTLE_CHUNK      (1024*1024)
+
+/* Token bucket limiter of the read bytes, the written bytes and the metadata operations (stat, open, mkdir,
+   unlink...) per second. Shared by every thread: the hashing, the copy and the directory walker functions
+   call consume() before the I/O, which sleeps as long as the bucket is in debt.
+   The limits can be changed at runtime by the control file (re-read when modified, or on SIGUSR1). */
+class Throttle
+{
+public:
+    static std::atomic<bool> active;   //Read by every thread without the lock
+
+    static int  parseLimit(UniSyncConfig *uc,const char *arg);
+    static void setup(UniSyncConfig *uc);
+    static void consume(int kind,double amount);
+    static unsigned long long chunk(unsigned long long length);
+
+private:
+    static void reload(void);
+};
+
+#endif // UNISYNC_THROTTLE_H
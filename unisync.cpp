@@ -20,6 +20,11 @@
 #include "unisync.h"
 #include "utils.h"
 #include "catalog.h"
+#include "syncplan.h"
+#include "uringcopy.h"
+#include "throttle.h"
+#include "journal.h"
+#include "bisync.h"
 
 #ifdef _WIN32
 #include <windows.h>
@@ -46,11 +51,22 @@ int printhelp(void)
     printf("    %s catdiff cat:./mycatalog.usc /STORE/BackupMyPics -md5 -v \n",PROGRAMCMD);
     printf("    %s catdiff cat:\"./my pics\" /STORE/BackupMyPics -md5 -vv \n",PROGRAMCMD);
     printf("    \n");
-    printf("  sync - Syncronize a directory to a directory\n");
-    printf("    %s sync SOURCE_DIRECOTRY DESTINATION_DIRECTORY [switches]\n",PROGRAMCMD);
+    printf("  sync - Syncronize a directory to a directory (or more directories)\n");
+    printf("    %s sync SOURCE_DIRECOTRY DESTINATION_DIRECTORY [DESTINATION_DIRECTORY...] [switches]\n",PROGRAMCMD);
     printf("    %s sync /STORE/MyPics /STORE/BackupMyPics -md5 -vv \n",PROGRAMCMD);
     printf("    %s sync /STORE/MyPics /STORE/BackupMyPics -exclf=Thumbs.db -v\n",PROGRAMCMD);
     printf("    %s sync /STORE/MyPics /STORE/BackupMyPics -exclf=Thumbs.db -i -vv\n",PROGRAMCMD);
+    printf("    %s sync /STORE/MyPics /STORE/BackupMyPics cat:./backup.usc -sha2 -verify\n",PROGRAMCMD);
+    printf("    %s sync /STORE/MyPics /media/disk1/pics /media/disk2/pics -md5 -v\n",PROGRAMCMD);
+    printf("    \n");
+    printf("  bisync - Syncronize two directories in both directions according to a base catalog\n");
+    printf("    %s bisync LEFT_DIRECTORY RIGHT_DIRECTORY cat:BASECATALOG [switches]\n",PROGRAMCMD);
+    printf("    %s bisync /STORE/Works /media/pen/Works cat:./works_base.usc -md5 -v\n",PROGRAMCMD);
+    printf("    \n");
+    printf("  execplan - Execute a sync plan written by sync -planout=PLANFILE\n");
+    printf("    %s execplan PLANFILE [switches]\n",PROGRAMCMD);
+    printf("    %s sync /STORE/MyPics /STORE/BackupMyPics -md5 -planout=./pics.usp\n",PROGRAMCMD);
+    printf("    %s execplan ./pics.usp -cj 4 -v\n",PROGRAMCMD);
     printf("    \n");
     printf("  makeupdate - Create an update package to sync offline directories\n");
     printf("    %s makeupdate cat:CATALOGFILE SOURCE_DIRECOTRY update:UPDATEDIR\n",PROGRAMCMD);
@@ -76,9 +92,53 @@ int printhelp(void)
     printf("               if the files appears to be same according to hashes.\n");
     printf("               (This switch only works with hashes and command=sync)\n");
     printf(" -skiphash   - Don't check hashes even if the catalog contains its.\n");
+    printf(" -blockhash=SIZE - Store the hashes of SIZE bytes blocks of the files too\n");
+    printf("               (4k - 1G, for example 4M), the diff reports the changed byte ranges.\n");
+    printf(" -chunks[=MIN:AVG:MAX] - Content defined chunking: the catalog stores the chunk\n");
+    printf("               list of files, the update packages store only unknown chunks.\n");
+    printf(" -verify     - Only in SYNC mode: Hash the data while copying and compare it to\n");
+    printf("               the hash computed on scan. (Needs -md5 or -sha2)\n");
+    printf(" -fprint     - Store a sampled fingerprint beside the hash and compare it first,\n");
+    printf("               so most modified files are found without reading them fully.\n");
+    printf("               (Needs -md5 or -sha2)\n");
+    printf(" -moves      - Detect the moved/renamed files (same size, time and hash) and rename\n");
+    printf("               them in the target instead of delete and copy. The catalogs\n");
+    printf("               store the inodes too, so makeupdate can find them without hash.\n");
+    printf(" -hardlinks  - Preserve the hardlinks: copy the data once and link the other names\n");
+    printf(" -dedup[=reflink|hardlink] - Only in SYNC mode: Copy every content once (by hash),\n");
+    printf("               create the other files with the same content by reflink (default)\n");
+    printf("               or hardlink (same time only). (Needs -md5 or -sha2)\n");
+    printf(" -planout=FILE - Only in SYNC mode: Write the sync plan to FILE instead of sync,\n");
+    printf("               it can be executed later by the execplan command.\n");
+    printf("               With -timebudget: the operations which are not done are written,\n");
+    printf("               the FILE is removed when every operation is done.\n");
+    printf(" -timebudget=TIME - SYNC and EXECPLAN: Do not start new operations after TIME\n");
+    printf("               (like 90s, 30m, 2h) from the start, finish the running ones.\n");
+    printf(" -journal=FILE - SYNC, MAKEUPDATE, MAKESYNCUPDATE, APPLYUPDATE: Record the done\n");
+    printf("               (synced) operations to FILE, it is removed when the run is complete.\n");
+    printf(" -resume     - Continue the interrupted run of the -journal: skip the done\n");
+    printf("               operations, continue the copy of the big files. (No sync scan)\n");
     printf(" -exclf=EXF  - Exclude file named EXF from every work\n");
     printf(" -excld=EXD  - Exclude directory named EXD from every work\n");
     printf(" -exclp=EXP  - Exclude path matched EXP from every work\n");
+    printf(" -cj N       - Copy the files on N parallel threads. (default: 1)\n");
+    printf("               The sync runs the deletes, mkdirs and copies as a dependency\n");
+    printf("               graph on the N threads, so the independent ones overlap.\n");
+    printf(" -order=ORDER - The order of the file copies: scan (default), small (small files\n");
+    printf("               first), large (large files first), newest (recently modified\n");
+    printf("               first), mixed (small and large files interleaved)\n");
+    printf(" -splitcopy=MINSIZE[:N] - Copy the files bigger than MINSIZE on N threads\n");
+    printf("               by ranges (default N: 4)\n");
+    printf(" -bwlimit=READ[:WRITE] - Limit the read and write bandwidth (byte/s, like 50M:20M)\n");
+    printf(" -iopslimit=N - Limit the metadata operations (stat, open, mkdir...) to N per sec\n");
+    printf(" -throttlectl=FILE - Re-read the limits from FILE when it changes or on SIGUSR1\n");
+    printf(" -idle       - Linux: Use the idle I/O priority class\n");
+    printf(" -atomic[=N] - Write the files to temporary name and rename them into place.\n");
+    printf("               With N: sync the target filesystem after every N files,\n");
+    printf("               and rename the files after their data is synced\n");
+    printf(" -direct     - Linux: Write the big files with O_DIRECT, bypassing the page cache\n");
+    printf(" -uring[=QD] - Linux: Copy the files with io_uring, keep QD operations in flight\n");
+    printf("               (default QD: 32)\n");
     printf(" -std        - Use standard POSIX routines instead of platform dependent codes.\n");
     printf(" -i          - Interactive/paranoid sync mode. Print info and ask before sync.\n");
     printf(" -h          - Print help\n");
@@ -98,6 +158,11 @@ int printversionabout(void)
 void specify(char *val,const char *name);
 void specify_and_canopen(char *val,const char *name);
 void dontspecify(char *val,const char *name);
+int  resume_sync(UniSyncConfig *uc,const char *sourcedir,const char *destdir);
+int  sync_fanout(UniSyncConfig *uc,const char *sourcedir,char destdirs[][512],int count);
+int  bisync(UniSyncConfig *uc,const char *leftdir,const char *rightdir,const char *catalogfile);
+int  close_journal(UniSyncConfig *uc,int r);
+static bool samefolder(const char *a,const char *b);
 
 int main(int argi,char **argc)
 {
@@ -113,6 +178,7 @@ int main(int argi,char **argc)
     char destdir[512];
     char catalogfile[512];
     char updatedir[512];
+    char destdirs[PLAN_MAXTARGETS][512]; //sync: the destinations after the first
 
     strcpy(command,"");
     strcpy(sourcedir,"");
@@ -127,6 +193,7 @@ int main(int argi,char **argc)
     simpleparams[2] = destdir;
 
     UniSyncConfig config;
+    const char *journalfile = NULL;
     int p;
     for(p = 1 ; p < argi ; ++p)
     {
@@ -176,6 +243,198 @@ int main(int argi,char **argc)
             config.skiphash = 1;
             continue;
         }
+        if(!strcmp(argc[p],"-fprint"))
+        {
+            config.fprint = 1;
+            continue;
+        }
+        if(!strcmp(argc[p],"-verify"))
+        {
+            config.verifycopy = 1;
+            continue;
+        }
+        if(!strncmp(argc[p],"-blockhash=",11))
+        {
+            unsigned long long blocksize = parsesize(argc[p]+11);
+            if(blocksize < 4096 || blocksize > 1024ULL*1024*1024)
+            {
+                fprintf(stderr,"Error, The block size of -blockhash must be between 4k and 1G\n");
+                return 1;
+            }
+            config.blocksize = (unsigned int)blocksize;
+            continue;
+        }
+        if(!strcmp(argc[p],"-chunks") || !strncmp(argc[p],"-chunks=",8))
+        {
+            config.chunking = 1;
+            if(argc[p][7] == '=')
+            {
+                char cbuf[64],*c1,*c2;
+                strncpy(cbuf,argc[p]+8,63);
+                cbuf[63] = '\0';
+                c1 = strchr(cbuf,':');
+                c2 = c1 == NULL ? NULL : strchr(c1+1,':');
+                if(c2 != NULL)
+                {
+                    *c1 = '\0';
+                    *c2 = '\0';
+                    config.chunkmin = (unsigned int)parsesize(cbuf);
+                    config.chunkavg = (unsigned int)parsesize(c1+1);
+                    config.chunkmax = (unsigned int)parsesize(c2+1);
+                }
+                if(c2 == NULL || config.chunkmin < 1024 || config.chunkmin >= config.chunkavg ||
+                   config.chunkavg >= config.chunkmax || config.chunkmax > 16*1024*1024)
+                {
+                    fprintf(stderr,"Error, Chunk sizes must be specified as -chunks=MIN:AVG:MAX ( -chunks=16k:64k:256k )\n");
+                    return 1;
+                }
+            }
+            continue;
+        }
+        if(!strcmp(argc[p],"-cj") || !strncmp(argc[p],"-cj=",4))
+        {
+            if(argc[p][3] == '=')
+                config.copyjobs = atoi(argc[p]+4);
+            else if(p+1 < argi)
+                config.copyjobs = atoi(argc[++p]);
+            else
+                config.copyjobs = 0;
+            if(config.copyjobs < 1 || config.copyjobs > 256)
+            {
+                fprintf(stderr,"Error, The number of copy jobs must be between 1 and 256 ( -cj 8 )\n");
+                return 1;
+            }
+            continue;
+        }
+        if(!strncmp(argc[p],"-splitcopy=",11))
+        {
+            char *c = strchr(argc[p]+11,':');
+            config.splitsize = parsesize(argc[p]+11);
+            if(c != NULL)
+                config.splitjobs = atoi(c+1);
+            if(config.splitsize < SPLITCOPY_PIECE || config.splitjobs < 1 || config.splitjobs > 64)
+            {
+                fprintf(stderr,"Error, Split copy must be specified as -splitcopy=MINSIZE[:THREADS] ( -splitcopy=1G:8 , MINSIZE >= 32M )\n");
+                return 1;
+            }
+            continue;
+        }
+        if(!strcmp(argc[p],"-atomic") || !strncmp(argc[p],"-atomic=",8))
+        {
+            config.atomiccopy = 1;
+            if(argc[p][7] == '=')
+            {
+                if(atoi(argc[p]+8) < 1)
+                {
+                    fprintf(stderr,"Error, The batch size of -atomic must be at least 1 ( -atomic=1000 )\n");
+                    return 1;
+                }
+                config.syncbatch = atoi(argc[p]+8);
+            }
+            continue;
+        }
+        if(!strncmp(argc[p],"-bwlimit=",9) || !strncmp(argc[p],"-iopslimit=",11))
+        {
+            if(Throttle::parseLimit(&config,argc[p]))
+            {
+                fprintf(stderr,"Error, The limits must be specified as -bwlimit=READ[:WRITE] ( -bwlimit=50M:20M ) and -iopslimit=N\n");
+                return 1;
+            }
+            continue;
+        }
+        if(!strncmp(argc[p],"-throttlectl=",13))
+        {
+            config.throttlefile = argc[p]+13;
+            continue;
+        }
+        if(!strcmp(argc[p],"-moves"))
+        {
+            config.moves = 1;
+            continue;
+        }
+        if(!strcmp(argc[p],"-hardlinks"))
+        {
+            config.hardlinks = 1;
+            continue;
+        }
+        if(!strcmp(argc[p],"-dedup") || !strcmp(argc[p],"-dedup=reflink"))
+        {
+            config.dedup = DEDUP_REFLINK;
+            continue;
+        }
+        if(!strcmp(argc[p],"-dedup=hardlink"))
+        {
+            config.dedup = DEDUP_HARDLINK;
+            continue;
+        }
+        if(!strncmp(argc[p],"-order=",7))
+        {
+            const char *orders[5] = { "scan" , "small" , "large" , "newest" , "mixed" };
+            config.copyorder = -1;
+            for(int o = 0 ; o < 5 ; ++o)
+                if(!strcmp(argc[p]+7,orders[o]))
+                    config.copyorder = o;
+            if(config.copyorder < 0)
+            {
+                fprintf(stderr,"Error, Unknown copy order: %s (scan, small, large, newest or mixed)\n",argc[p]+7);
+                return 1;
+            }
+            continue;
+        }
+        if(!strncmp(argc[p],"-timebudget=",12))
+        {
+            //The budget covers the whole run (the scan too)
+            char *unit;
+            double budget = strtod(argc[p]+12,&unit);
+            if(*unit == 'm')
+                budget *= 60;
+            if(*unit == 'h')
+                budget *= 3600;
+            if(budget <= 0 || unit == argc[p]+12 || (*unit != '\0' && strcmp(unit,"s") && strcmp(unit,"m") && strcmp(unit,"h")))
+            {
+                fprintf(stderr,"Error, Invalid time budget: %s ( -timebudget=30m )\n",argc[p]+12);
+                return 1;
+            }
+            config.deadline = time(NULL) + (time_t)budget;
+            continue;
+        }
+        if(!strncmp(argc[p],"-journal=",9))
+        {
+            journalfile = argc[p]+9;
+            continue;
+        }
+        if(!strcmp(argc[p],"-resume"))
+        {
+            config.resume = 1;
+            continue;
+        }
+        if(!strncmp(argc[p],"-planout=",9))
+        {
+            config.planout = argc[p]+9;
+            continue;
+        }
+        if(!strcmp(argc[p],"-idle"))
+        {
+            config.ioidle = 1;
+            continue;
+        }
+        if(!strcmp(argc[p],"-direct"))
+        {
+            config.directio = 1;
+            continue;
+        }
+        if(!strcmp(argc[p],"-uring") || !strncmp(argc[p],"-uring=",7))
+        {
+            config.uringdepth = URING_DEPTH_DEFAULT;
+            if(argc[p][6] == '=')
+                config.uringdepth = atoi(argc[p]+7);
+            if(config.uringdepth < 1 || config.uringdepth > 4096)
+            {
+                fprintf(stderr,"Error, The queue depth of io_uring must be between 1 and 4096 ( -uring=64 )\n");
+                return 1;
+            }
+            continue;
+        }
         if(!strcmp(argc[p],"-fixtime"))
         {
             config.fixmtime = 1;
@@ -278,6 +537,11 @@ int main(int argi,char **argc)
             strncpy(simpleparams[spc],argc[p],510);
             ++spc;
         }
+        else if(spc < PLAN_MAXTARGETS + 2)
+        {
+            strncpy(destdirs[spc - 2],argc[p],510);
+            ++spc;
+        }
         else
         {
             fprintf(stderr,"Error, too much parameter passed.\n");
@@ -293,6 +557,27 @@ int main(int argi,char **argc)
     trimenddir(sourcedir);
     trimenddir(destdir);
     trimenddir(updatedir);
+    strcpy(destdirs[0],destdir);
+    config.destinations = spc > 3 ? spc - 2 : 1;
+    for(p = 1 ; p < config.destinations ; ++p)
+        trimenddir(destdirs[p]);
+    if(config.destinations > 1 && strcmp(command,"sync"))
+    {
+        fprintf(stderr,"Error, too much parameter passed.\n");
+        return 1;
+    }
+    for(p = 1 ; p < config.destinations ; ++p)
+        for(int d = 0 ; d < p ; ++d)
+            if(samefolder(destdirs[p],destdirs[d]))
+            {
+                fprintf(stderr,"Error, the destination is given more times: %s\n",destdirs[p]);
+                return 1;
+            }
+    if(config.fprint && config.hashmode == HASH_EMPTY)
+    {
+        fprintf(stderr,"Error, The -fprint needs the hash of the files (-md5 or -sha2)\n");
+        return 1;
+    }
 
     if(config.verbose > 1)
     {
@@ -314,12 +599,31 @@ int main(int argi,char **argc)
             fflush(stdout);
     }
 
+    Throttle::setup(&config);
+
     // **********************************************************************
     //Switch off fixtime switch in some unwanted situation...
     if(config.fixmtime && strcmp(command,"sync")) // ...when not SYNC command requested
         config.fixmtime = 0;
     if(config.fixmtime && config.skiphash) // ...when skiphash is enabled
         config.fixmtime = 0;
+    if(config.chunking && strcmp(command,"create") && strcmp(command,"makeupdate") && strcmp(command,"makesyncupdate"))
+        config.chunking = 0; // ...chunk lists are only used by the update packages
+    // **********************************************************************
+    if(journalfile != NULL)
+    {
+        if(strcmp(command,"sync") && strcmp(command,"makeupdate") && strcmp(command,"makesyncupdate") && strcmp(command,"applyupdate"))
+        {
+            fprintf(stderr,"Error, The -journal can be used with sync, makeupdate, makesyncupdate and applyupdate\n");
+            return 1;
+        }
+        config.journal = new SyncJournal(&config,journalfile);
+    }
+    else if(config.resume)
+    {
+        fprintf(stderr,"Error, The -resume needs the journal of the interrupted run (-journal=FILE)\n");
+        return 1;
+    }
     // **********************************************************************
     if(!strcmp(command,"create"))
     {
@@ -357,6 +661,8 @@ int main(int argi,char **argc)
         r = catalog->scandir_diff(destdir);
         if(r != 0) { delete catalog; return 1; }
 
+        if(config.moves)
+            catalog->detect_moves(DIRECTION_DIFF_TO_CAT,sourcedir,destdir);
         catalog->diffresultPrint();
         delete catalog;
         return 0;
@@ -376,6 +682,8 @@ int main(int argi,char **argc)
         r = catalog->scandir_diff(sourcedir);
         if(r != 0) { delete catalog; return 1; }
 
+        if(config.moves)
+            catalog->detect_moves(DIRECTION_DIFF_TO_CAT,NULL,sourcedir);
         catalog->diffresultPrint();
         delete catalog;
         return 0;
@@ -385,16 +693,81 @@ int main(int argi,char **argc)
     {
         specify_and_canopen(sourcedir,"source directory");
         specify(destdir,"destination directory");
-        dontspecify(catalogfile,"parameter");
         dontspecify(updatedir,"parameter");
+        if(config.planout != NULL || config.journal != NULL)
+            dontspecify(catalogfile,"parameter");
+        if(config.journal != NULL && config.planout != NULL)
+        {
+            fprintf(stderr,"Error, The -planout and -journal cannot be used together\n");
+            return 1;
+        }
+        //The journal has the plan of the interrupted sync, the folders are not scanned again
+        if(config.journal != NULL && config.resume && config.journal->resumable())
+            return close_journal(&config,resume_sync(&config,sourcedir,destdir));
+        if(config.destinations > 1)
+        {
+            dontspecify(catalogfile,"parameter");
+            if(config.planout != NULL || config.journal != NULL)
+            {
+                fprintf(stderr,"Error, The -planout and -journal cannot be used with more destinations\n");
+                return 1;
+            }
+        }
+
+        FILE *catf=NULL;
+        if(strlen(catalogfile) > 0)
+        {
+            catf = fopen(catalogfile,"w");
+            if(catf == NULL)
+            {
+                fprintf(stderr,"Error, Cannot open catalog file for writing: %s\n",catalogfile);
+                return 1;
+            }
+        }
+
+        if(config.verifycopy && config.hashmode == HASH_EMPTY)
+        {
+            fprintf(stderr,"Error, The -verify needs the hash of the files (-md5 or -sha2)\n");
+            if(catf != NULL)
+                fclose(catf);
+            return 1;
+        }
+        if(config.dedup != DEDUP_NONE && config.hashmode == HASH_EMPTY)
+        {
+            fprintf(stderr,"Error, The -dedup needs the hash of the files (-md5 or -sha2)\n");
+            if(catf != NULL)
+                fclose(catf);
+            return 1;
+        }
+
+        if(config.destinations > 1)
+            return sync_fanout(&config,sourcedir,destdirs,config.destinations);
 
         UniCatalog *catalog = new UniCatalog(&config);
+        //Hardlinks, dedup: the new files can be linked/cloned from the unchanged files
+        if(catf != NULL || config.hardlinks || config.dedup != DEDUP_NONE)
+            catalog->setKeepMatched(true);
         r = catalog->scandir(sourcedir,NULL,true);
         if(r != 0) { delete catalog; return 1; }
 
         r = catalog->scandir_diff(destdir);
         if(r != 0) { delete catalog; return 1; }
 
+        if(config.moves)
+            catalog->detect_moves(DIRECTION_CAT_TO_DIFF,sourcedir,destdir);
+        if(config.planout != NULL && config.deadline == 0)
+        {
+            SyncPlan *plan = new SyncPlan(&config);
+            catalog->build_sync_plan(plan,DIRECTION_CAT_TO_DIFF);
+            if(config.verbose > 0 || config.interactivesync)
+                catalog->print_sync_procedures(sourcedir,destdir,DIRECTION_CAT_TO_DIFF);
+            r = plan->save(config.planout,sourcedir,destdir);
+            if(r == 0 && config.verbose > 0)
+                printf("The sync plan with %d operations is written to %s\n",plan->count(),config.planout);
+            delete plan;
+            delete catalog;
+            return r;
+        }
         if(config.interactivesync)
         {
             r = catalog->print_sync_procedures(sourcedir,destdir,DIRECTION_CAT_TO_DIFF);
@@ -409,9 +782,63 @@ int main(int argi,char **argc)
             }
         }
 
-        r = catalog->scandir_sync(sourcedir,destdir,DIRECTION_CAT_TO_DIFF);
+        if(config.journal != NULL && config.journal->open(false))
+        {
+            delete catalog;
+            return 1;
+        }
+        r = catalog->scandir_sync(sourcedir,destdir,DIRECTION_CAT_TO_DIFF,catf);
 
+        if(catf != NULL)
+            fclose(catf);
         delete catalog;
+        return close_journal(&config,r);
+    }
+    // **********************************************************************
+    if(!strcmp(command,"bisync"))
+    {
+        specify_and_canopen(sourcedir,"left directory");
+        specify_and_canopen(destdir,"right directory");
+        specify(catalogfile,"base catalog file");
+        dontspecify(updatedir,"parameter");
+        if(config.planout != NULL || config.deadline > 0 || config.moves || config.hardlinks || config.dedup != DEDUP_NONE)
+        {
+            fprintf(stderr,"Error, The -planout, -timebudget, -moves, -hardlinks and -dedup cannot be used with bisync\n");
+            return 1;
+        }
+        return bisync(&config,sourcedir,destdir,catalogfile);
+    }
+    // **********************************************************************
+    if(!strcmp(command,"execplan"))
+    {
+        specify_and_canopen(sourcedir,"plan file");
+        dontspecify(destdir,"directory");
+        dontspecify(catalogfile,"parameter");
+        dontspecify(updatedir,"parameter");
+
+        SyncPlan *plan = new SyncPlan(&config);
+        r = plan->load(sourcedir);
+        if(r == 0)
+            r = plan->check();
+        if(r == 0)
+        {
+            if(config.verbose > 0)
+            {
+                printf("Execute the sync plan: \"%s\" -> \"%s\"\n",plan->sourcefolder(),plan->targetfolder());
+                if(config.guicall)
+                    fflush(stdout);
+            }
+            FileCopier *copier = new FileCopier(&config);
+            r = PathMaker::mkpath(plan->targetfolder(),false);
+            if(r == 0)
+                r = plan->execute(plan->sourcefolder(),plan->targetfolder(),copier);
+            if(r == 0 && config.planout != NULL)
+                r = plan->save_rest(config.planout);
+            if(r == 0)
+                copier->printStatistics();
+            delete copier;
+        }
+        delete plan;
         return r;
     }
     // **********************************************************************
@@ -423,15 +850,24 @@ int main(int argi,char **argc)
         dontspecify(destdir,"directory");
 
         UniCatalog *catalog = new UniCatalog(&config);
+        if(config.hardlinks)
+            catalog->setKeepMatched(true);
         r = catalog->read(catalogfile);
         if(r != 0) { delete catalog; return 1; }
 
         r = catalog->scandir_diff(sourcedir);
         if(r != 0) { delete catalog; return 1; }
 
+        if(config.moves)
+            catalog->detect_moves(DIRECTION_DIFF_TO_CAT,NULL,sourcedir);
+        if(config.journal != NULL && config.journal->open(config.resume))
+        {
+            delete catalog;
+            return 1;
+        }
         r = catalog->make_update_package(sourcedir,updatedir);
         delete catalog;
-        return r;
+        return close_journal(&config,r);
     }
     // **********************************************************************
     if(!strcmp(command,"makesyncupdate"))
@@ -442,15 +878,25 @@ int main(int argi,char **argc)
         dontspecify(catalogfile,"parameter");
 
         UniCatalog *catalog = new UniCatalog(&config);
+        if(config.hardlinks)
+            catalog->setKeepMatched(true);
         r = catalog->scandir(destdir,NULL,true);
         if(r != 0) { delete catalog; return 1; }
 
         r = catalog->scandir_diff(sourcedir);
         if(r != 0) { delete catalog; return 1; }
 
+        if(config.moves)
+            catalog->detect_moves(DIRECTION_DIFF_TO_CAT,destdir,sourcedir);
+
+        if(config.journal != NULL && config.journal->open(config.resume))
+        {
+            delete catalog;
+            return 1;
+        }
         r = catalog->make_update_package(sourcedir,updatedir);
         delete catalog;
-        return r;
+        return close_journal(&config,r);
     }
     // **********************************************************************
     if(!strcmp(command,"applyupdate"))
@@ -460,10 +906,12 @@ int main(int argi,char **argc)
         dontspecify(destdir,"directory");
         dontspecify(catalogfile,"parameter");
 
+        if(config.journal != NULL && config.journal->open(config.resume))
+            return 1;
         UniCatalog *catalog = new UniCatalog(&config);
         r = catalog->apply_update_package(updatedir,sourcedir);
         delete catalog;
-        return r;
+        return close_journal(&config,r);
     }
 
     fprintf(stderr,"Error, unknown command: %s\n",command);
@@ -503,6 +951,191 @@ void specify_and_canopen(char *val,const char *name)
     }
 }
 
+/* The two folder names refer to the same folder (the plans store absolute paths) */
+static bool samefolder(const char *a,const char *b)
+{
+    bool same = !strcmp(a,b);
+#ifndef _WIN32
+    char *ra = realpath(a,NULL),*rb = realpath(b,NULL);
+    if(ra != NULL && rb != NULL)
+        same = !strcmp(ra,rb);
+    free(ra);
+    free(rb);
+#endif
+    return same;
+}
+
+/* Continues an interrupted sync by its journal and saved plan, without scanning the folders.
+   The done operations are skipped, the partially copied big files are continued. */
+int resume_sync(UniSyncConfig *uc,const char *sourcedir,const char *destdir)
+{
+    SyncPlan *plan = new SyncPlan(uc);
+    int r = plan->load(uc->journal->planfile());
+    if(r == 0 && (!samefolder(plan->sourcefolder(),sourcedir) || !samefolder(plan->targetfolder(),destdir)))
+    {
+        fprintf(stderr,"Error, The journal belongs to an other sync: \"%s\" -> \"%s\"\n",plan->sourcefolder(),plan->targetfolder());
+        if(uc->guicall)
+            fflush(stderr);
+        r = 1;
+    }
+    if(r == 0)
+        r = uc->journal->open(true);
+    if(r == 0)
+    {
+        int done = plan->resume();
+        if(uc->verbose > 0)
+        {
+            printf("Resume the sync: %d of %d operations are left\n",plan->count() - done,plan->count());
+            if(uc->guicall)
+                fflush(stdout);
+        }
+        //The same folder names as the interrupted run, the file level records contain them
+        FileCopier *copier = new FileCopier(uc);
+        r = PathMaker::mkpath(destdir,false);
+        if(r == 0)
+            r = plan->execute(sourcedir,destdir,copier);
+        if(r == 0)
+            copier->printStatistics();
+        delete copier;
+    }
+    delete plan;
+    return r;
+}
+
+/* Syncs the source to more destinations: the source is scanned (and hashed) once, a copy of its catalog
+   is diffed with every destination, and the operations of all destinations run as one sync plan.
+   The file needed by several destinations is read once and written to all of them. */
+int sync_fanout(UniSyncConfig *uc,const char *sourcedir,char destdirs[][512],int count)
+{
+    int d,r = 0;
+    UniCatalog *catalogs[PLAN_MAXTARGETS];
+    UniCatalog *source = new UniCatalog(uc);
+
+    if(source->scandir(sourcedir,NULL,true))
+    {
+        delete source;
+        return 1;
+    }
+    for(d = 0 ; d < count ; ++d)
+    {
+        catalogs[d] = new UniCatalog(uc);
+        if(uc->hardlinks || uc->dedup != DEDUP_NONE)
+            catalogs[d]->setKeepMatched(true);
+        catalogs[d]->copy_from(source);
+        if(r == 0)
+            r = catalogs[d]->scandir_diff(destdirs[d]);
+        if(r == 0 && uc->moves)
+            catalogs[d]->detect_moves(DIRECTION_CAT_TO_DIFF,sourcedir,destdirs[d]);
+    }
+    delete source;
+
+    if(r == 0 && uc->interactivesync)
+    {
+        for(d = 0 ; d < count ; ++d)
+            catalogs[d]->print_sync_procedures(sourcedir,destdirs[d],DIRECTION_CAT_TO_DIFF);
+        printf("Do you really want to start the sync? [y/n]\n");
+        if(read_and_echo_character() != 'y')
+        {
+            printf("\nSync aborted.\n");
+            for(d = 0 ; d < count ; ++d)
+                delete catalogs[d];
+            return 0;
+        }
+    }
+    if(r == 0)
+    {
+        if(uc->verbose > 0)
+        {
+            printf("Sync directory to %d destinations...\n",count);
+            if(uc->guicall)
+                fflush(stdout);
+        }
+        SyncPlan *plan = new SyncPlan(uc);
+        for(d = 0 ; d < count ; ++d)
+        {
+            r = PathMaker::mkpath(destdirs[d],false);
+            if(r != 0)
+                break;
+            plan->settarget(destdirs[d]);
+            catalogs[d]->build_sync_plan(plan,DIRECTION_CAT_TO_DIFF);
+        }
+        FileCopier *copier = new FileCopier(uc);
+        if(r == 0)
+            r = plan->execute(sourcedir,destdirs[0],copier);
+        if(r == 0)
+            copier->printStatistics();
+        delete copier;
+        delete plan;
+    }
+    for(d = 0 ; d < count ; ++d)
+        delete catalogs[d];
+    return r;
+}
+
+/* Three-way sync of two folders: both are diffed against the base catalog (the state of the last bisync),
+   the one sided changes are synced to the other side in one plan, then the new base catalog is written. */
+int bisync(UniSyncConfig *uc,const char *leftdir,const char *rightdir,const char *catalogfile)
+{
+    int r;
+
+    //The in place modified files with unchanged size are found by the time
+    uc->watchtime = 1;
+    ThreeWaySync *sync = new ThreeWaySync(uc,leftdir,rightdir);
+    r = sync->read_base(catalogfile);
+    if(r == 0)
+        r = sync->diff();
+    if(r != 0)
+    {
+        delete sync;
+        return 1;
+    }
+    //The copies hash the data for the new base, no extra read is needed
+    if(uc->hashmode != HASH_EMPTY)
+        uc->verifycopy = 1;
+
+    SyncPlan *plan = new SyncPlan(uc);
+    sync->build_sync_plan(plan);
+    if(uc->verbose > 0 || uc->interactivesync)
+        sync->print_sync_procedures();
+    if(uc->interactivesync)
+    {
+        printf("Do you really want to start the sync? [y/n]\n");
+        if(read_and_echo_character() != 'y')
+        {
+            printf("\nSync aborted.\n");
+            delete plan;
+            delete sync;
+            return 0;
+        }
+    }
+
+    FileCopier *copier = new FileCopier(uc);
+    r = plan->execute(leftdir,rightdir,copier);
+    //After a failed sync the old base stays: the done changes are found the same on both sides next time
+    if(r == 0)
+        r = sync->write_base(catalogfile);
+    if(r == 0)
+        copier->printStatistics();
+    if(r == 0 && sync->conflicts() > 0 && uc->verbose > 0)
+        printf("%d conflict(s) are left as is, resolve them and run bisync again\n",sync->conflicts());
+    delete copier;
+    delete plan;
+    delete sync;
+    return r;
+}
+
+/* Closes the journal after the command, it is removed if the run is complete */
+int close_journal(UniSyncConfig *uc,int r)
+{
+    if(uc->journal != NULL)
+    {
+        uc->journal->close(r);
+        delete uc->journal;
+        uc->journal = NULL;
+    }
+    return r;
+}
+
 void dontspecify(char *val,const char *name)
 {
     if(strlen(val) > 0)
@@ -523,6 +1156,32 @@ UniSyncConfig::UniSyncConfig(void)
     fixmtime = 0;
     usestd = 0;
     interactivesync = 0;
+    fprint = 0;
+    verifycopy = 0;
+    blocksize = 0;
+    chunking = 0;
+    chunkmin = CHUNK_MIN_DEFAULT;
+    chunkavg = CHUNK_AVG_DEFAULT;
+    chunkmax = CHUNK_MAX_DEFAULT;
+    copyjobs = 1;
+    splitsize = 0;
+    splitjobs = SPLITCOPY_JOBS_DEFAULT;
+    uringdepth = 0;
+    directio = 0;
+    atomiccopy = 0;
+    syncbatch = 0;
+    readlimit = writelimit = metalimit = 0;
+    ioidle = 0;
+    throttlefile = NULL;
+    moves = 0;
+    hardlinks = 0;
+    dedup = DEDUP_NONE;
+    planout = NULL;
+    copyorder = COPYORDER_SCAN;
+    deadline = 0;
+    journal = NULL;
+    resume = 0;
+    destinations = 1;
     exl = NULL;
 }
 
@@ -534,6 +1193,7 @@ void UniSyncConfig::save(void)
     s_skiphash = skiphash;
     s_exclude = exclude;
     s_fixmtime = fixmtime;
+    s_chunking = chunking;
 }
 
 void UniSyncConfig::restore(void)
@@ -544,6 +1204,7 @@ void UniSyncConfig::restore(void)
     skiphash = s_skiphash;
     exclude = s_exclude;
     fixmtime = s_fixmtime;
+    chunking = s_chunking;
 }
 
 /* end code */
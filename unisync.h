@@ -9,6 +9,8 @@
 #ifndef UNISYNC_UNISYNC_GLOBAL_H
 #define UNISYNC_UNISYNC_GLOBAL_H
 
+#include <time.h>
+
 #define PROGRAMNAME "UniSync"
 #define PROGRAMCMD  "unisync"
 #define VERSION     "1.0"
@@ -17,6 +19,18 @@
 #define HASH_MD5        1
 #define HASH_SHA256     2
 
+#define DEDUP_NONE      0
+#define DEDUP_REFLINK   1
+#define DEDUP_HARDLINK  2
+
+#define COPYORDER_SCAN      0
+#define COPYORDER_SMALL     1
+#define COPYORDER_LARGE     2
+#define COPYORDER_NEWEST    3
+#define COPYORDER_MIXED     4
+
+class SyncJournal;
+
 #define EXCL_FILE       0
 #define EXCL_DIR        1
 #define EXCL_PATH       2
@@ -41,6 +55,30 @@ public:
     int fixmtime;
     int usestd;
     int interactivesync;
+    int fprint;
+    int verifycopy;
+    unsigned int blocksize;
+    int chunking;
+    unsigned int chunkmin,chunkavg,chunkmax;
+    int copyjobs;
+    unsigned long long splitsize;
+    int splitjobs;
+    int uringdepth;
+    int directio;
+    int atomiccopy;
+    unsigned int syncbatch;
+    double readlimit,writelimit,metalimit;
+    int ioidle;
+    const char *throttlefile;
+    int moves;
+    int hardlinks;
+    int dedup;
+    const char *planout;
+    int copyorder;
+    time_t deadline;
+    SyncJournal *journal;
+    int resume;
+    int destinations;
     ExcludeNames *exl;
 
     UniSyncConfig(void);
@@ -48,7 +86,7 @@ public:
     void restore(void);
 
 private:
-    int s_verbose,s_hashmode,s_watchtime,s_skiphash,s_exclude,s_fixmtime;
+    int s_verbose,s_hashmode,s_watchtime,s_skiphash,s_exclude,s_fixmtime,s_chunking;
 };
 
 #endif // UNISYNC_UNISYNC_GLOBAL_H
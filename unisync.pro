@@ -2,6 +2,6 @@ TEMPLATE = app
 TARGET = unisync
 CONFIG += console
 CONFIG -= qt
-SOURCES += unisync.cpp utils.cpp catalog.cpp 
-HEADERS += unisync.h utils.h catalog.h
+SOURCES += unisync.cpp utils.cpp catalog.cpp scheduler.cpp syncplan.cpp subtree.cpp uringcopy.cpp throttle.cpp journal.cpp bisync.cpp 
+HEADERS += unisync.h utils.h catalog.h scheduler.h syncplan.h subtree.h uringcopy.h throttle.h journal.h bisync.h
 
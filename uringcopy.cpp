@@ -0,0 +1,542 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "unisync.h"
+#include "utils.h"
+#include "scheduler.h"
+#include "uringcopy.h"
+#include "throttle.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <utime.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define SLOT_IDLE   0
+#define SLOT_READ   1
+#define SLOT_WRITE  2
+
+#define URING_CANCEL_DATA   0xffffffffffffffffULL //user_data of the cancel requests
+
+static int io_uring_setup(unsigned entries,struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup,entries,p);
+}
+
+static int io_uring_enter(int fd,unsigned to_submit,unsigned min_complete,unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter,fd,to_submit,min_complete,flags,NULL,0);
+}
+
+static int io_uring_register(int fd,unsigned opcode,void *arg,unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register,fd,opcode,arg,nr_args);
+}
+
+UringCopier::UringCopier(UniSyncConfig *ucp,FileCopier *mastercopier)
+{
+    uc = ucp;
+    master = mastercopier;
+    ringfd = -1;
+    depth = uc->uringdepth;
+    fixedbuffers = false;
+    sqring = cqring = MAP_FAILED;
+    sqes = (struct io_uring_sqe *)MAP_FAILED;
+    sqringsize = cqringsize = sqessize = 0;
+    tosubmit = 0;
+    slots = NULL;
+    files = NULL;
+    nextjob = NULL;
+    failed = 0;
+    sqentries = 0;
+    leaked = false;
+}
+
+UringCopier::~UringCopier(void)
+{
+    //The kernel may still use the buffers of an undrained ring, they are left allocated then
+    if(slots != NULL && !leaked)
+    {
+        for(unsigned int i = 0 ; i < depth ; ++i)
+            delete[] slots[i].buff;
+        delete[] slots;
+    }
+    delete[] files;
+    if(sqes != MAP_FAILED)
+        munmap(sqes,sqessize);
+    if(cqring != MAP_FAILED && cqring != sqring)
+        munmap(cqring,cqringsize);
+    if(sqring != MAP_FAILED)
+        munmap(sqring,sqringsize);
+    if(ringfd >= 0)
+        close(ringfd);
+}
+
+bool UringCopier::init(void)
+{
+    struct io_uring_params p;
+
+    memset(&p,0,sizeof(p));
+    ringfd = io_uring_setup(depth,&p);
+    if(ringfd < 0)
+        return false;
+
+    sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(cqringsize > sqringsize)
+            sqringsize = cqringsize;
+        cqringsize = sqringsize;
+    }
+    sqring = mmap(NULL,sqringsize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ringfd,IORING_OFF_SQ_RING);
+    if(sqring == MAP_FAILED)
+        return false;
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        cqring = sqring;
+    else
+    {
+        cqring = mmap(NULL,cqringsize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ringfd,IORING_OFF_CQ_RING);
+        if(cqring == MAP_FAILED)
+            return false;
+    }
+    sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(NULL,sqessize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ringfd,IORING_OFF_SQES);
+    if(sqes == MAP_FAILED)
+        return false;
+
+    sq_head  = (unsigned *)((char *)sqring + p.sq_off.head);
+    sq_tail  = (unsigned *)((char *)sqring + p.sq_off.tail);
+    sq_mask  = (unsigned *)((char *)sqring + p.sq_off.ring_mask);
+    sq_array = (unsigned *)((char *)sqring + p.sq_off.array);
+    cq_head  = (unsigned *)((char *)cqring + p.cq_off.head);
+    cq_tail  = (unsigned *)((char *)cqring + p.cq_off.tail);
+    cq_mask  = (unsigned *)((char *)cqring + p.cq_off.ring_mask);
+    cqes     = (struct io_uring_cqe *)((char *)cqring + p.cq_off.cqes);
+
+    //Every slot has at most one operation in flight, so the submission queue can not overflow
+    sqentries = p.sq_entries;
+    if(depth > p.sq_entries)
+        depth = p.sq_entries;
+    slots = new struct UringSlot[depth];
+    files = new struct UringFile*[depth];
+    struct iovec *iovs = new struct iovec[depth];
+    for(unsigned int i = 0 ; i < depth ; ++i)
+    {
+        slots[i].file = NULL;
+        slots[i].buff = new unsigned char[URING_BUFFSIZE];
+        slots[i].state = SLOT_IDLE;
+        iovs[i].iov_base = slots[i].buff;
+        iovs[i].iov_len = URING_BUFFSIZE;
+        files[i] = NULL;
+    }
+    //Registering can fail on the locked memory limit, then the plain readv/writev is used
+    fixedbuffers = (io_uring_register(ringfd,IORING_REGISTER_BUFFERS,iovs,depth) == 0);
+    delete[] iovs;
+
+    if(uc->verbose > 2)
+    {
+        printf("Copy engine: io_uring, queue depth %u, %s buffers\n",depth,fixedbuffers ? "registered" : "unregistered");
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    return true;
+}
+
+void UringCopier::queue(struct UringSlot *slot,bool write)
+{
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    int slotindex = slot - slots;
+
+    memset(sqe,0,sizeof(struct io_uring_sqe));
+    Throttle::consume(write ? THROTTLE_WRITE : THROTTLE_READ,write ? slot->filled - slot->wdone : slot->length);
+    if(write)
+    {
+        slot->state = SLOT_WRITE;
+        sqe->fd = slot->file->dstfd;
+        slot->iov.iov_base = slot->buff + slot->wdone;
+        slot->iov.iov_len = slot->filled - slot->wdone;
+        sqe->off = slot->offset + slot->wdone;
+    }
+    else
+    {
+        slot->state = SLOT_READ;
+        sqe->fd = slot->file->srcfd;
+        slot->iov.iov_base = slot->buff;
+        slot->iov.iov_len = slot->length;
+        sqe->off = slot->offset;
+    }
+    if(fixedbuffers)
+    {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (unsigned long long)slot->iov.iov_base;
+        sqe->len = slot->iov.iov_len;
+        sqe->buf_index = slotindex;
+    }
+    else
+    {
+        sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (unsigned long long)&slot->iov;
+        sqe->len = 1;
+    }
+    sqe->user_data = slotindex;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail,tail + 1,__ATOMIC_RELEASE);
+    ++tosubmit;
+}
+
+int UringCopier::submit_and_wait(void)
+{
+    int n;
+    do
+        n = io_uring_enter(ringfd,tosubmit,1,IORING_ENTER_GETEVENTS);
+    while(n < 0 && errno == EINTR);
+    if(n < 0)
+    {
+        fprintf(stderr,"Error, Copy: io_uring submit failed (%d)\n",errno);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+    tosubmit -= n;
+    return 0;
+}
+
+/* Opens the next job's files. The empty and sparse files are finished at once, the next job is taken then */
+struct UringFile *UringCopier::open_next(void)
+{
+    unsigned int i;
+    struct UringFile *file;
+
+    while(true)
+    {
+        for(i = 0 ; i < depth ; ++i)
+            if(files[i] == NULL)
+                break;
+        if(i >= depth || nextjob == NULL || failed)
+            return NULL;
+
+        file = new UringFile();
+        file->job = nextjob;
+        nextjob = nextjob->n;
+        file->srcfd = file->dstfd = -1;
+        file->atomic = false;
+        file->next = file->written = 0;
+        file->inflight = 0;
+        files[i] = file;
+
+        Throttle::consume(THROTTLE_META,1);
+        if(stat(file->job->source,&file->st))
+        {
+            fprintf(stderr,"Error, Copy: cannot get times of source file: %s (%d)\n",file->job->source,errno);
+            if(uc->guicall)
+                fflush(stderr);
+            failed = 1;
+            return NULL;
+        }
+        //The sparse files are copied by their data regions by FileCopier
+        if(issparse(&file->st))
+        {
+            if(master->copy(file->job->source,file->job->dest))
+            {
+                failed = 1;
+                return NULL;
+            }
+            close_file(file);
+            continue;
+        }
+        if(uc->verbose > 1)
+        {
+            printf("Copy %s ..\n",file->job->source);
+            if(uc->guicall)
+                fflush(stdout);
+        }
+        file->atomic = (uc->atomiccopy && !master->tempname(file->job->dest,file->target));
+        if(!file->atomic)
+            strcpy(file->target,file->job->dest);
+        if(PathMaker::mkpath(file->target,true) || (!file->atomic && master->unshare(file->target)))
+        {
+            failed = 1;
+            return NULL;
+        }
+        if((file->srcfd = open(file->job->source,O_RDONLY)) == -1 ||
+           (file->dstfd = open(file->target,O_WRONLY | O_CREAT | O_TRUNC,S_IRUSR | S_IWUSR)) == -1)
+        {
+            fprintf(stderr,"Error, Copy: cannot copy the file: %s (%d)\n",file->job->source,errno);
+            if(uc->guicall)
+                fflush(stderr);
+            failed = 1;
+            return NULL;
+        }
+        posix_fadvise(file->srcfd,0,0,POSIX_FADV_SEQUENTIAL);
+        if(file->st.st_size >= PREALLOC_MINSIZE)
+            fallocate(file->dstfd,0,0,file->st.st_size);
+        if(file->st.st_size == 0)
+        {
+            if(finish_file(file))
+                return NULL;
+            continue;
+        }
+        return file;
+    }
+}
+
+/* The oldest open file which has unread data, or a newly opened one */
+struct UringFile *UringCopier::pick_file(void)
+{
+    for(unsigned int i = 0 ; i < depth ; ++i)
+        if(files[i] != NULL && files[i]->next < (unsigned long long)files[i]->st.st_size)
+            return files[i];
+    return open_next();
+}
+
+void UringCopier::close_file(struct UringFile *file)
+{
+    for(unsigned int i = 0 ; i < depth ; ++i)
+        if(files[i] == file)
+            files[i] = NULL;
+    if(file->srcfd >= 0)
+        close(file->srcfd);
+    if(file->dstfd >= 0)
+        close(file->dstfd);
+    if(file->atomic) //unfinished temporary file
+        unlink(file->target);
+    delete file;
+}
+
+int UringCopier::finish_file(struct UringFile *file)
+{
+    struct utimbuf d_mt;
+    int r;
+
+    close(file->srcfd);
+    r = close(file->dstfd);
+    file->srcfd = file->dstfd = -1;
+    if(r != 0)
+    {
+        fprintf(stderr,"Error, Copy: cannot copy the file: %s (%d)\n",file->job->source,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        failed = 1;
+        return 1;
+    }
+    d_mt.actime = file->st.st_atime;
+    d_mt.modtime = file->st.st_mtime;
+    if(utime(file->target,&d_mt) != 0)
+    {
+        fprintf(stderr,"Error, Copy: cannot set times of target file: %s (%d)\n",file->job->dest,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        failed = 1;
+        return 1;
+    }
+    if(chmod(file->target,file->st.st_mode) != 0)
+    {
+        fprintf(stderr,"Error, Copy: cannot set mode of target file: %s (%d)\n",file->job->dest,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        failed = 1;
+        return 1;
+    }
+    if(file->atomic)
+    {
+        file->atomic = false; //renamed or removed by commit_file
+        if(master->commit_file(file->target,file->job->dest))
+        {
+            failed = 1;
+            return 1;
+        }
+    }
+    master->ckbytes += ((double)file->written) / 1024;
+    close_file(file);
+    return 0;
+}
+
+/* Processes a completion of the slot. Returns 1 if the slot became idle */
+int UringCopier::complete(struct UringSlot *slot,int res)
+{
+    struct UringFile *file = slot->file;
+
+    if(res == -EINTR || res == -EAGAIN)
+    {
+        queue(slot,slot->state == SLOT_WRITE);
+        return 0;
+    }
+    if(res < 0 || (res == 0 && slot->state == SLOT_READ))
+    {
+        if(!failed)
+        {
+            if(res == 0)
+                fprintf(stderr,"Error, Copy: the source file changed while copying: %s\n",file->job->source);
+            else
+                fprintf(stderr,"Error, Copy: cannot copy the file: %s (%d)\n",file->job->source,-res);
+            if(uc->guicall)
+                fflush(stderr);
+        }
+        failed = 1;
+    }
+    else if(slot->state == SLOT_READ)
+    {
+        slot->filled = res;
+        slot->wdone = 0;
+        if(!failed)
+        {
+            queue(slot,true);
+            return 0;
+        }
+    }
+    else
+    {
+        slot->wdone += res;
+        if(slot->wdone < slot->filled && !failed)
+        {
+            queue(slot,true);
+            return 0;
+        }
+        file->written += slot->filled;
+        if(slot->filled < slot->length && !failed) //short read, read the rest of the range
+        {
+            slot->offset += slot->filled;
+            slot->length -= slot->filled;
+            queue(slot,false);
+            return 0;
+        }
+    }
+
+    slot->state = SLOT_IDLE;
+    slot->file = NULL;
+    --file->inflight;
+    if(failed)
+    {
+        if(file->inflight == 0)
+            close_file(file);
+    }
+    else if(file->inflight == 0 && file->written == (unsigned long long)file->st.st_size)
+        finish_file(file);
+    return 1;
+}
+
+/* Waits for every operation of the slots after a failed submit, so the files can be closed and
+   the buffers freed. The submitted operations are cancelled to shorten the wait.
+   If the ring does not work any more, the buffers and the files are left to the kernel (leaked). */
+void UringCopier::drain(void)
+{
+    unsigned int i,busy = 0;
+    int n;
+
+    for(i = 0 ; i < depth ; ++i)
+        if(slots[i].state != SLOT_IDLE)
+            ++busy;
+    for(i = 0 ; i < depth && busy > 0 ; ++i)
+    {
+        unsigned tail = *sq_tail;
+        if(slots[i].state == SLOT_IDLE || tail - __atomic_load_n(sq_head,__ATOMIC_ACQUIRE) >= sqentries)
+            continue;
+        struct io_uring_sqe *sqe = &sqes[tail & *sq_mask];
+        memset(sqe,0,sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = i;
+        sqe->user_data = URING_CANCEL_DATA;
+        sq_array[tail & *sq_mask] = tail & *sq_mask;
+        __atomic_store_n(sq_tail,tail + 1,__ATOMIC_RELEASE);
+        ++tosubmit;
+    }
+    while(busy > 0)
+    {
+        n = io_uring_enter(ringfd,tosubmit,1,IORING_ENTER_GETEVENTS);
+        if(n < 0)
+        {
+            if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            leaked = true;
+            return;
+        }
+        tosubmit -= n;
+
+        unsigned head = *cq_head;
+        while(head != __atomic_load_n(cq_tail,__ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            if(cqe->user_data != URING_CANCEL_DATA && slots[cqe->user_data].state != SLOT_IDLE)
+            {
+                slots[cqe->user_data].state = SLOT_IDLE;
+                --busy;
+            }
+            ++head;
+        }
+        __atomic_store_n(cq_head,head,__ATOMIC_RELEASE);
+    }
+}
+
+int UringCopier::run(struct CopyJob *jobs)
+{
+    unsigned int i,inflight = 0;
+    struct UringFile *file;
+
+    nextjob = jobs;
+    failed = 0;
+    while(true)
+    {
+        //Start a read on every idle slot
+        for(i = 0 ; i < depth && !failed ; ++i)
+        {
+            if(slots[i].state != SLOT_IDLE)
+                continue;
+            if((file = pick_file()) == NULL)
+                break;
+            slots[i].file = file;
+            slots[i].offset = file->next;
+            slots[i].length = URING_BUFFSIZE;
+            if(file->next + URING_BUFFSIZE > (unsigned long long)file->st.st_size)
+                slots[i].length = file->st.st_size - file->next;
+            file->next += slots[i].length;
+            ++file->inflight;
+            ++inflight;
+            queue(&slots[i],false);
+        }
+        if(inflight == 0)
+            break;
+
+        if(submit_and_wait())
+        {
+            failed = 1;
+            drain();
+            break;
+        }
+
+        unsigned head = *cq_head;
+        while(head != __atomic_load_n(cq_tail,__ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            if(cqe->user_data != URING_CANCEL_DATA && complete(&slots[cqe->user_data],cqe->res))
+                --inflight;
+            ++head;
+        }
+        __atomic_store_n(cq_head,head,__ATOMIC_RELEASE);
+    }
+
+    //Files opened (or half done) when the error occured. The files of an undrained ring stay open.
+    for(i = 0 ; i < depth ; ++i)
+        if(files[i] != NULL && !leaked)
+            close_file(files[i]);
+    return failed;
+}
+
+#endif
+
+/* end code */
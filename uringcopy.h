@@ -0,0 +1,94 @@
+/* **********************************************************
+    UniSync - Universal direcotry sync-diff utility
+     http://hyperprog.com
+
+    (C) 2014-2019 Peter Deak (hyper80@gmail.com)
+
+    License: GPLv2  http://www.gnu.org/licenses/gpl-2.0.html
+************************************************************* */
+#ifndef UNISYNC_URINGCOPY_H
+#define UNISYNC_URINGCOPY_H
+
+#include "unisync.h"
+#include "utils.h"
+#include "scheduler.h"
+
+#define URING_DEPTH_DEFAULT     32
+#define URING_BUFFSIZE          COPY_BUFFSIZE
+
+#ifdef __linux__
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct UringFile
+{
+    struct CopyJob *job;
+    char target[512];           //The written file: the destination or its temporary name (-atomic)
+    bool atomic;
+    int srcfd,dstfd;
+    struct stat st;
+    unsigned long long next;    //The next offset to read
+    unsigned long long written;
+    int inflight;
+};
+
+struct UringSlot
+{
+    struct UringFile *file;
+    unsigned char *buff;
+    struct iovec iov;
+    unsigned long long offset;
+    unsigned int length;        //Requested read length
+    unsigned int filled;        //Bytes read to the buffer
+    unsigned int wdone;         //Bytes written from the buffer
+    int state;
+};
+
+/* Asynchronous copy engine on io_uring: keeps uc->uringdepth read/write operations in flight,
+   spread over several files. The buffers are registered to the kernel if possible.
+   The io_uring is used through the raw system calls, no liburing needed. */
+class UringCopier
+{
+public:
+    UringCopier(UniSyncConfig *ucp,FileCopier *mastercopier);
+    ~UringCopier(void);
+
+    bool init(void); //false if io_uring is not available
+    int  run(struct CopyJob *jobs);
+
+private:
+    UniSyncConfig *uc;
+    FileCopier *master;
+    int ringfd;
+    unsigned int depth;
+    bool fixedbuffers;
+
+    void *sqring,*cqring;
+    size_t sqringsize,cqringsize;
+    struct io_uring_sqe *sqes;
+    size_t sqessize;
+    unsigned *sq_head,*sq_tail,*sq_mask,*sq_array;
+    unsigned *cq_head,*cq_tail,*cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int tosubmit;
+    unsigned int sqentries;
+    bool leaked;                //The ring could not be drained, the buffers stay allocated
+
+    struct UringSlot *slots;
+    struct UringFile **files;
+    struct CopyJob *nextjob;
+    int failed;
+
+    void queue(struct UringSlot *slot,bool write);
+    int  submit_and_wait(void);
+    void drain(void);
+    struct UringFile *open_next(void);
+    struct UringFile *pick_file(void);
+    int  finish_file(struct UringFile *file);
+    void close_file(struct UringFile *file);
+    int  complete(struct UringSlot *slot,int res);
+};
+#endif
+
+#endif // UNISYNC_URINGCOPY_H
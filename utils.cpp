@@ -25,9 +25,19 @@
 #else
 #include <termios.h>
 #include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #endif
 
+#include <mutex>
+#include <thread>
+#include <atomic>
+
 #include "utils.h"
+#include "catalog.h"
+#include "throttle.h"
+#include "journal.h"
+#include "syncplan.h"
 
 #include "sha2.c"
 #include "md5.c"
@@ -89,9 +99,12 @@ char *chop(char *str)
 
 /* ************************************************************************************** */
 struct PathMakerCacheItem* PathMaker::cache = NULL;
+static std::mutex pathmaker_mutex;
+static std::mutex copymethod_mutex;
 
 void PathMaker::clearCache(void)
 {
+    std::lock_guard<std::mutex> lock(pathmaker_mutex);
     struct PathMakerCacheItem *old,*r=cache;
     while(r != NULL)
     {
@@ -127,6 +140,9 @@ int PathMaker::mkpath(const char *path,bool contains_filename)
     int i;
     struct stat st;
 
+    //The path is cached before created, so the whole function is serialized between copy threads
+    std::lock_guard<std::mutex> lock(pathmaker_mutex);
+
     char *p = strdup(path);
     if(contains_filename)
     {
@@ -166,9 +182,11 @@ int PathMaker::mkpath(const char *path,bool contains_filename)
             {
                 if(cb[0] != '\0')
                 {
+                    Throttle::consume(THROTTLE_META,1);
                     if (stat(cb, &st) != 0)
                     {
-                        if(mymkdir(cb) != 0)
+                        //Other copy thread can create it in the meantime
+                        if(mymkdir(cb) != 0 && errno != EEXIST)
                         {
                             fprintf(stderr,"Error, cannot create directory: %s\n",cb);
                             free(p);
@@ -188,16 +206,253 @@ int PathMaker::mkpath(const char *path,bool contains_filename)
 }
 
 /* ************************************************************************************** */
-double FileCopier::ckbytes;
+struct CopyMethodCacheItem* FileCopier::methodcache = NULL;
 
 FileCopier::FileCopier(UniSyncConfig *ucp)
 {
     uc = ucp;
+    pending = NULL;
+    pendingcount = 0;
+    lastdest[0] = '\0';
     resetCounters();
 }
 
-int FileCopier::copy(const char *source,const char *dest)
+FileCopier::~FileCopier(void)
+{
+    commit(true);
+}
+
+/* If the item is passed it must describe the source file (its hash is the hash of the source)
+   In -verify mode the hash is computed while copying and compared to the item's hash,
+   so the item describes the destination file after a succesful copy. */
+int FileCopier::copy(const char *source,const char *dest,struct cItem *item)
+{
+    char tmp[512];
+    struct stat s_st,d_st;
+
+    //Copied by the interrupted run: the journal can be newer than the data, so the target is checked too
+    if(journaled(JOURNAL_COPY,dest) && stat(source,&s_st) == 0 && stat(dest,&d_st) == 0 &&
+       s_st.st_size == d_st.st_size && s_st.st_mtime == d_st.st_mtime)
+        return 0;
+    if(!uc->atomiccopy || tempname(dest,tmp))
+    {
+        if(unshare(dest))
+            return record(JOURNAL_COPY,dest,1);
+        return record(JOURNAL_COPY,dest,copy_file(source,dest,item));
+    }
+    if(copy_file(source,tmp,item))
+    {
+        unlink(tmp);
+        return 1;
+    }
+    return record(JOURNAL_COPY,dest,commit_file(tmp,dest));
+}
+
+/* The operation is done by the interrupted run (-resume). The sync plan journals its whole operations,
+   the file level records are used by the other commands. */
+bool FileCopier::journaled(char kind,const char *path)
+{
+    return uc->journal != NULL && uc->journal->perfile() && uc->journal->isdone(kind,path);
+}
+
+/* Appends the succesful operation to the journal, after its result is synced to the disk. Returns the result */
+int FileCopier::record(char kind,const char *path,int result)
+{
+    if(result == 0 && uc->journal != NULL && uc->journal->perfile())
+    {
+        if(syncentry(path))
+        {
+            fprintf(stderr,"Error, cannot sync the target: %s (%d)\n",path,errno);
+            if(uc->guicall)
+                fflush(stderr);
+            return 1;
+        }
+        uc->journal->done(kind,path);
+    }
+    return result;
+}
+
+/* Generates the temporary name of the atomic copy: a hidden file in the target's directory.
+   Returns 1 if the name would be too long, the file is copied directly then. */
+int FileCopier::tempname(const char *dest,char *tmp)
+{
+    const char *base = strrchr(dest,'/');
+#ifdef _WIN32
+    const char *wbase = strrchr(dest,'\\');
+    if(wbase != NULL && (base == NULL || wbase > base))
+        base = wbase;
+#endif
+    base = (base == NULL ? dest : base + 1);
+    if(strlen(base) + strlen(ATOMIC_TMPSUFFIX) + 1 > 255 || strlen(dest) + strlen(ATOMIC_TMPSUFFIX) + 1 >= 512)
+        return 1;
+    snprintf(tmp,512,"%.*s.%s%s",(int)(base - dest),dest,base,ATOMIC_TMPSUFFIX);
+    return 0;
+}
+
+/* Moves the completely written temporary file to its final name.
+   With batched durability (-atomic=N) the rename waits until the data of the batch is synced,
+   so a crash never leaves a partially written file under the final name.
+   Without batch the data of the file is synced before the rename.
+   With the journal the file is renamed at once, the journal records it as done. */
+int FileCopier::commit_file(const char *tmp,const char *dest)
+{
+    if(uc->syncbatch > 0 && uc->journal == NULL)
+    {
+        struct PendingRename *p = new PendingRename();
+        strcpy(p->tmp,tmp);
+        strcpy(p->dest,dest);
+        p->n = pending;
+        pending = p;
+        if(++pendingcount >= uc->syncbatch)
+            return commit(false);
+        return 0;
+    }
+    if(uc->journal == NULL && syncfile(tmp))
+    {
+        fprintf(stderr,"Error, Copy: cannot sync the temporary file of %s (%d)\n",dest,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        unlink(tmp);
+        return 1;
+    }
+#ifdef _WIN32
+    if(MoveFileExA(tmp,dest,MOVEFILE_REPLACE_EXISTING) == 0)
+#else
+    if(rename(tmp,dest) != 0)
+#endif
+    {
+        fprintf(stderr,"Error, Copy: cannot rename the temporary file to %s (%d)\n",dest,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        unlink(tmp);
+        return 1;
+    }
+    strcpy(lastdest,dest);
+    return 0;
+}
+
+/* Flushes the data of one file */
+int FileCopier::syncfile(const char *path)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    int fd = open(path,O_RDONLY);
+    if(fd < 0)
+        return 1;
+    int r = fsync(fd);
+    close(fd);
+    return r == 0 ? 0 : 1;
+#endif
+}
+
+/* Makes the entry durable before the journal records it: the data of the file or folder (if it still exists)
+   and its name in the parent folder */
+int FileCopier::syncentry(const char *path)
+{
+#ifdef _WIN32
+    (void)path;
+    return 0;
+#else
+    char parent[512];
+    struct stat st;
+    const char *base = strrchr(path,'/');
+    size_t l;
+
+    if(lstat(path,&st) == 0 && !S_ISLNK(st.st_mode) && syncfile(path))
+        return 1;
+    if(base == NULL)
+        return syncfile(".");
+    l = (base == path ? 1 : base - path);
+    if(l >= 512)
+        return 1;
+    memcpy(parent,path,l);
+    parent[l] = '\0';
+    return syncfile(parent);
+#endif
+}
+
+/* Flushes the filesystem of the target path. (One syncfs instead of fsync of every file) */
+int FileCopier::syncdest(const char *path)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    int fd = open(path,O_RDONLY);
+    if(fd < 0)
+        return 1;
+    int r = syncfs(fd);
+    close(fd);
+    return r == 0 ? 0 : 1;
+#endif
+}
+
+/* Makes the pending batch durable: syncs the written data, renames the files into place.
+   The final commit syncs the renames too (also the renames of the unbatched -atomic copies). */
+int FileCopier::commit(bool final)
+{
+    struct PendingRename *p,*old;
+    int r = 0;
+
+    if(pending != NULL)
+    {
+        if(syncdest(pending->tmp))
+        {
+            fprintf(stderr,"Error, Copy: cannot sync the target filesystem of %s (%d)\n",pending->dest,errno);
+            if(uc->guicall)
+                fflush(stderr);
+            r = 1;
+        }
+        if(!r)
+            strcpy(lastdest,pending->dest);
+        p = pending;
+        while(p != NULL)
+        {
+#ifdef _WIN32
+            if(!r && MoveFileExA(p->tmp,p->dest,MOVEFILE_REPLACE_EXISTING) == 0)
+#else
+            if(!r && rename(p->tmp,p->dest) != 0)
+#endif
+            {
+                fprintf(stderr,"Error, Copy: cannot rename the temporary file to %s (%d)\n",p->dest,errno);
+                if(uc->guicall)
+                    fflush(stderr);
+                r = 1;
+            }
+            if(r)
+                unlink(p->tmp);
+            old = p;
+            p = p->n;
+            delete old;
+        }
+        pending = NULL;
+        pendingcount = 0;
+        if(uc->verbose > 2)
+        {
+            printf("Durable batch committed.\n");
+            if(uc->guicall)
+                fflush(stdout);
+        }
+    }
+    if(final && lastdest[0] != '\0')
+    {
+        if(!r && syncdest(lastdest))
+        {
+            fprintf(stderr,"Error, Copy: cannot sync the target filesystem of %s (%d)\n",lastdest,errno);
+            if(uc->guicall)
+                fflush(stderr);
+            r = 1;
+        }
+        lastdest[0] = '\0';
+    }
+    return r;
+}
+
+int FileCopier::copy_file(const char *source,const char *dest,struct cItem *item)
 {
+    Throttle::consume(THROTTLE_META,1);
+    if(uc->verifycopy && item != NULL && (item->htype != HASH_EMPTY || uc->hashmode != HASH_EMPTY))
+        return copy_verify(source,dest,item);
 #ifdef _WIN32
     if(uc->usestd)
         return copy_std(source,dest);
@@ -209,13 +464,39 @@ int FileCopier::copy(const char *source,const char *dest)
 #endif
 }
 
+#ifndef _WIN32
+static bool iszero(const unsigned char *buff,size_t n)
+{
+    return n > 0 && buff[0] == 0 && !memcmp(buff,buff + 1,n - 1);
+}
+
+/* Writes the buffer to the target, or seeks over it if it is all zero and the source is sparse
+   (the target gets hole there, the size is fixed by finish_sparse) */
+static size_t write_sparse(const unsigned char *buff,size_t n,FILE *dst,bool sparse)
+{
+    if(sparse && iszero(buff,n))
+        return fseeko(dst,n,SEEK_CUR) == 0 ? n : 0;
+    return fwrite(buff,1,n,dst);
+}
+
+static int finish_sparse(FILE *dst,unsigned long long size,bool sparse)
+{
+    if(!sparse)
+        return 0;
+    if(fflush(dst) != 0 || ftruncate(fileno(dst),size) != 0)
+        return 1;
+    return 0;
+}
+#endif
+
 int FileCopier::copy_std(const char *source,const char *dest)
 {
     int n;
     FILE *src=NULL,*dst=NULL;
     unsigned char *buff;
-    unsigned int copied=0;
+    unsigned long long copied=0;
     double size;
+    bool sparse = false;
 
     if(uc->verbose > 1)
     {
@@ -235,18 +516,50 @@ int FileCopier::copy_std(const char *source,const char *dest)
         fclose(src);
         return 1;
     }
+#ifndef _WIN32
+    struct stat src_st;
+    sparse = (fstat(fileno(src),&src_st) == 0 && issparse(&src_st));
+#endif
 
     buff = new unsigned char[8192];
     do
     {
+        Throttle::consume(THROTTLE_READ,8192);
         n = fread(buff,1,8192,src);
         if(n > 0)
-            fwrite(buff,1,n,dst);
+        {
+            Throttle::consume(THROTTLE_WRITE,n);
+#ifdef _WIN32
+            if(fwrite(buff,1,n,dst) != (size_t)n)
+#else
+            if(write_sparse(buff,n,dst,sparse) != (size_t)n)
+#endif
+            {
+                fprintf(stderr,"Error, Copy: cannot write target file: %s (%d)\n",dest,errno);
+                if(uc->guicall)
+                    fflush(stderr);
+                delete[] buff;
+                fclose(src);
+                fclose(dst);
+                return 1;
+            }
+        }
         copied += n;
     }
     while (n > 0);
     fclose(src);
-    fclose(dst);
+#ifdef _WIN32
+    if(fclose(dst) != 0)
+#else
+    if(finish_sparse(dst,copied,sparse) | fclose(dst))
+#endif
+    {
+        fprintf(stderr,"Error, Copy: cannot write target file: %s (%d)\n",dest,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        delete[] buff;
+        return 1;
+    }
 
     struct stat s_st;
     struct utimbuf d_mt;
@@ -283,6 +596,127 @@ int FileCopier::copy_std(const char *source,const char *dest)
     return 0;
 }
 
+/* Copies the file through user space buffer and feeds the hasher with the same data,
+   so the copy is verified without a second read pass. */
+int FileCopier::copy_verify(const char *source,const char *dest,struct cItem *item)
+{
+    int hashmode;
+    size_t n;
+    FILE *src=NULL,*dst=NULL;
+    unsigned char *buff;
+    double copied=0;
+    char hexhash[80];
+
+    if(uc->verbose > 1)
+    {
+        printf("Copy %s (verify) ...\n",source);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+
+    if(PathMaker::mkpath(dest,true))
+        return 1;
+
+    if((src=fopen(source,"rb")) == NULL)
+        return 1;
+
+    if((dst=fopen(dest,"wb")) == NULL)
+    {
+        fclose(src);
+        return 1;
+    }
+
+    bool sparse = false;
+#ifndef _WIN32
+    struct stat src_st;
+    sparse = (fstat(fileno(src),&src_st) == 0 && issparse(&src_st));
+#endif
+    hashmode = item->htype != HASH_EMPTY ? item->htype : uc->hashmode;
+    Hasher hasher(hashmode);
+    buff = new unsigned char[COPY_BUFFSIZE];
+    do
+    {
+        Throttle::consume(THROTTLE_READ,COPY_BUFFSIZE);
+        n = fread(buff,1,COPY_BUFFSIZE,src);
+        if(n > 0)
+        {
+            hasher.update(buff,n);
+            Throttle::consume(THROTTLE_WRITE,n);
+#ifdef _WIN32
+            if(fwrite(buff,1,n,dst) != n)
+#else
+            if(write_sparse(buff,n,dst,sparse) != n)
+#endif
+            {
+                fprintf(stderr,"Error, Copy: cannot write target file: %s (%d)\n",dest,errno);
+                if(uc->guicall)
+                    fflush(stderr);
+                delete[] buff;
+                fclose(src);
+                fclose(dst);
+                return 1;
+            }
+            copied += n;
+        }
+    }
+    while (n > 0);
+    delete[] buff;
+    fclose(src);
+#ifdef _WIN32
+    if(fclose(dst) != 0)
+#else
+    if(finish_sparse(dst,copied,sparse) | fclose(dst))
+#endif
+    {
+        fprintf(stderr,"Error, Copy: cannot write target file: %s (%d)\n",dest,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+
+    hasher.final(hexhash,0);
+    if(item->htype != HASH_EMPTY && strcmp(hexhash,item->hash))
+    {
+        fprintf(stderr,"Error, Verify: the copied data of %s does not match to the scanned hash!\n",source);
+        if(uc->guicall)
+            fflush(stderr);
+        //The bad copy is not left under the target name
+        unlink(dest);
+        return 1;
+    }
+    item->htype = hashmode;
+    strcpy(item->hash,hexhash);
+
+    struct stat s_st;
+    struct utimbuf d_mt;
+    if(stat(source,&s_st))
+    {
+        fprintf(stderr,"Error, Copy: cannot get times of source file: %s (%d)\n",source,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+    d_mt.actime = s_st.st_atime;
+    d_mt.modtime = s_st.st_mtime;
+    if(utime(dest,&d_mt) != 0)
+    {
+        fprintf(stderr,"Error, Copy: cannot set times of target file: %s (%d)\n",dest,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+    if(chmod(dest,s_st.st_mode) != 0)
+    {
+        fprintf(stderr,"Error, Copy: cannot set mode of target file: %s (%d)\n",dest,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+
+    ckbytes += copied / 1024;
+    return 0;
+}
+
 #ifdef _WIN32
 int FileCopier::copy_spec(const char *source,const char *dest)
 {
@@ -326,8 +760,7 @@ int FileCopier::copy_spec(const char *source,const char *dest)
 int FileCopier::copy_spec(const char *source,const char *dest)
 {
     int srcfd,dstfd;
-    unsigned int copied=0;
-    off_t offset = 0;
+    long long copied=0;
     double size;
     struct stat s_st;
     struct utimbuf d_mt;
@@ -353,17 +786,23 @@ int FileCopier::copy_spec(const char *source,const char *dest)
     if((srcfd=open(source,O_RDONLY)) == -1)
         return 1;
 
-    if((dstfd=open(dest,O_WRONLY | O_CREAT,S_IRUSR | S_IWUSR)) == -1)
+    //The plain copies of the big files are checkpointed (-journal), the -direct and -splitcopy copies are made in one go
+    if(uc->journal != NULL && (unsigned long long)s_st.st_size > JOURNAL_CHECKPOINT && !issparse(&s_st) &&
+       !uc->directio && !(uc->splitsize > 0 && (unsigned long long)s_st.st_size >= uc->splitsize))
+        copied = copy_checkpointed(srcfd,&s_st,dest,&dstfd);
+    else
+        copied = copy_into(srcfd,&s_st,AT_FDCWD,dest,&dstfd);
+    close(srcfd);
+    if(dstfd == -1)
+        return 1;
+    if(close(dstfd) != 0 || copied < 0)
     {
-        close(srcfd);
+        fprintf(stderr,"Error, Copy: cannot copy the file: %s (%d)\n",source,errno);
+        if(uc->guicall)
+            fflush(stderr);
         return 1;
     }
 
-    copied = sendfile(dstfd,srcfd,&offset,s_st.st_size);
-
-    close(srcfd);
-    close(dstfd);
-
     d_mt.actime = s_st.st_atime;
     d_mt.modtime = s_st.st_mtime;
     if(utime(dest,&d_mt) != 0)
@@ -385,26 +824,723 @@ int FileCopier::copy_spec(const char *source,const char *dest)
     ckbytes += size;
     return 0;
 }
-#endif
 
-int FileCopier::fixtime(const char *source,const char *dest)
+/* Creates the target dstname in the folder dstdirfd (AT_FDCWD: dstname is a path) and copies the data of srcfd
+   (described by s_st) into it. The target is left open in dstfd (-1 if it cannot be created).
+   Returns the number of bytes copied or -1 on error */
+long long FileCopier::copy_into(int srcfd,const struct stat *s_st,int dstdirfd,const char *dstname,int *dstfd)
+{
+    long long copied;
+
+    //O_DIRECT is not supported by every filesystem, the normal open is used then
+    bool direct = false;
+    if(uc->directio && s_st->st_size >= DIRECTIO_MINSIZE && !issparse(s_st))
+    {
+        *dstfd = openat(dstdirfd,dstname,O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT,S_IRUSR | S_IWUSR);
+        direct = (*dstfd != -1);
+    }
+    if(!direct && (*dstfd = openat(dstdirfd,dstname,O_WRONLY | O_CREAT | O_TRUNC,S_IRUSR | S_IWUSR)) == -1)
+        return -1;
+
+    if(direct)
+        copied = copy_data_direct(srcfd,*dstfd,s_st->st_size);
+    else if(issparse(s_st))
+        copied = copy_data_sparse(srcfd,*dstfd,s_st->st_size);
+    else if(uc->splitsize > 0 && (unsigned long long)s_st->st_size >= uc->splitsize)
+        copied = copy_data_split(srcfd,*dstfd,s_st->st_size);
+    else
+        copied = copy_data(srcfd,*dstfd,s_st->st_size);
+    //A short copy (the source became shorter or the copy stopped early) is not a complete target
+    if(copied >= 0 && copied < s_st->st_size && !issparse(s_st))
+    {
+        errno = EIO;
+        copied = -1;
+    }
+    return copied;
+}
+
+/* Copies the file name from the folder srcdirfd to the folder dstdirfd without resolving the full paths
+   (subtree copy). sourcedir is the path of the source folder for the messages. */
+int FileCopier::copy_at(int srcdirfd,int dstdirfd,const char *name,const char *sourcedir)
 {
+    int srcfd,dstfd;
+    long long copied;
     struct stat s_st;
-    struct utimbuf d_mt;
+    struct timespec times[2];
+
     if(uc->verbose > 1)
     {
-        printf("Fixing times of %s ...\n",dest);
+        printf("Copy %s/%s ..\n",sourcedir,name);
         if(uc->guicall)
             fflush(stdout);
     }
-    if(!stat(source,&s_st))
+
+    Throttle::consume(THROTTLE_META,1);
+    if((srcfd = openat(srcdirfd,name,O_RDONLY)) == -1 || fstat(srcfd,&s_st) != 0)
     {
-        d_mt.actime = s_st.st_atime;
-        d_mt.modtime = s_st.st_mtime;
-        if(utime(dest,&d_mt) != 0)
-        {
-            fprintf(stderr,"Error, Fixtime: cannot set times of target file: %s\n",dest);
-            if(uc->guicall)
+        fprintf(stderr,"Error, Copy: cannot open the source file: %s/%s (%d)\n",sourcedir,name,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        if(srcfd != -1)
+            close(srcfd);
+        return 1;
+    }
+
+    copied = copy_into(srcfd,&s_st,dstdirfd,name,&dstfd);
+    close(srcfd);
+    if(dstfd == -1)
+    {
+        fprintf(stderr,"Error, Copy: cannot create the target of: %s/%s (%d)\n",sourcedir,name,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+
+    times[0].tv_sec = s_st.st_atime;
+    times[1].tv_sec = s_st.st_mtime;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    if(copied >= 0 && (futimens(dstfd,times) != 0 || fchmod(dstfd,s_st.st_mode) != 0))
+    {
+        fprintf(stderr,"Error, Copy: cannot set times/mode of the target of: %s/%s (%d)\n",sourcedir,name,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        close(dstfd);
+        return 1;
+    }
+    if(close(dstfd) != 0 || copied < 0)
+    {
+        fprintf(stderr,"Error, Copy: cannot copy the file: %s/%s (%d)\n",sourcedir,name,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+
+    ckbytes += ((double)copied) / 1024;
+    return 0;
+}
+
+/* Copies the source to several targets (multi-destination sync): every block is read once and written
+   to all targets, the kernel writes them back to the target devices in parallel.
+   The holes of the sparse files are kept. */
+int FileCopier::copy_fanout(const char *source,const char * const *dests,int count)
+{
+    int srcfd,i;
+    int dstfds[PLAN_MAXTARGETS];
+    struct stat s_st;
+    struct timespec times[2];
+    ssize_t n;
+    unsigned long long done = 0;
+    int r = 0;
+
+    static_assert(sizeof(dstfds) / sizeof(dstfds[0]) >= PLAN_MAXTARGETS,"The fanout copy needs a descriptor for every target of the plan");
+    if(count > PLAN_MAXTARGETS)
+        return 1;
+    if(uc->verbose > 1)
+    {
+        printf("Copy %s (to %d destinations) ..\n",source,count);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+
+    Throttle::consume(THROTTLE_META,count);
+    if((srcfd = open(source,O_RDONLY)) == -1 || fstat(srcfd,&s_st) != 0)
+    {
+        fprintf(stderr,"Error, Copy: cannot open the source file: %s (%d)\n",source,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        if(srcfd != -1)
+            close(srcfd);
+        return 1;
+    }
+    bool sparse = issparse(&s_st);
+    for(i = 0 ; i < count ; ++i)
+    {
+        if(PathMaker::mkpath(dests[i],true) || unshare(dests[i]) ||
+           (dstfds[i] = open(dests[i],O_WRONLY | O_CREAT | O_TRUNC,S_IRUSR | S_IWUSR)) == -1)
+        {
+            fprintf(stderr,"Error, Copy: cannot create the target file: %s (%d)\n",dests[i],errno);
+            if(uc->guicall)
+                fflush(stderr);
+            while(--i >= 0)
+                close(dstfds[i]);
+            close(srcfd);
+            return 1;
+        }
+        if(!sparse && s_st.st_size >= PREALLOC_MINSIZE && fallocate(dstfds[i],0,0,s_st.st_size) != 0 && uc->verbose > 2)
+            printf("Cannot preallocate the target file (%d)\n",errno);
+    }
+
+    unsigned char *buff = new unsigned char[FANOUT_BUFFSIZE];
+    while(true)
+    {
+        Throttle::consume(THROTTLE_READ,FANOUT_BUFFSIZE);
+        n = pread(srcfd,buff,FANOUT_BUFFSIZE,done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        if(!sparse || !iszero(buff,n))
+            for(i = 0 ; i < count && !r ; ++i)
+            {
+                Throttle::consume(THROTTLE_WRITE,n);
+                if(pwrite(dstfds[i],buff,n,done) != n)
+                    r = 1;
+            }
+        if(r)
+            break;
+        done += n;
+    }
+    delete[] buff;
+    close(srcfd);
+    if(n < 0)
+        r = 1;
+
+    times[0].tv_sec = s_st.st_atime;
+    times[1].tv_sec = s_st.st_mtime;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    for(i = 0 ; i < count ; ++i)
+    {
+        //The size of a sparse file ending with hole, or of a preallocated target of a shrunk source
+        if(!r && (ftruncate(dstfds[i],done) != 0 || futimens(dstfds[i],times) != 0 || fchmod(dstfds[i],s_st.st_mode) != 0))
+            r = 1;
+        if(close(dstfds[i]) != 0)
+            r = 1;
+    }
+    if(r)
+    {
+        fprintf(stderr,"Error, Copy: cannot copy the file: %s (%d)\n",source,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+    ckbytes += ((double)done * count) / 1024;
+    return 0;
+}
+
+int FileCopier::getCopyMethod(unsigned long long sdev,unsigned long long ddev)
+{
+    std::lock_guard<std::mutex> lock(copymethod_mutex);
+    struct CopyMethodCacheItem *r=methodcache;
+    while(r != NULL)
+    {
+        if(r->sdev == sdev && r->ddev == ddev)
+            return r->method;
+        r = r->n;
+    }
+    return COPYMETHOD_UNKNOWN;
+}
+
+void FileCopier::setCopyMethod(unsigned long long sdev,unsigned long long ddev,int method)
+{
+    std::lock_guard<std::mutex> lock(copymethod_mutex);
+    struct CopyMethodCacheItem *r=methodcache;
+    while(r != NULL)
+    {
+        if(r->sdev == sdev && r->ddev == ddev)
+        {
+            r->method = method;
+            return;
+        }
+        r = r->n;
+    }
+    r = new CopyMethodCacheItem();
+    r->sdev = sdev;
+    r->ddev = ddev;
+    r->method = method;
+    r->n = methodcache;
+    methodcache = r;
+}
+
+/* The FICLONE error means that the filesystems cannot reflink at all */
+static bool noreflink(int err)
+{
+    return err == EXDEV || err == EOPNOTSUPP || err == ENOTTY;
+}
+
+/* Copies the file data from srcfd to dstfd with the fastest method which works between the two filesystems:
+   reflink (FICLONE), copy_file_range, sendfile and finally read/write.
+   The working method is cached for every source-target filesystem pair.
+   Returns the number of bytes copied or -1 on error */
+long long FileCopier::copy_data(int srcfd,int dstfd,unsigned long long size)
+{
+    struct stat s_st,d_st;
+    int method;
+    ssize_t n;
+    off_t soff,doff;
+    unsigned long long done;
+
+    //An empty file tells nothing about the methods
+    if(size == 0)
+        return 0;
+    if(fstat(srcfd,&s_st) != 0 || fstat(dstfd,&d_st) != 0)
+        return -1;
+    method = getCopyMethod(s_st.st_dev,d_st.st_dev);
+    bool detect = (method == COPYMETHOD_UNKNOWN);
+    bool remember = true;
+
+    if(method == COPYMETHOD_UNKNOWN || method == COPYMETHOD_CLONE)
+    {
+        if(ioctl(dstfd,FICLONE,srcfd) == 0)
+        {
+            if(detect && uc->verbose > 2)
+                printf("Copy method between devices %llu -> %llu: reflink\n",
+                        (unsigned long long)s_st.st_dev,(unsigned long long)d_st.st_dev);
+            setCopyMethod(s_st.st_dev,d_st.st_dev,COPYMETHOD_CLONE);
+            return size;
+        }
+        //Only the filesystems without reflink are remembered, an other error (like a nodatacow file) is about this file
+        remember = noreflink(errno);
+        method = COPYMETHOD_RANGE;
+    }
+
+    //Allocate the big files in one piece to avoid fragmentation (a shorter copy is an error in copy_into)
+    if(size >= PREALLOC_MINSIZE && fallocate(dstfd,0,0,size) != 0 && uc->verbose > 2)
+        printf("Cannot preallocate the target file (%d)\n",errno);
+
+    if(method == COPYMETHOD_RANGE)
+    {
+        soff = doff = 0;
+        done = 0;
+        while(done < size)
+        {
+            Throttle::consume(THROTTLE_READ,Throttle::chunk(size - done));
+            Throttle::consume(THROTTLE_WRITE,Throttle::chunk(size - done));
+            n = copy_file_range(srcfd,&soff,dstfd,&doff,Throttle::chunk(size - done),0);
+            if(n == 0)
+                break;
+            if(n < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                if(done == 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+                    break;
+                return -1;
+            }
+            done += n;
+        }
+        if(done > 0)
+        {
+            if(remember)
+                setCopyMethod(s_st.st_dev,d_st.st_dev,COPYMETHOD_RANGE);
+            if(detect && uc->verbose > 2)
+                printf("Copy method between devices %llu -> %llu: copy_file_range\n",
+                        (unsigned long long)s_st.st_dev,(unsigned long long)d_st.st_dev);
+            return done;
+        }
+        method = COPYMETHOD_SENDFILE;
+    }
+
+    if(method == COPYMETHOD_SENDFILE)
+    {
+        soff = 0;
+        done = 0;
+        while(done < size)
+        {
+            Throttle::consume(THROTTLE_READ,Throttle::chunk(size - done));
+            Throttle::consume(THROTTLE_WRITE,Throttle::chunk(size - done));
+            n = sendfile(dstfd,srcfd,&soff,Throttle::chunk(size - done));
+            if(n == 0)
+                break;
+            if(n < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                if(done == 0 && (errno == EINVAL || errno == ENOSYS))
+                    break;
+                return -1;
+            }
+            done += n;
+        }
+        if(done > 0)
+        {
+            if(remember)
+                setCopyMethod(s_st.st_dev,d_st.st_dev,COPYMETHOD_SENDFILE);
+            if(detect && uc->verbose > 2)
+                printf("Copy method between devices %llu -> %llu: sendfile\n",
+                        (unsigned long long)s_st.st_dev,(unsigned long long)d_st.st_dev);
+            return done;
+        }
+        method = COPYMETHOD_READWRITE;
+    }
+
+    if(remember)
+        setCopyMethod(s_st.st_dev,d_st.st_dev,COPYMETHOD_READWRITE);
+    unsigned char *buff = new unsigned char[COPY_BUFFSIZE];
+    done = 0;
+    while(true)
+    {
+        Throttle::consume(THROTTLE_READ,COPY_BUFFSIZE);
+        n = pread(srcfd,buff,COPY_BUFFSIZE,done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        Throttle::consume(THROTTLE_WRITE,n);
+        if(pwrite(dstfd,buff,n,done) != n)
+        {
+            delete[] buff;
+            return -1;
+        }
+        done += n;
+    }
+    delete[] buff;
+    return n < 0 ? -1 : (long long)done;
+}
+
+/* Copies the length bytes from offset to the same offset of the target.
+   Uses copy_file_range with explicit offsets if userange is set, otherwise pread/pwrite.
+   Returns the number of bytes copied or -1 on error. (0 means copy_file_range is not usable) */
+static long long copy_range(int srcfd,int dstfd,unsigned long long offset,unsigned long long length,bool userange)
+{
+    ssize_t n = 0;
+    unsigned long long done = 0;
+
+    if(userange)
+    {
+        off_t soff = offset,doff = offset;
+        while(done < length)
+        {
+            Throttle::consume(THROTTLE_READ,Throttle::chunk(length - done));
+            Throttle::consume(THROTTLE_WRITE,Throttle::chunk(length - done));
+            n = copy_file_range(srcfd,&soff,dstfd,&doff,Throttle::chunk(length - done),0);
+            if(n == 0)
+                break;
+            if(n < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                if(done == 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+                    return 0;
+                return -1;
+            }
+            done += n;
+        }
+        return done;
+    }
+
+    unsigned char *buff = new unsigned char[COPY_BUFFSIZE];
+    while(done < length)
+    {
+        size_t want = length - done < COPY_BUFFSIZE ? length - done : COPY_BUFFSIZE;
+        Throttle::consume(THROTTLE_READ,want);
+        n = pread(srcfd,buff,want,offset + done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        Throttle::consume(THROTTLE_WRITE,n);
+        if(pwrite(dstfd,buff,n,offset + done) != n)
+        {
+            delete[] buff;
+            return -1;
+        }
+        done += n;
+    }
+    delete[] buff;
+    return n < 0 ? -1 : (long long)done;
+}
+
+static bool same_data(int fd1,int fd2,unsigned long long offset,size_t length)
+{
+    unsigned char *b1 = new unsigned char[length];
+    unsigned char *b2 = new unsigned char[length];
+    bool same = (pread(fd1,b1,length,offset) == (ssize_t)length && pread(fd2,b2,length,offset) == (ssize_t)length &&
+                 !memcmp(b1,b2,length));
+    delete[] b1;
+    delete[] b2;
+    return same;
+}
+
+/* Copies a big file in JOURNAL_CHECKPOINT sized pieces (-journal): the end of every piece is synced and
+   recorded to the journal. The reflink is tried first (on a new copy), it is made at once. The copy of an interrupted run is continued from its last recorded offset
+   if the source is the same and the block before the offset matches.
+   Returns the number of bytes copied or -1 on error */
+long long FileCopier::copy_checkpointed(int srcfd,const struct stat *s_st,const char *dest,int *dstfd)
+{
+    unsigned long long size = s_st->st_size,offset,start,piece;
+    long long n;
+    bool userange = true;
+    struct stat d_st;
+
+    *dstfd = -1;
+    offset = uc->journal->resumeoffset(dest,s_st);
+    if(offset >= JOURNAL_VERIFY_BLOCK)
+    {
+        if((*dstfd = open(dest,O_RDWR)) != -1 && fstat(*dstfd,&d_st) == 0 && (unsigned long long)d_st.st_size >= offset &&
+           same_data(srcfd,*dstfd,offset - JOURNAL_VERIFY_BLOCK,JOURNAL_VERIFY_BLOCK))
+        {
+            if(uc->verbose > 0)
+            {
+                printf("Continue the copy of %s from %llu bytes\n",dest,offset);
+                if(uc->guicall)
+                    fflush(stdout);
+            }
+        }
+        else
+        {
+            if(*dstfd != -1)
+                close(*dstfd);
+            *dstfd = -1;
+        }
+    }
+    if(*dstfd == -1)
+    {
+        offset = 0;
+        if((*dstfd = open(dest,O_WRONLY | O_CREAT | O_TRUNC,S_IRUSR | S_IWUSR)) == -1)
+            return -1;
+        //A reflink needs no checkpoints
+        int method = (fstat(*dstfd,&d_st) == 0 ? getCopyMethod(s_st->st_dev,d_st.st_dev) : COPYMETHOD_RANGE);
+        if((method == COPYMETHOD_UNKNOWN || method == COPYMETHOD_CLONE) && ioctl(*dstfd,FICLONE,srcfd) == 0)
+        {
+            setCopyMethod(s_st->st_dev,d_st.st_dev,COPYMETHOD_CLONE);
+            return size;
+        }
+        if(fallocate(*dstfd,0,0,size) != 0 && uc->verbose > 2)
+            printf("Cannot preallocate the target file (%d)\n",errno);
+    }
+
+    start = offset;
+    while(offset < size)
+    {
+        piece = size - offset < JOURNAL_CHECKPOINT ? size - offset : JOURNAL_CHECKPOINT;
+        n = copy_range(srcfd,*dstfd,offset,piece,userange);
+        if(n == 0 && userange)
+        {
+            userange = false;
+            continue;
+        }
+        if(n < 0)
+            return -1;
+        offset += n;
+        if((unsigned long long)n < piece) //The source became shorter: the copy is not complete
+        {
+            errno = EIO;
+            return -1;
+        }
+        if(offset < size && fdatasync(*dstfd) == 0)
+            uc->journal->progress(dest,offset,s_st);
+    }
+    return offset - start;
+}
+
+/* Copies a big file on uc->splitjobs threads: The target is preallocated and the workers
+   copy disjoint ranges of it at explicit offsets. (Reflink is tried first, it needs no data copy)
+   Returns the number of bytes copied or -1 on error */
+long long FileCopier::copy_data_split(int srcfd,int dstfd,unsigned long long size)
+{
+    struct stat s_st,d_st;
+    int method,jobs;
+
+    if(fstat(srcfd,&s_st) != 0 || fstat(dstfd,&d_st) != 0)
+        return -1;
+    method = getCopyMethod(s_st.st_dev,d_st.st_dev);
+    if(method == COPYMETHOD_UNKNOWN || method == COPYMETHOD_CLONE)
+    {
+        if(ioctl(dstfd,FICLONE,srcfd) == 0)
+        {
+            setCopyMethod(s_st.st_dev,d_st.st_dev,COPYMETHOD_CLONE);
+            return size;
+        }
+        if(method == COPYMETHOD_CLONE)
+            setCopyMethod(s_st.st_dev,d_st.st_dev,COPYMETHOD_RANGE);
+    }
+
+    if(fallocate(dstfd,0,0,size) != 0 && ftruncate(dstfd,size) != 0)
+        return -1;
+
+    jobs = uc->splitjobs;
+    if((unsigned long long)jobs > size / SPLITCOPY_PIECE + 1)
+        jobs = size / SPLITCOPY_PIECE + 1;
+    if(uc->verbose > 2)
+    {
+        printf("Split copy: %llu bytes on %d threads\n",size,jobs);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+
+    std::atomic<unsigned long long> next(0);
+    std::atomic<unsigned long long> copied(0);
+    std::atomic<bool> failed(false);
+    std::atomic<bool> userange(method != COPYMETHOD_SENDFILE && method != COPYMETHOD_READWRITE);
+    std::thread **workers = new std::thread*[jobs];
+    for(int i = 0 ; i < jobs ; ++i)
+        workers[i] = new std::thread([&]()
+        {
+            unsigned long long offset,length;
+            long long n;
+            while(!failed && (offset = next.fetch_add(SPLITCOPY_PIECE)) < size)
+            {
+                length = size - offset < SPLITCOPY_PIECE ? size - offset : SPLITCOPY_PIECE;
+                n = copy_range(srcfd,dstfd,offset,length,userange);
+                if(n == 0 && userange)
+                {
+                    userange = false;
+                    n = copy_range(srcfd,dstfd,offset,length,false);
+                }
+                if(n < 0 || (unsigned long long)n != length) //error or the source became shorter
+                {
+                    failed = true;
+                    break;
+                }
+                copied += n;
+            }
+        });
+    for(int i = 0 ; i < jobs ; ++i)
+    {
+        workers[i]->join();
+        delete workers[i];
+    }
+    delete[] workers;
+
+    if(failed)
+        return -1;
+    if(method == COPYMETHOD_UNKNOWN)
+        setCopyMethod(s_st.st_dev,d_st.st_dev,userange ? COPYMETHOD_RANGE : COPYMETHOD_READWRITE);
+    return copied;
+}
+
+/* Writes the target with O_DIRECT (bypassing the page cache) through an aligned buffer.
+   The last partial block is padded to the alignment and the file is truncated to the exact size.
+   Returns the number of bytes copied or -1 on error */
+long long FileCopier::copy_data_direct(int srcfd,int dstfd,unsigned long long size)
+{
+    void *mem;
+    unsigned char *buff;
+    ssize_t n;
+    size_t want,got,wlen;
+    unsigned long long done = 0;
+
+    if(posix_memalign(&mem,DIRECTIO_ALIGN,DIRECTIO_BUFFSIZE) != 0)
+        return -1;
+    buff = (unsigned char *)mem;
+    if(fallocate(dstfd,0,0,size) != 0 && uc->verbose > 2)
+        printf("Cannot preallocate the target file (%d)\n",errno);
+
+    while(done < size)
+    {
+        want = size - done < DIRECTIO_BUFFSIZE ? size - done : DIRECTIO_BUFFSIZE;
+        Throttle::consume(THROTTLE_READ,want);
+        got = 0;
+        while(got < want)
+        {
+            n = pread(srcfd,buff + got,want - got,done + got);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0)
+            {
+                free(mem);
+                return -1;
+            }
+            if(n == 0)
+                break;
+            got += n;
+        }
+        if(got == 0)
+            break;
+        wlen = (got + DIRECTIO_ALIGN - 1) & ~((size_t)DIRECTIO_ALIGN - 1);
+        memset(buff + got,0,wlen - got);
+        Throttle::consume(THROTTLE_WRITE,wlen);
+        do
+            n = pwrite(dstfd,buff,wlen,done);
+        while(n < 0 && errno == EINTR);
+        if(n != (ssize_t)wlen)
+        {
+            free(mem);
+            return -1;
+        }
+        done += got;
+        if(got < want)
+            break;
+    }
+    free(mem);
+    if(ftruncate(dstfd,done) != 0)
+        return -1;
+    return done;
+}
+
+/* Copies only the data regions of a sparse file (found by SEEK_DATA/SEEK_HOLE).
+   The target is a new (truncated) file, so the skipped regions remain holes,
+   the size is set by ftruncate at the end to keep the trailing hole.
+   Returns the number of data bytes copied or -1 on error */
+long long FileCopier::copy_data_sparse(int srcfd,int dstfd,unsigned long long size)
+{
+    struct stat s_st,d_st;
+    int method;
+    off_t data,hole;
+    long long n;
+    unsigned long long pos = 0,copied = 0;
+
+    if(fstat(srcfd,&s_st) != 0 || fstat(dstfd,&d_st) != 0)
+        return -1;
+    method = getCopyMethod(s_st.st_dev,d_st.st_dev);
+    if(method == COPYMETHOD_UNKNOWN || method == COPYMETHOD_CLONE)
+    {
+        if(ioctl(dstfd,FICLONE,srcfd) == 0)
+        {
+            setCopyMethod(s_st.st_dev,d_st.st_dev,COPYMETHOD_CLONE);
+            return size;
+        }
+    }
+    bool userange = (method != COPYMETHOD_SENDFILE && method != COPYMETHOD_READWRITE);
+
+    while(pos < size)
+    {
+        data = lseek(srcfd,pos,SEEK_DATA);
+        if(data < 0)
+        {
+            if(errno == ENXIO) //only hole till the end
+                break;
+            return -1;
+        }
+        if((unsigned long long)data >= size)
+            break;
+        hole = lseek(srcfd,data,SEEK_HOLE);
+        if(hole < 0)
+            return -1;
+        if((unsigned long long)hole > size)
+            hole = size;
+        n = copy_range(srcfd,dstfd,data,hole - data,userange);
+        if(n == 0 && userange)
+        {
+            userange = false;
+            n = copy_range(srcfd,dstfd,data,hole - data,false);
+        }
+        if(n != hole - data)
+            return -1;
+        copied += n;
+        pos = hole;
+    }
+    if(ftruncate(dstfd,size) != 0)
+        return -1;
+    if(uc->verbose > 2)
+    {
+        printf("Sparse copy: %llu data bytes of %llu\n",copied,size);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    return copied;
+}
+#endif
+
+int FileCopier::fixtime(const char *source,const char *dest)
+{
+    struct stat s_st;
+    struct utimbuf d_mt;
+    if(uc->verbose > 1)
+    {
+        printf("Fixing times of %s ...\n",dest);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    Throttle::consume(THROTTLE_META,1);
+    if(!stat(source,&s_st))
+    {
+        d_mt.actime = s_st.st_atime;
+        d_mt.modtime = s_st.st_mtime;
+        if(utime(dest,&d_mt) != 0)
+        {
+            fprintf(stderr,"Error, Fixtime: cannot set times of target file: %s\n",dest);
+            if(uc->guicall)
                 fflush(stderr);
             return 1;
         }
@@ -433,6 +1569,11 @@ void FileCopier::resetCounters(void)
     te = 0;
 }
 
+void FileCopier::addCounters(FileCopier *other)
+{
+    ckbytes += other->ckbytes;
+}
+
 void FileCopier::printStatistics()
 {
     if(uc->verbose > 0)
@@ -464,7 +1605,14 @@ int FileCopier::deletefile(const char *path)
         if(uc->guicall)
             fflush(stdout);
     }
-    return unlink(path);
+    if(journaled(JOURNAL_DELETE,path))
+        return 0;
+    Throttle::consume(THROTTLE_META,1);
+    int r = unlink(path);
+    //With the journal the delete can be repeated (its record can be lost by a crash)
+    if(r != 0 && errno == ENOENT && uc->journal != NULL)
+        r = 0;
+    return record(JOURNAL_DELETE,path,r);
 }
 
 int FileCopier::deletefolder(const char *path)
@@ -475,13 +1623,273 @@ int FileCopier::deletefolder(const char *path)
         if(uc->guicall)
             fflush(stdout);
     }
-    return rmdir(path);
+    if(journaled(JOURNAL_RMDIR,path))
+        return 0;
+    Throttle::consume(THROTTLE_META,1);
+    int r = rmdir(path);
+    if(r != 0 && errno == ENOENT && uc->journal != NULL)
+        r = 0;
+    return record(JOURNAL_RMDIR,path,r);
 }
 
+/* Renames a file inside the target tree (move detection). Does not overwrite existing files. */
+int FileCopier::movefile(const char *from,const char *to)
+{
+    if(uc->verbose > 1)
+    {
+        printf("Move %s -> %s\n",from,to);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    if(journaled(JOURNAL_MOVE,to))
+        return 0;
+    Throttle::consume(THROTTLE_META,1);
+#ifdef _WIN32
+    return record(JOURNAL_MOVE,to,MoveFileExA(from,to,0) == 0 ? 1 : 0);
+#else
+    struct stat st;
+    //Moved by the interrupted run, but the record is lost
+    if(uc->journal != NULL && lstat(from,&st) != 0 && lstat(to,&st) == 0)
+        return 0;
+    if(lstat(to,&st) == 0)
+        return 1;
+    return record(JOURNAL_MOVE,to,rename(from,to) == 0 ? 0 : 1);
+#endif
+}
+
+/* Creates dest as a hardlink of existing (replaces dest). Copies the file if the link cannot be made. */
+int FileCopier::linkfile(const char *existing,const char *dest)
+{
+    if(uc->verbose > 1)
+    {
+        printf("Link %s -> %s\n",dest,existing);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    if(journaled(JOURNAL_LINK,dest))
+        return 0;
+    Throttle::consume(THROTTLE_META,2);
+#ifdef _WIN32
+    DeleteFileA(dest);
+    if(CreateHardLinkA(dest,existing,NULL) != 0)
+        return record(JOURNAL_LINK,dest,0);
+#else
+    unlink(dest);
+    if(link(existing,dest) == 0)
+        return record(JOURNAL_LINK,dest,0);
+#endif
+    if(uc->verbose > 0)
+    {
+        printf("Cannot link %s, copy instead\n",dest);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    return copy(existing,dest);
+}
+
+/* Dedup: creates dest with the content of existing (a file already written to the target) by reflink or
+   by hardlink (uc->dedup). The times and the mode of the reflinked file are set from source.
+   Falls back to the normal copy of source. */
+int FileCopier::clonefile(const char *existing,const char *dest,const char *source,struct cItem *item)
+{
+    if(uc->dedup == DEDUP_HARDLINK)
+        return linkfile(existing,dest);
+#ifdef __linux__
+    char tmp[512];
+    const char *target = dest;
+    struct stat st;
+    int srcfd,dstfd,method;
+    bool cloned = false;
+
+    if(uc->verbose > 1)
+    {
+        printf("Reflink %s -> %s\n",dest,existing);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+    if(uc->atomiccopy && tempname(dest,tmp) == 0)
+        target = tmp;
+    Throttle::consume(THROTTLE_META,2);
+    unlink(target);
+    //The filesystems without reflink are remembered by the copy method cache
+    if((srcfd = open(existing,O_RDONLY)) >= 0)
+    {
+        method = (fstat(srcfd,&st) == 0 ? getCopyMethod(st.st_dev,st.st_dev) : COPYMETHOD_UNKNOWN);
+        if((method == COPYMETHOD_UNKNOWN || method == COPYMETHOD_CLONE) &&
+           (dstfd = open(target,O_WRONLY | O_CREAT | O_EXCL,0600)) >= 0)
+        {
+            cloned = (ioctl(dstfd,FICLONE,srcfd) == 0);
+            if(method == COPYMETHOD_UNKNOWN && (cloned || noreflink(errno)))
+                setCopyMethod(st.st_dev,st.st_dev,cloned ? COPYMETHOD_CLONE : COPYMETHOD_RANGE);
+            close(dstfd);
+            if(!cloned)
+                unlink(target);
+        }
+        close(srcfd);
+    }
+    if(cloned)
+    {
+        if(fixtime(source,target))
+            return 1;
+        if(target != dest)
+            return commit_file(target,dest);
+        return 0;
+    }
+    if(uc->verbose > 1)
+    {
+        printf("Cannot reflink %s, copy instead\n",dest);
+        if(uc->guicall)
+            fflush(stdout);
+    }
+#else
+    (void)existing;
+#endif
+    return copy(source,dest,item);
+}
+
+/* Removes the file if it has other hardlinks (-hardlinks, -dedup=hardlink, or made by others),
+   so the copy written in place does not change the other names. Not journaled, it can be repeated. */
+int FileCopier::unshare(const char *path)
+{
+#ifndef _WIN32
+    struct stat st;
+    if(lstat(path,&st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1 && unlink(path) != 0 && errno != ENOENT)
+    {
+        fprintf(stderr,"Error, cannot unlink the hardlinked target: %s (%d)\n",path,errno);
+        if(uc->guicall)
+            fflush(stderr);
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+Hasher::Hasher(int hashmode)
+{
+    mode = hashmode;
+    ctx = NULL;
+    if(mode == HASH_SHA256)
+    {
+        ctx = new SHA256_CTX;
+        sha256_init((SHA256_CTX *)ctx);
+    }
+    if(mode == HASH_MD5)
+    {
+        ctx = new MD5_CTX;
+        MD5_Init((MD5_CTX *)ctx);
+    }
+}
+
+Hasher::~Hasher(void)
+{
+    if(mode == HASH_SHA256)
+        delete (SHA256_CTX *)ctx;
+    if(mode == HASH_MD5)
+        delete (MD5_CTX *)ctx;
+}
+
+void Hasher::update(const unsigned char *data,unsigned int len)
+{
+    if(mode == HASH_SHA256)
+        sha256_update((SHA256_CTX *)ctx,(uchar *)data,len);
+    if(mode == HASH_MD5)
+        MD5_Update((MD5_CTX *)ctx,(void *)data,len);
+}
+
+/* Feeds len zero bytes (the holes of the sparse files) without reading them */
+void Hasher::update_zeros(unsigned long long len)
+{
+    static const unsigned char zeros[8192] = {0};
+    while(len > 0)
+    {
+        unsigned int n = len < sizeof(zeros) ? len : sizeof(zeros);
+        update(zeros,n);
+        len -= n;
+    }
+}
+
+void Hasher::final(char *hexhash,int needprefix)
+{
+    unsigned char hash[32];
+    int hlen=0,idx=0;
+
+    if(mode == HASH_SHA256)
+    {
+        sha256_final((SHA256_CTX *)ctx,hash);
+        hlen = 32;
+        if(needprefix)
+        {
+            idx=5;
+            memcpy(hexhash,"SHA2:",5);
+        }
+    }
+    if(mode == HASH_MD5)
+    {
+        MD5_Final(hash,(MD5_CTX *)ctx);
+        hlen = 16;
+        if(needprefix)
+        {
+            idx=4;
+            memcpy(hexhash,"MD5:",4);
+        }
+    }
+    for (int i=0; i < hlen; i++)
+    {
+        hexhash[idx++] = dtoh((hash[i] & 240) >> 4);
+        hexhash[idx++] = dtoh(hash[i] & 15);
+    }
+    hexhash[idx] = '\0';
+}
+
+#ifndef _WIN32
+/* Hashes the file by its data regions, the holes are hashed as zero runs without reading */
+static int hash_sparse(int fd,unsigned long long size,Hasher *hasher,unsigned char *buff,size_t buffsize)
+{
+    off_t data,hole;
+    ssize_t n;
+    unsigned long long pos = 0;
+
+    while(pos < size)
+    {
+        data = lseek(fd,pos,SEEK_DATA);
+        if(data < 0)
+        {
+            if(errno != ENXIO)
+                return 1;
+            data = size; //only hole till the end
+        }
+        hasher->update_zeros(data - pos);
+        pos = data;
+        if(pos >= size)
+            break;
+        hole = lseek(fd,pos,SEEK_HOLE);
+        if(hole < 0)
+            return 1;
+        if((unsigned long long)hole > size)
+            hole = size;
+        while(pos < (unsigned long long)hole)
+        {
+            Throttle::consume(THROTTLE_READ,buffsize);
+            n = pread(fd,buff,(unsigned long long)hole - pos < buffsize ? hole - pos : buffsize,pos);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+                return 1;
+            hasher->update(buff,n);
+            pos += n;
+        }
+    }
+    return 0;
+}
+
+int issparse(const struct stat *st)
+{
+    return st->st_size > 0 && ((unsigned long long)st->st_blocks) * 512 < (unsigned long long)st->st_size;
+}
+#endif
+
 int gethash(const char *fullpath,char *hexhash,int hashmode,int needprefix)
 {
-    SHA256_CTX shactx;
-    MD5_CTX md5ctx;
     FILE *f;
 
     if(hashmode == HASH_EMPTY)
@@ -490,67 +1898,350 @@ int gethash(const char *fullpath,char *hexhash,int hashmode,int needprefix)
         return 0;
     }
 
-    unsigned char hash[32];
     unsigned char buff[8192];
 
     f = fopen(fullpath,"rb");
     if(f == NULL)
         return 1;
 
-    if(hashmode == HASH_SHA256)
-        sha256_init(&shactx);
-    if(hashmode == HASH_MD5)
-        MD5_Init(&md5ctx);
-
+    Hasher hasher(hashmode);
+#ifndef _WIN32
+    struct stat st;
+    if(fstat(fileno(f),&st) == 0 && issparse(&st))
+    {
+        int r = hash_sparse(fileno(f),st.st_size,&hasher,buff,sizeof(buff));
+        fclose(f);
+        if(r)
+            return 1;
+        hasher.final(hexhash,needprefix);
+        return 0;
+    }
+#endif
     size_t n;
     do
     {
+        Throttle::consume(THROTTLE_READ,8192);
         n = fread(buff, 1, 8192, f);
         if(n > 0)
+            hasher.update(buff,n);
+    }
+    while (n > 0);
+    hasher.final(hexhash,needprefix);
+
+    fclose(f);
+    return 0;
+}
+
+/* Computes the full hash and the hashes of every blocksize sized block of the file in one pass.
+   The block hashes are allocated to *blockhashes as BLOCKHASH_WIDTH wide strings (caller frees). */
+int getblockhashes(const char *fullpath,char *hexhash,int hashmode,unsigned int blocksize,
+                   char **blockhashes,unsigned int *blockcount,int needprefix)
+{
+    FILE *f;
+    struct stat st;
+    unsigned int count,idx;
+
+    *blockhashes = NULL;
+    *blockcount = 0;
+    hexhash[0] = '\0';
+    if(hashmode == HASH_EMPTY || blocksize == 0)
+        return 0;
+
+    f = fopen(fullpath,"rb");
+    if(f == NULL)
+        return 1;
+    if(fstat(fileno(f),&st) != 0)
+    {
+        fclose(f);
+        return 1;
+    }
+
+    count = (unsigned int)((st.st_size + blocksize - 1) / blocksize);
+    char *blocks = new char[(count > 0 ? count : 1) * BLOCKHASH_WIDTH];
+    unsigned char *buff = new unsigned char[COPY_BUFFSIZE];
+
+    Hasher hasher(hashmode);
+    Hasher *bhasher = NULL;
+    unsigned int inblock = 0;
+    size_t n,pos,part;
+    idx = 0;
+    do
+    {
+        Throttle::consume(THROTTLE_READ,COPY_BUFFSIZE);
+        n = fread(buff,1,COPY_BUFFSIZE,f);
+        if(n > 0)
+            hasher.update(buff,n);
+        pos = 0;
+        while(pos < n)
         {
-            if(hashmode == HASH_SHA256)
-                sha256_update(&shactx,buff,n);
-            if(hashmode == HASH_MD5)
-                MD5_Update(&md5ctx,buff,n);
+            if(bhasher == NULL)
+            {
+                bhasher = new Hasher(hashmode);
+                inblock = 0;
+            }
+            part = n - pos;
+            if(part > blocksize - inblock)
+                part = blocksize - inblock;
+            bhasher->update(buff + pos,part);
+            inblock += part;
+            pos += part;
+            if(inblock == blocksize && idx < count)
+            {
+                bhasher->final(blocks + idx * BLOCKHASH_WIDTH,0);
+                delete bhasher;
+                bhasher = NULL;
+                ++idx;
+            }
         }
     }
     while (n > 0);
+    if(bhasher != NULL)
+    {
+        if(idx < count)
+            bhasher->final(blocks + (idx++) * BLOCKHASH_WIDTH,0);
+        delete bhasher;
+    }
+    hasher.final(hexhash,needprefix);
+
+    delete[] buff;
+    fclose(f);
+    *blockhashes = blocks;
+    *blockcount = idx;
+    return 0;
+}
+
+/* ************************************************************************************** */
+static unsigned long long geartable[256];
+static bool geartable_ready = false;
 
-    if(hashmode == HASH_SHA256)
+static void init_geartable(void)
+{
+    //Deterministic (splitmix64) so the chunk boundaries are the same on every machine
+    unsigned long long x = 0x756e6973796e63ULL;
+    for(int i = 0 ; i < 256 ; ++i)
     {
-        sha256_final(&shactx,hash);
+        unsigned long long z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        geartable[i] = z ^ (z >> 31);
+    }
+    geartable_ready = true;
+}
 
-        int idx=0;
-        if(needprefix)
+/* Splits the file to content defined chunks and calls the callback with every chunk.
+   A boundary is placed where the gear hash masked by the average size is zero,
+   but the chunks are never shorter than minsize (except the last) or longer than maxsize. */
+int chunkfile(const char *fullpath,unsigned int minsize,unsigned int avgsize,unsigned int maxsize,
+              ChunkCallback callback,void *param)
+{
+    FILE *f;
+    unsigned long long mask,h;
+    unsigned long long offset = 0;
+    unsigned int filled = 0,i,bits = 0;
+    size_t n;
+    struct ChunkInfo ci;
+
+    if(!geartable_ready)
+        init_geartable();
+    while((1U << (bits+1)) <= avgsize)
+        ++bits;
+    mask = ((1ULL << bits) - 1) << (64 - bits);
+
+    f = fopen(fullpath,"rb");
+    if(f == NULL)
+        return 1;
+
+    unsigned char *buff = new unsigned char[maxsize];
+    bool eof = false;
+    while(true)
+    {
+        if(!eof && filled < maxsize)
         {
-            idx=5;
-            memcpy(hexhash,"SHA2:",5);
+            Throttle::consume(THROTTLE_READ,maxsize - filled);
+            n = fread(buff + filled,1,maxsize - filled,f);
+            if(n == 0)
+                eof = true;
+            filled += n;
+            if(!eof && filled < maxsize)
+                continue;
+        }
+        if(filled == 0)
+            break;
+
+        unsigned int cut = filled;
+        if(filled > minsize)
+        {
+            h = 0;
+            for(i = minsize ; i < filled ; ++i)
+            {
+                h = (h << 1) + geartable[buff[i]];
+                if((h & mask) == 0)
+                {
+                    cut = i + 1;
+                    break;
+                }
+            }
         }
-        for (int i=0; i < 32; i++)
+
+        Hasher hasher(HASH_SHA256);
+        hasher.update(buff,cut);
+        hasher.final(ci.hash,0);
+        ci.offset = offset;
+        ci.length = cut;
+        if(callback(&ci,buff,param))
         {
-            hexhash[idx++] = dtoh((hash[i] & 240) >> 4);
-            hexhash[idx++] = dtoh(hash[i] & 15);
+            delete[] buff;
+            fclose(f);
+            return 1;
         }
-        hexhash[idx] = '\0';
+        offset += cut;
+        memmove(buff,buff + cut,filled - cut);
+        filled -= cut;
     }
-    if(hashmode == HASH_MD5)
-    {
-        MD5_Final(hash,&md5ctx);
 
-        int idx=0;
-        if(needprefix)
+    delete[] buff;
+    fclose(f);
+    return 0;
+}
+
+/* ************************************************************************************** */
+HashIndex::HashIndex(unsigned int buckets)
+{
+    size = buckets;
+    items = 0;
+    table = new struct HashIndexItem*[size];
+    for(unsigned int i = 0 ; i < size ; ++i)
+        table[i] = NULL;
+}
+
+HashIndex::~HashIndex(void)
+{
+    struct HashIndexItem *old,*r;
+    for(unsigned int i = 0 ; i < size ; ++i)
+    {
+        r = table[i];
+        while(r != NULL)
         {
-            idx=4;
-            memcpy(hexhash,"MD5:",5);
+            old = r;
+            r = r->n;
+            free(old->key);
+            delete old;
         }
-        for (int i=0; i < 16; i++)
+    }
+    delete[] table;
+}
+
+static unsigned int hashindex_hash(const char *key)
+{
+    unsigned int h = 2166136261U;
+    while(*key != '\0')
+    {
+        h ^= (unsigned char)*key++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+void *HashIndex::find(const char *key)
+{
+    struct HashIndexItem *r = table[hashindex_hash(key) % size];
+    while(r != NULL)
+    {
+        if(!strcmp(r->key,key))
+            return r->value;
+        r = r->n;
+    }
+    return NULL;
+}
+
+void HashIndex::add(const char *key,void *value)
+{
+    unsigned int b = hashindex_hash(key) % size;
+    struct HashIndexItem *item = new HashIndexItem();
+    item->key = strdup(key);
+    item->value = value;
+    item->n = table[b];
+    table[b] = item;
+    ++items;
+}
+
+/* Parses size values like 4096, 64k, 4M, 1G */
+unsigned long long parsesize(const char *str)
+{
+    char *end;
+    unsigned long long v = strtoull(str,&end,10);
+    if(*end == 'k' || *end == 'K')
+        v *= 1024;
+    if(*end == 'm' || *end == 'M')
+        v *= 1024 * 1024;
+    if(*end == 'g' || *end == 'G')
+        v *= 1024 * 1024 * 1024;
+    return v;
+}
+
+/* Generates a cheap fingerprint of a file by hashing the head, the tail and some strided
+   blocks between them. Two files with different fingerprint surely differ, the matching
+   fingerprint is only a hint: the full hash have to be compared too.
+   Gives empty string if the file is too small to worth it. */
+int getfingerprint(const char *fullpath,char *hexfp,int hashmode,int needprefix)
+{
+    FILE *f;
+    struct stat st;
+
+    hexfp[0] = '\0';
+    if(hashmode == HASH_EMPTY)
+        return 0;
+
+    f = fopen(fullpath,"rb");
+    if(f == NULL)
+        return 1;
+    if(fstat(fileno(f),&st) != 0)
+    {
+        fclose(f);
+        return 1;
+    }
+    if(st.st_size < FPRINT_MINSIZE)
+    {
+        fclose(f);
+        return 0;
+    }
+
+    unsigned char *buff = new unsigned char[FPRINT_HEADTAIL];
+    off_t offsets[FPRINT_STRIDES + 2];
+    size_t lengths[FPRINT_STRIDES + 2];
+    int i,count=0;
+
+    offsets[count] = 0;
+    lengths[count++] = FPRINT_HEADTAIL;
+    for(i = 1 ; i <= FPRINT_STRIDES ; ++i)
+    {
+        offsets[count] = (st.st_size / (FPRINT_STRIDES + 1)) * i;
+        lengths[count++] = FPRINT_BLOCK;
+    }
+    offsets[count] = st.st_size - FPRINT_HEADTAIL;
+    lengths[count++] = FPRINT_HEADTAIL;
+
+    Hasher hasher(hashmode);
+    for(i = 0 ; i < count ; ++i)
+    {
+        size_t n;
+        Throttle::consume(THROTTLE_READ,lengths[i]);
+        if(fseeko(f,offsets[i],SEEK_SET) != 0 || (n = fread(buff,1,lengths[i],f)) != lengths[i])
         {
-            hexhash[idx++] = dtoh((hash[i] & 240) >> 4);
-            hexhash[idx++] = dtoh(hash[i] & 15);
+            delete[] buff;
+            fclose(f);
+            return 1;
         }
-        hexhash[idx] = '\0';
+        hasher.update(buff,n);
+    }
+    hasher.final(hexfp,0);
+    if(needprefix)
+    {
+        memmove(hexfp+3,hexfp,strlen(hexfp)+1);
+        memcpy(hexfp,"FP:",3);
     }
 
+    delete[] buff;
     fclose(f);
     return 0;
 }
@@ -17,7 +17,76 @@ char *unifypath(char *path);
 char *chop(char *str);
 int my_dtoa(double v,char *buffer,int bufflen,int min,int max,int group);
 int gethash(const char *fullpath,char *hexhash,int hashmode=HASH_SHA256,int needprefix = 1);
+int getfingerprint(const char *fullpath,char *hexfp,int hashmode=HASH_SHA256,int needprefix = 1);
+int getblockhashes(const char *fullpath,char *hexhash,int hashmode,unsigned int blocksize,
+                   char **blockhashes,unsigned int *blockcount,int needprefix = 1);
+unsigned long long parsesize(const char *str);
 char read_and_echo_character();
+#ifndef _WIN32
+struct stat;
+int issparse(const struct stat *st);
+#endif
+
+/* Sampled fingerprint: head and tail blocks plus some strided blocks between them.
+   Files smaller than FPRINT_MINSIZE don't get fingerprint, the full hash is cheap enough. */
+#define FPRINT_MINSIZE      (1024*1024)
+#define FPRINT_HEADTAIL     65536
+#define FPRINT_BLOCK        32768
+#define FPRINT_STRIDES      6
+
+class Hasher
+{
+public:
+    Hasher(int hashmode);
+    ~Hasher(void);
+    void update(const unsigned char *data,unsigned int len);
+    void update_zeros(unsigned long long len);
+    void final(char *hexhash,int needprefix = 1);
+
+private:
+    int mode;
+    void *ctx;
+};
+
+/* Content defined chunking (gear rolling hash) */
+#define CHUNK_MIN_DEFAULT   16384
+#define CHUNK_AVG_DEFAULT   65536
+#define CHUNK_MAX_DEFAULT   262144
+
+struct ChunkInfo
+{
+    unsigned long long offset;
+    unsigned int length;
+    char hash[80]; //sha256 of the chunk data without prefix
+};
+
+typedef int (*ChunkCallback)(const struct ChunkInfo *chunk,const unsigned char *data,void *param);
+
+int chunkfile(const char *fullpath,unsigned int minsize,unsigned int avgsize,unsigned int maxsize,
+              ChunkCallback callback,void *param);
+
+/* Simple string keyed hash table, the values are not owned by the table */
+struct HashIndexItem
+{
+    char *key;
+    void *value;
+    struct HashIndexItem *n;
+};
+
+class HashIndex
+{
+public:
+    HashIndex(unsigned int buckets = 65536);
+    ~HashIndex(void);
+    void *find(const char *key);
+    void add(const char *key,void *value);
+    unsigned int count(void) { return items; }
+
+private:
+    struct HashIndexItem **table;
+    unsigned int size;
+    unsigned int items;
+};
 
 struct PathMakerCacheItem
 {
@@ -35,24 +104,99 @@ private:
     static struct PathMakerCacheItem* cache;
 };
 
+#define COPY_BUFFSIZE       131072
+#define FANOUT_BUFFSIZE     (1024*1024)
+
+#define COPYMETHOD_UNKNOWN      0
+#define COPYMETHOD_CLONE        1
+#define COPYMETHOD_RANGE        2
+#define COPYMETHOD_SENDFILE     3
+#define COPYMETHOD_READWRITE    4
+
+/* Split copy of big files: the workers take SPLITCOPY_PIECE sized ranges one after another */
+#define SPLITCOPY_PIECE         (32*1024*1024)
+#define SPLITCOPY_JOBS_DEFAULT  4
+
+/* The targets bigger than PREALLOC_MINSIZE are allocated in one piece before the copy.
+   With -direct the targets bigger than DIRECTIO_MINSIZE are written with O_DIRECT */
+#define PREALLOC_MINSIZE        (1024*1024)
+#define DIRECTIO_MINSIZE        (4*1024*1024)
+#define DIRECTIO_ALIGN          4096
+#define DIRECTIO_BUFFSIZE       (1024*1024)
+
+/* The working copy method between two filesystems (source dev -> target dev) */
+struct CopyMethodCacheItem
+{
+    unsigned long long sdev,ddev;
+    int method;
+    struct CopyMethodCacheItem* n;
+};
+
+struct cItem;
+
+/* Atomic copy: the file is written to a temporary name beside the target and renamed into place */
+#define ATOMIC_TMPSUFFIX    ".unisync-tmp"
+
+/* Renames which wait for the next durable batch (-atomic=N) */
+struct PendingRename
+{
+    char tmp[512];
+    char dest[512];
+    struct PendingRename *n;
+};
+
 class FileCopier
 {
 public:
-    static double ckbytes;
+    double ckbytes;
     time_t ts,te;
 
     FileCopier(UniSyncConfig *ucp);
-    int copy(const char *source,const char *dest);
+    ~FileCopier(void);
+    int copy(const char *source,const char *dest,struct cItem *item = NULL);
+    int tempname(const char *dest,char *tmp);
+    int commit_file(const char *tmp,const char *dest);
+    int commit(bool final);
+    int syncentry(const char *path);
+    int syncdest(const char *path);
     int copy_std(const char *source,const char *dest);
     int copy_spec(const char *source,const char *dest);
+    int copy_verify(const char *source,const char *dest,struct cItem *item);
     int fixtime(const char *source,const char *dest);
     void resetCounters(void);
+    void addCounters(FileCopier *other);
     void printStatistics();
     int deletefile(const char *path);
     int deletefolder(const char *path);
+    int movefile(const char *from,const char *to);
+    int linkfile(const char *existing,const char *dest);
+    int unshare(const char *path);
+    int clonefile(const char *existing,const char *dest,const char *source,struct cItem *item = NULL);
+#ifndef _WIN32
+    long long copy_data(int srcfd,int dstfd,unsigned long long size);
+    long long copy_data_split(int srcfd,int dstfd,unsigned long long size);
+    long long copy_data_sparse(int srcfd,int dstfd,unsigned long long size);
+    long long copy_data_direct(int srcfd,int dstfd,unsigned long long size);
+    long long copy_into(int srcfd,const struct stat *s_st,int dstdirfd,const char *dstname,int *dstfd);
+    int copy_at(int srcdirfd,int dstdirfd,const char *name,const char *sourcedir);
+    long long copy_checkpointed(int srcfd,const struct stat *s_st,const char *dest,int *dstfd);
+    int copy_fanout(const char *source,const char * const *dests,int count);
+#endif
 
 private:
     UniSyncConfig *uc;
+    struct PendingRename *pending;
+    unsigned int pendingcount;
+    char lastdest[512];         //The last renamed file, its filesystem is synced by the final commit
+
+    int copy_file(const char *source,const char *dest,struct cItem *item);
+    int syncfile(const char *path);
+    bool journaled(char kind,const char *path);
+    int  record(char kind,const char *path,int result);
+
+    static struct CopyMethodCacheItem* methodcache;
+    static int  getCopyMethod(unsigned long long sdev,unsigned long long ddev);
+    static void setCopyMethod(unsigned long long sdev,unsigned long long ddev,int method);
 };
 
 #endif // UNISYNC_UTILS_H